@@ -0,0 +1,285 @@
+/*
+ * Microbenchmarks of statsd-router hot path: hashing, routing and packing of lines.
+ *
+ * Data thread is emulated in-process: downstreams are always alive, event loop is never
+ * run and filled buffers are released as if they were sent, so no network I/O is done.
+ */
+
+#include "../sr-main.h"
+
+// how long each case runs, seconds
+#define BENCH_TIME 0.2
+// number of distinct lines in each case
+#define BENCH_LINES 4096
+
+struct bench_line_s {
+    char *line;
+    int length;
+    int name_length;
+    unsigned long hash;
+};
+
+struct bench_s {
+    struct sr_config_s config;
+    struct thread_config_s *thread_config;
+    struct ds_health_client_s *health_client;
+    struct downstream_s *downstream;
+    struct ds_socket_out_s socket_out;
+    struct ev_loop *loop;
+    int downstream_num;
+    struct bench_line_s line[BENCH_LINES];
+    // datagrams packed with the same lines, each has spare byte after data
+    char *datagram[BENCH_LINES];
+    int datagram_length[BENCH_LINES];
+    int datagram_lines[BENCH_LINES];
+    int datagram_num;
+};
+
+static int downstream_nums[] = {3, 50, 500};
+static int name_lengths[] = {16, 64, 200};
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// this function releases queued buffers as if socket sent them
+static void bench_drain(struct bench_s *bench) {
+    struct downstream_s *ds;
+    struct ds_buffer_s *buffer;
+
+    while ((ds = bench->socket_out.flush_queue_head) != NULL) {
+        while ((buffer = ds->ready_head) != NULL) {
+            ds->ready_head = buffer->next;
+            ds_buffer_free(ds->pool, buffer);
+        }
+        ds->ready_tail = NULL;
+        ds->ready_num = 0;
+        ds->flush_queued = 0;
+        bench->socket_out.flush_queue_head = ds->flush_queue_next;
+        ds->flush_queue_next = NULL;
+    }
+    bench->socket_out.flush_queue_tail = NULL;
+    ev_io_stop(bench->loop, (struct ev_io *)&(bench->socket_out));
+}
+
+// this function creates synthetic lines with names of given length and datagrams packed with them
+static int bench_lines(struct bench_s *bench, int name_length) {
+    char *p;
+    int length;
+    int i;
+    int n;
+
+    for (i = 0; i < BENCH_LINES; i++) {
+        p = (char *)malloc(name_length + 32);
+        if (p == NULL) {
+            return 1;
+        }
+        n = snprintf(p, name_length + 1, "bench.%d.", i);
+        memset(p + n, 'x', name_length - n);
+        length = name_length + sprintf(p + name_length, ":%d|c\n", i);
+        bench->line[i].line = p;
+        bench->line[i].length = length;
+        bench->line[i].name_length = name_length;
+        bench->line[i].hash = hash(p, name_length);
+    }
+    bench->datagram_num = 0;
+    for (i = 0; i < BENCH_LINES; i++) {
+        if (bench->datagram_num == 0 || bench->datagram_length[bench->datagram_num - 1] + bench->line[i].length > DOWNSTREAM_BUF_SIZE) {
+            bench->datagram[bench->datagram_num] = (char *)malloc(DOWNSTREAM_BUF_SIZE + 1);
+            if (bench->datagram[bench->datagram_num] == NULL) {
+                return 1;
+            }
+            bench->datagram_length[bench->datagram_num] = 0;
+            bench->datagram_lines[bench->datagram_num] = 0;
+            bench->datagram_num++;
+        }
+        n = bench->datagram_num - 1;
+        memcpy(bench->datagram[n] + bench->datagram_length[n], bench->line[i].line, bench->line[i].length);
+        bench->datagram_length[n] += bench->line[i].length;
+        bench->datagram_lines[n]++;
+    }
+    return 0;
+}
+
+static void bench_free_lines(struct bench_s *bench) {
+    int i;
+
+    for (i = 0; i < BENCH_LINES; i++) {
+        free(bench->line[i].line);
+    }
+    for (i = 0; i < bench->datagram_num; i++) {
+        free(bench->datagram[i]);
+    }
+}
+
+// this function sets up single data thread with given number of alive downstreams
+static int bench_init(struct bench_s *bench, int downstream_num, enum routing_mode_e mode) {
+    int i;
+
+    memset(&(bench->config), 0, sizeof(bench->config));
+    bench->downstream_num = downstream_num;
+    bench->config.threads_num = 1;
+    bench->config.downstream_num = downstream_num;
+    bench->config.downstream_packet_size = DOWNSTREAM_BUF_SIZE;
+    bench->config.downstream_gso_segments = 1;
+    bench->config.buffer_memory_limit = BUFFER_MEMORY_LIMIT;
+    bench->health_client = (struct ds_health_client_s *)calloc(downstream_num, sizeof(struct ds_health_client_s));
+    bench->downstream = (struct downstream_s *)calloc(downstream_num, sizeof(struct downstream_s));
+    if (bench->health_client == NULL || bench->downstream == NULL
+        || posix_memalign((void **)&(bench->thread_config), CACHE_LINE_SIZE, sizeof(struct thread_config_s)) != 0) {
+        return 1;
+    }
+    for (i = 0; i < downstream_num; i++) {
+        (bench->health_client + i)->id = i;
+        (bench->health_client + i)->alive = 1;
+    }
+    if (init_routing(&(bench->config.routing), mode, ROUTING_TABLE_SIZE, downstream_num, bench->health_client) != 0) {
+        return 1;
+    }
+    memset(bench->thread_config, 0, sizeof(struct thread_config_s));
+    bench->thread_config->common = &(bench->config);
+    bench->loop = ev_loop_new(0);
+    ev_set_userdata(bench->loop, bench->thread_config);
+    bench->thread_config->loop = bench->loop;
+    init_buffer_pool(&(bench->thread_config->buffer_pool), DOWNSTREAM_BUF_SIZE, DOWNSTREAM_BUF_SIZE, BUFFER_POOL_SIZE,
+        &(bench->config.buffer_memory), bench->config.buffer_memory_limit);
+    // socket is never polled, loop isn't run
+    ev_io_init((struct ev_io *)&(bench->socket_out), ds_flush_cb, socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP), EV_WRITE);
+    bench->socket_out.flush_queue_head = NULL;
+    bench->socket_out.flush_queue_tail = NULL;
+    bench->socket_out.uring = NULL;
+    for (i = 0; i < downstream_num; i++) {
+        (bench->downstream + i)->pool = &(bench->thread_config->buffer_pool);
+        (bench->downstream + i)->overflow_policy = BUFFER_OVERFLOW_DROP_NEW;
+        (bench->downstream + i)->health_client = bench->health_client + i;
+        (bench->downstream + i)->socket_out = &(bench->socket_out);
+    }
+    bench->thread_config->downstream = bench->downstream;
+    return 0;
+}
+
+static void bench_cleanup(struct bench_s *bench) {
+    struct ds_buffer_s *buffer;
+    int i;
+
+    bench_drain(bench);
+    for (i = 0; i < bench->downstream_num; i++) {
+        if ((buffer = (bench->downstream + i)->active_buffer) != NULL) {
+            ds_buffer_free(&(bench->thread_config->buffer_pool), buffer);
+        }
+    }
+    close(bench->socket_out.super.fd);
+    ev_loop_destroy(bench->loop);
+    free(bench->config.routing.table[0]);
+    free(bench->config.routing.table[1]);
+    free(bench->health_client);
+    free(bench->downstream);
+    free(bench->thread_config);
+}
+
+enum bench_case_e {
+    BENCH_HASH,
+    BENCH_FIND_DOWNSTREAM,
+    BENCH_PROCESS_DATA_LINE,
+    BENCH_PUSH_TO_DOWNSTREAM,
+    BENCH_PROCESS_DATAGRAM
+};
+
+// this function runs single case over all synthetic lines until BENCH_TIME passes, returns ns per line
+static double bench_run(struct bench_s *bench, enum bench_case_e bench_case) {
+    struct bench_line_s *l;
+    unsigned long h = 0;
+    double start = now();
+    double elapsed;
+    long lines = 0;
+    int i;
+
+    do {
+        switch (bench_case) {
+        case BENCH_HASH:
+            for (i = 0; i < BENCH_LINES; i++) {
+                h ^= hash(bench->line[i].line, bench->line[i].name_length);
+            }
+            break;
+        case BENCH_FIND_DOWNSTREAM:
+            for (i = 0; i < BENCH_LINES; i++) {
+                l = bench->line + i;
+                find_downstream(l->line, l->hash, l->length, bench->downstream_num, bench->downstream, bench->loop);
+            }
+            break;
+        case BENCH_PROCESS_DATA_LINE:
+            for (i = 0; i < BENCH_LINES; i++) {
+                l = bench->line + i;
+                process_data_line(l->line, l->length, l->name_length, bench->downstream_num, bench->downstream, bench->loop);
+            }
+            break;
+        case BENCH_PUSH_TO_DOWNSTREAM:
+            for (i = 0; i < BENCH_LINES; i++) {
+                l = bench->line + i;
+                push_to_downstream(bench->downstream + i % bench->downstream_num, l->line, l->length, bench->loop);
+            }
+            break;
+        case BENCH_PROCESS_DATAGRAM:
+            for (i = 0; i < bench->datagram_num; i++) {
+                process_datagram(bench->datagram[i], bench->datagram_length[i], bench->downstream_num, bench->downstream, bench->loop);
+            }
+            break;
+        }
+        bench_drain(bench);
+        lines += BENCH_LINES;
+        elapsed = now() - start;
+    } while (elapsed < BENCH_TIME);
+    // result is used, so compiler can't drop hashing
+    if (h == 1) {
+        fprintf(stderr, "%lx\n", h);
+    }
+    return elapsed * 1e9 / lines;
+}
+
+static void bench_report(char *name, char *routing, int downstream_num, int name_length, double ns) {
+    fprintf(stdout, "%-20s %-7s %11d %11d %10.1f %14.0f\n", name, routing, downstream_num, name_length, ns, 1e9 / ns);
+}
+
+int main(int argc, char *argv[]) {
+    static struct bench_s bench;
+    static char *routing_name[] = {"compat", "table"};
+    enum routing_mode_e routing_mode[] = {ROUTING_MODE_COMPAT, ROUTING_MODE_TABLE};
+    int i;
+    int j;
+    int k;
+
+    log_level = ERROR;
+    init_scan();
+    fprintf(stdout, "%-20s %-7s %11s %11s %10s %14s\n", "benchmark", "routing", "downstreams", "name_length", "ns/line", "lines/s");
+    for (j = 0; j < ARRAY_SIZE(name_lengths); j++) {
+        if (bench_init(&bench, downstream_nums[0], ROUTING_MODE_COMPAT) != 0 || bench_lines(&bench, name_lengths[j]) != 0) {
+            log_msg(ERROR, "%s: benchmark setup failed", __func__);
+            return 1;
+        }
+        bench_report("hash", "-", 0, name_lengths[j], bench_run(&bench, BENCH_HASH));
+        bench_cleanup(&bench);
+        bench_free_lines(&bench);
+    }
+    for (k = 0; k < ARRAY_SIZE(routing_mode); k++) {
+        for (i = 0; i < ARRAY_SIZE(downstream_nums); i++) {
+            for (j = 0; j < ARRAY_SIZE(name_lengths); j++) {
+                if (bench_init(&bench, downstream_nums[i], routing_mode[k]) != 0 || bench_lines(&bench, name_lengths[j]) != 0) {
+                    log_msg(ERROR, "%s: benchmark setup failed", __func__);
+                    return 1;
+                }
+                bench_report("find_downstream", routing_name[k], downstream_nums[i], name_lengths[j], bench_run(&bench, BENCH_FIND_DOWNSTREAM));
+                bench_report("process_data_line", routing_name[k], downstream_nums[i], name_lengths[j], bench_run(&bench, BENCH_PROCESS_DATA_LINE));
+                bench_report("push_to_downstream", routing_name[k], downstream_nums[i], name_lengths[j], bench_run(&bench, BENCH_PUSH_TO_DOWNSTREAM));
+                bench_report("process_datagram", routing_name[k], downstream_nums[i], name_lengths[j], bench_run(&bench, BENCH_PROCESS_DATAGRAM));
+                bench_cleanup(&bench);
+                bench_free_lines(&bench);
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,268 @@
+#include "sr-main.h"
+#include <math.h>
+
+// this function allocates per thread aggregation state
+struct aggregation_s *init_aggregation(int basic, int timers, int table_size, int arena_size, int line_size) {
+    struct aggregation_s *aggregation;
+    int capacity = 1;
+
+    // open addressing table is kept at most half full
+    while (capacity < 2 * table_size) {
+        capacity <<= 1;
+    }
+    aggregation = (struct aggregation_s *)malloc(sizeof(struct aggregation_s));
+    if (aggregation == NULL) {
+        log_msg(ERROR, "%s: malloc() failed %s", __func__, strerror(errno));
+        return NULL;
+    }
+    aggregation->basic = basic;
+    aggregation->timers = timers;
+    aggregation->capacity = capacity;
+    aggregation->max_entries = table_size;
+    aggregation->entry = (struct aggregation_entry_s *)calloc(capacity, sizeof(struct aggregation_entry_s));
+    aggregation->used_slot = (int *)malloc(table_size * sizeof(int));
+    aggregation->used_num = 0;
+    aggregation->arena = (char *)malloc(arena_size);
+    aggregation->arena_size = arena_size;
+    aggregation->arena_length = 0;
+    aggregation->input_counter = 0;
+    aggregation->output_counter = 0;
+    aggregation->line_size = line_size;
+    aggregation->line_buffer = (char *)malloc(line_size);
+    if (aggregation->entry == NULL || aggregation->used_slot == NULL || aggregation->arena == NULL || aggregation->line_buffer == NULL) {
+        log_msg(ERROR, "%s: malloc() failed %s", __func__, strerror(errno));
+        return NULL;
+    }
+    return aggregation;
+}
+
+// this function finds entry for given key or creates new one, NULL if table or arena is full
+static struct aggregation_entry_s *find_entry(struct aggregation_s *aggregation, enum aggregation_type_e type, char *name, int name_length, unsigned long name_hash, char *member, int member_length) {
+    struct aggregation_entry_s *entry;
+    // sets are keyed by name and member, timers by name and sample rate, other types by name only
+    unsigned long key_hash = name_hash * 31 + type;
+    int slot;
+
+    if (member_length > 0) {
+        key_hash = key_hash * 31 + hash(member, member_length);
+    }
+    slot = key_hash & (aggregation->capacity - 1);
+    while ((entry = aggregation->entry + slot)->name != NULL) {
+        if (entry->key_hash == key_hash && entry->type == type
+            && entry->name_length == name_length && entry->member_length == member_length
+            && memcmp(entry->name, name, name_length) == 0
+            && memcmp(entry->member, member, member_length) == 0) {
+            return entry;
+        }
+        slot = (slot + 1) & (aggregation->capacity - 1);
+    }
+    if (aggregation->used_num == aggregation->max_entries || aggregation->arena_length + name_length + member_length > aggregation->arena_size) {
+        return NULL;
+    }
+    entry->name = aggregation->arena + aggregation->arena_length;
+    memcpy(entry->name, name, name_length);
+    entry->member = entry->name + name_length;
+    memcpy(entry->member, member, member_length);
+    aggregation->arena_length += name_length + member_length;
+    entry->name_length = name_length;
+    entry->member_length = member_length;
+    entry->name_hash = name_hash;
+    entry->key_hash = key_hash;
+    entry->type = type;
+    entry->gauge_absolute = 0;
+    entry->value = 0.0;
+    entry->sample_head = NULL;
+    entry->sample_tail = NULL;
+    *(aggregation->used_slot + aggregation->used_num++) = slot;
+    return entry;
+}
+
+// this function appends timer value to entry, returns 1 if arena is full
+static int append_sample(struct aggregation_s *aggregation, struct aggregation_entry_s *entry, char *value, int value_length) {
+    struct aggregation_sample_s *sample;
+    // samples are aligned in arena
+    int offset = (aggregation->arena_length + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+    if (offset + sizeof(struct aggregation_sample_s) + value_length > aggregation->arena_size) {
+        return 1;
+    }
+    sample = (struct aggregation_sample_s *)(aggregation->arena + offset);
+    sample->next = NULL;
+    sample->length = value_length;
+    memcpy(sample->value, value, value_length);
+    aggregation->arena_length = offset + sizeof(struct aggregation_sample_s) + value_length;
+    if (entry->sample_tail != NULL) {
+        entry->sample_tail->next = sample;
+    } else {
+        entry->sample_head = sample;
+    }
+    entry->sample_tail = sample;
+    return 0;
+}
+
+// this function folds metrics line into aggregation table
+// line format is name:value|type[|@rate]\n, returns 1 if line can't be aggregated and should be passed as is
+int aggregate_line(struct aggregation_s *aggregation, char *line, int length, int name_length, unsigned long name_hash) {
+    struct aggregation_entry_s *entry;
+    char *value = line + name_length + 1;
+    char *end = line + length - 1;
+    char *type;
+    char *rate;
+    char *endptr;
+    char *member = value;
+    int member_length = 0;
+    int type_length;
+    double v = 0.0;
+    double r = 1.0;
+    enum aggregation_type_e t;
+
+    type = memchr(value, '|', end - value);
+    if (type == NULL || type == value) {
+        return 1;
+    }
+    type++;
+    // only single value lines are supported, everything except sample rate makes line opaque
+    rate = memchr(type, '|', end - type);
+    type_length = ((rate == NULL) ? end : rate) - type;
+    if (rate != NULL) {
+        if (end - rate < 3 || *(rate + 1) != '@') {
+            return 1;
+        }
+        r = strtod(rate + 2, &endptr);
+        if (endptr != end || !(r > 0.0 && r <= 1.0)) {
+            return 1;
+        }
+    }
+    if (type_length == 1 && *type == 'c' && aggregation->basic) {
+        t = AGGREGATION_COUNTER;
+    } else if (type_length == 1 && *type == 'g' && rate == NULL && aggregation->basic) {
+        t = AGGREGATION_GAUGE;
+    } else if (type_length == 1 && *type == 's' && rate == NULL && aggregation->basic) {
+        t = AGGREGATION_SET;
+        member_length = type - 1 - value;
+    } else if (type_length == 2 && *type == 'm' && *(type + 1) == 's' && aggregation->timers) {
+        t = AGGREGATION_TIMER;
+    } else if (type_length == 1 && *type == 'h' && aggregation->timers) {
+        t = AGGREGATION_HISTOGRAM;
+    } else {
+        return 1;
+    }
+    if (t != AGGREGATION_SET) {
+        v = strtod(value, &endptr);
+        if (endptr != type - 1 || !isfinite(v)) {
+            return 1;
+        }
+    }
+    if ((t == AGGREGATION_TIMER || t == AGGREGATION_HISTOGRAM) && rate != NULL) {
+        // samples with different rates are packed separately, rate is kept as is
+        member = rate;
+        member_length = end - rate;
+    }
+    entry = find_entry(aggregation, t, line, name_length, name_hash, member, member_length);
+    if (entry == NULL) {
+        return 1;
+    }
+    switch (t) {
+        case AGGREGATION_COUNTER:
+            entry->value += v / r;
+            break;
+        case AGGREGATION_GAUGE:
+            // gauge with explicit sign is relative
+            if (*value == '+' || *value == '-') {
+                entry->value += v;
+            } else {
+                entry->value = v;
+                entry->gauge_absolute = 1;
+            }
+            break;
+        case AGGREGATION_TIMER:
+        case AGGREGATION_HISTOGRAM:
+            if (append_sample(aggregation, entry, value, type - 1 - value) != 0) {
+                return 1;
+            }
+            break;
+        default:
+            break;
+    }
+    aggregation->input_counter++;
+    return 0;
+}
+
+// this function packs timer samples into multi value lines name:v1|ms:v2|ms..., each line fits into downstream buffer
+static void flush_samples(struct aggregation_s *aggregation, struct aggregation_entry_s *entry, int downstream_num, struct downstream_s *downstream, struct ev_loop *loop) {
+    struct aggregation_sample_s *sample;
+    char *buffer = aggregation->line_buffer;
+    char *type = (entry->type == AGGREGATION_TIMER) ? "ms" : "h";
+    int n = 0;
+    int l;
+
+    for (sample = entry->sample_head; sample != NULL; sample = sample->next) {
+        // room for separator, value, type, rate and new line
+        l = 1 + sample->length + 1 + strlen(type) + entry->member_length + 1;
+        if (n > 0 && n + l > aggregation->line_size - 1) {
+            buffer[n++] = '\n';
+            find_downstream(buffer, entry->name_hash, n, downstream_num, downstream, loop);
+            aggregation->output_counter++;
+            n = 0;
+        }
+        if (n == 0) {
+            if (entry->name_length + l > aggregation->line_size - 1) {
+                log_msg(WARN, "%s: aggregated metric %.*s is too long", __func__, entry->name_length, entry->name);
+                continue;
+            }
+            memcpy(buffer, entry->name, entry->name_length);
+            n = entry->name_length;
+        }
+        n += sprintf(buffer + n, ":%.*s|%s%.*s", sample->length, sample->value, type, entry->member_length, entry->member);
+    }
+    if (n > 0) {
+        buffer[n++] = '\n';
+        find_downstream(buffer, entry->name_hash, n, downstream_num, downstream, loop);
+        aggregation->output_counter++;
+    }
+}
+
+// this function pushes aggregated metrics to downstreams and resets aggregation table
+void flush_aggregation(struct aggregation_s *aggregation, int downstream_num, struct downstream_s *downstream, struct ev_loop *loop) {
+    struct aggregation_entry_s *entry;
+    char *buffer = aggregation->line_buffer;
+    int i;
+    int n;
+
+    for (i = 0; i < aggregation->used_num; i++) {
+        entry = aggregation->entry + *(aggregation->used_slot + i);
+        n = -1;
+        switch (entry->type) {
+            case AGGREGATION_COUNTER:
+                n = snprintf(buffer, aggregation->line_size, "%.*s:%.15g|c\n", entry->name_length, entry->name, entry->value);
+                break;
+            case AGGREGATION_GAUGE:
+                if (!entry->gauge_absolute) {
+                    n = snprintf(buffer, aggregation->line_size, "%.*s:%+.15g|g\n", entry->name_length, entry->name, entry->value);
+                } else if (entry->value < 0.0) {
+                    // negative value would be treated by statsd as relative, so gauge is reset first
+                    n = snprintf(buffer, aggregation->line_size, "%.*s:0|g\n%.*s:%.15g|g\n", entry->name_length, entry->name, entry->name_length, entry->name, entry->value);
+                } else {
+                    n = snprintf(buffer, aggregation->line_size, "%.*s:%.15g|g\n", entry->name_length, entry->name, entry->value);
+                }
+                break;
+            case AGGREGATION_SET:
+                n = snprintf(buffer, aggregation->line_size, "%.*s:%.*s|s\n", entry->name_length, entry->name, entry->member_length, entry->member);
+                break;
+            case AGGREGATION_TIMER:
+            case AGGREGATION_HISTOGRAM:
+                flush_samples(aggregation, entry, downstream_num, downstream, loop);
+                entry->name = NULL;
+                continue;
+        }
+        if (n > 0 && n < aggregation->line_size) {
+            find_downstream(buffer, entry->name_hash, n, downstream_num, downstream, loop);
+            aggregation->output_counter++;
+        } else {
+            log_msg(WARN, "%s: aggregated metric %.*s is too long", __func__, entry->name_length, entry->name);
+        }
+        entry->name = NULL;
+    }
+    aggregation->used_num = 0;
+    aggregation->arena_length = 0;
+}
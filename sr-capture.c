@@ -0,0 +1,292 @@
+#include "sr-main.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// this function creates capture file and maps it into memory
+// file is created with its full size, so data threads never resize it
+int init_capture(struct sr_config_s *config) {
+    struct capture_s *capture;
+    int fd;
+
+    capture = (struct capture_s *)malloc(sizeof(struct capture_s));
+    if (capture == NULL) {
+        log_msg(ERROR, "%s: malloc() failed", __func__);
+        return 1;
+    }
+    fd = open(config->capture_file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        log_msg(ERROR, "%s: open() of %s failed %s", __func__, config->capture_file, strerror(errno));
+        return 1;
+    }
+    if (ftruncate(fd, config->capture_size) != 0) {
+        log_msg(ERROR, "%s: ftruncate() failed %s", __func__, strerror(errno));
+        close(fd);
+        return 1;
+    }
+    capture->header = (struct capture_header_s *)mmap(NULL, config->capture_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (capture->header == MAP_FAILED) {
+        log_msg(ERROR, "%s: mmap() failed %s", __func__, strerror(errno));
+        return 1;
+    }
+    memcpy(capture->header->magic, CAPTURE_MAGIC, sizeof(capture->header->magic));
+    capture->header->end = sizeof(struct capture_header_s);
+    capture->size = config->capture_size;
+    capture->full = 0;
+    config->capture = capture;
+    log_msg(INFO, "%s: capturing datagrams to %s", __func__, config->capture_file);
+    return 0;
+}
+
+// this function appends datagram to capture file
+// space is reserved by moving end of file, length is stored last, so reader never sees partially written record
+void capture_datagram(struct capture_s *capture, int thread, char *buffer, int length, long time) {
+    struct capture_record_s *record;
+    long size = CAPTURE_RECORD_SIZE(length);
+    long end;
+
+    if (length <= 0 || __atomic_load_n(&(capture->full), __ATOMIC_RELAXED)) {
+        return;
+    }
+    end = __atomic_load_n(&(capture->header->end), __ATOMIC_RELAXED);
+    do {
+        if (end + size > capture->size) {
+            if (__atomic_exchange_n(&(capture->full), 1, __ATOMIC_RELAXED) == 0) {
+                log_msg(WARN, "%s: capture file is full, capture is stopped", __func__);
+            }
+            return;
+        }
+    } while (!__atomic_compare_exchange_n(&(capture->header->end), &end, end + size, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    record = (struct capture_record_s *)((char *)capture->header + end);
+    record->time = time;
+    record->thread = thread;
+    memcpy(record + 1, buffer, length);
+    __atomic_store_n(&(record->length), length, __ATOMIC_RELEASE);
+}
+
+// this function returns 1 while socket receive queue is at least half full
+static int replay_socket_busy(int fd) {
+    unsigned int meminfo[SK_MEMINFO_VARS];
+    socklen_t length = sizeof(meminfo);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_MEMINFO, meminfo, &length) != 0 || length <= SK_MEMINFO_RCVBUF * sizeof(unsigned int)) {
+        return 0;
+    }
+    return meminfo[SK_MEMINFO_RMEM_ALLOC] > meminfo[SK_MEMINFO_RCVBUF] / 2;
+}
+
+// this function returns 1 if receive queue of socket is empty
+static int replay_socket_empty(int fd) {
+    unsigned int meminfo[SK_MEMINFO_VARS];
+    socklen_t length = sizeof(meminfo);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_MEMINFO, meminfo, &length) != 0 || length <= SK_MEMINFO_RMEM_ALLOC * sizeof(unsigned int)) {
+        return 1;
+    }
+    return meminfo[SK_MEMINFO_RMEM_ALLOC] == 0;
+}
+
+static void replay_sleep(long ns) {
+    struct timespec ts;
+
+    ts.tv_sec = ns / 1000000000L;
+    ts.tv_nsec = ns % 1000000000L;
+    nanosleep(&ts, NULL);
+}
+
+// this function sends batch of datagrams to data threads
+// loopback drops datagrams if receiver is slow, so replay waits till receive queues have room, returns number of datagrams sent
+static int replay_send(struct sr_config_s *config, struct mmsghdr *msg, int n) {
+    int sent = 0;
+    int rc;
+    int i;
+
+    for (i = 0; i < config->threads_num; i++) {
+        while (replay_socket_busy((config->thread_config + i)->socket_in)) {
+            replay_sleep(REPLAY_WAIT_NS);
+        }
+    }
+    while (sent < n) {
+        rc = sendmmsg(config->replay->socket_out, msg + sent, n - sent, 0);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_msg(WARN, "%s: sendmmsg() failed %s", __func__, strerror(errno));
+            break;
+        }
+        sent += rc;
+    }
+    return sent;
+}
+
+// this function feeds capture file to data threads and stops router once all datagrams are routed
+// datagram is passed to the thread it was captured by, or to thread % threads_num if router has less threads
+static void *replay_thread(void *args) {
+    struct sr_config_s *config = (struct sr_config_s *)args;
+    struct replay_s *replay = config->replay;
+    struct mmsghdr msg[REPLAY_BATCH_SIZE];
+    struct iovec iov[REPLAY_BATCH_SIZE];
+    struct capture_record_s *record;
+    char *p = (char *)replay->header + sizeof(struct capture_header_s);
+    char *end = (char *)replay->header + replay->header->end;
+    long first_time = 0;
+    long start;
+    long elapsed;
+    long due;
+    long now;
+    long datagrams = 0;
+    long bytes = 0;
+    long lines = 0;
+    long kernel_drops = 0;
+    int n = 0;
+    int i;
+
+    memset(msg, 0, sizeof(msg));
+    start = latency_now();
+    while (p + sizeof(struct capture_record_s) <= end) {
+        record = (struct capture_record_s *)p;
+        // records reserved but not written by crashed router end the capture
+        if (record->length <= 0 || p + CAPTURE_RECORD_SIZE(record->length) > end) {
+            break;
+        }
+        if (datagrams + n == 0) {
+            first_time = record->time;
+        }
+        if (config->replay_speed > 0.0) {
+            due = start + (long)((record->time - first_time) / config->replay_speed);
+            if ((now = latency_now()) < due) {
+                // datagrams which are due are sent before waiting for the next one
+                if (n > 0) {
+                    datagrams += replay_send(config, msg, n);
+                    n = 0;
+                }
+                replay_sleep(due - now);
+            }
+        }
+        iov[n].iov_base = record + 1;
+        iov[n].iov_len = record->length;
+        msg[n].msg_hdr.msg_iov = iov + n;
+        msg[n].msg_hdr.msg_iovlen = 1;
+        msg[n].msg_hdr.msg_name = replay->addr + (record->thread % config->threads_num);
+        msg[n].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        bytes += record->length;
+        if (++n == REPLAY_BATCH_SIZE) {
+            datagrams += replay_send(config, msg, n);
+            n = 0;
+        }
+        p += CAPTURE_RECORD_SIZE(record->length);
+    }
+    if (n > 0) {
+        datagrams += replay_send(config, msg, n);
+    }
+    // data threads finish receive queues, then flush timer sends everything buffered
+    for (i = 0; i < config->threads_num; i++) {
+        while (!replay_socket_empty((config->thread_config + i)->socket_in)) {
+            replay_sleep(REPLAY_WAIT_NS);
+        }
+    }
+    elapsed = latency_now() - start;
+    replay_sleep((long)(2 * config->downstream_flush_interval * 1e9));
+    for (i = 0; i < config->threads_num; i++) {
+        lines += __atomic_load_n(&((config->thread_config + i)->stats.lines), __ATOMIC_RELAXED);
+        kernel_drops += __atomic_load_n(&((config->thread_config + i)->stats.kernel_drops), __ATOMIC_RELAXED);
+    }
+    log_msg(INFO, "%s: replayed %ld datagrams, %ld bytes, %ld lines in %.3f seconds: %.0f datagrams/s, %.0f lines/s, %ld kernel drops",
+        __func__, datagrams, bytes, lines, elapsed / 1e9, datagrams * 1e9 / elapsed, lines * 1e9 / elapsed, kernel_drops);
+    ev_async_send(replay->loop, &(replay->done_async));
+    return NULL;
+}
+
+// this function maps capture file and creates loopback sockets data threads receive replayed datagrams from
+// downstream health isn't checked during replay, so downstreams can be local sinks
+int init_replay(struct sr_config_s *config) {
+    struct replay_s *replay;
+    struct thread_config_s *thread_config;
+    struct stat st;
+    socklen_t length;
+    int rcvbuf = (config->socket_rcvbuf > 0) ? config->socket_rcvbuf : REPLAY_RCVBUF;
+    int optval = 1;
+    int fd;
+    int i;
+
+    replay = (struct replay_s *)malloc(sizeof(struct replay_s));
+    if (replay == NULL || (replay->addr = (struct sockaddr_in *)calloc(config->threads_num, sizeof(struct sockaddr_in))) == NULL) {
+        log_msg(ERROR, "%s: malloc() failed", __func__);
+        return 1;
+    }
+    fd = open(config->replay_file, O_RDONLY);
+    if (fd < 0) {
+        log_msg(ERROR, "%s: open() of %s failed %s", __func__, config->replay_file, strerror(errno));
+        return 1;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < sizeof(struct capture_header_s)) {
+        log_msg(ERROR, "%s: %s is not a capture file", __func__, config->replay_file);
+        close(fd);
+        return 1;
+    }
+    replay->size = st.st_size;
+    replay->header = (struct capture_header_s *)mmap(NULL, replay->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (replay->header == MAP_FAILED) {
+        log_msg(ERROR, "%s: mmap() failed %s", __func__, strerror(errno));
+        return 1;
+    }
+    if (memcmp(replay->header->magic, CAPTURE_MAGIC, sizeof(replay->header->magic)) != 0
+        || replay->header->end < sizeof(struct capture_header_s) || replay->header->end > replay->size) {
+        log_msg(ERROR, "%s: %s is not a capture file", __func__, config->replay_file);
+        return 1;
+    }
+    madvise(replay->header, replay->size, MADV_SEQUENTIAL);
+    for (i = 0; i < config->threads_num; i++) {
+        thread_config = config->thread_config + i;
+        fd = socket(PF_INET, SOCK_DGRAM, 0);
+        if (fd < 0) {
+            log_msg(ERROR, "%s: socket() error %s", __func__, strerror(errno));
+            return 1;
+        }
+        if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(int)) != 0) {
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(int));
+        }
+        setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &optval, sizeof(optval));
+        (replay->addr + i)->sin_family = AF_INET;
+        (replay->addr + i)->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        length = sizeof(struct sockaddr_in);
+        if (bind(fd, (struct sockaddr *)(replay->addr + i), length) != 0
+            || getsockname(fd, (struct sockaddr *)(replay->addr + i), &length) != 0) {
+            log_msg(ERROR, "%s: bind() failed %s", __func__, strerror(errno));
+            return 1;
+        }
+        thread_config->socket_in = fd;
+    }
+    replay->socket_out = socket(PF_INET, SOCK_DGRAM, 0);
+    if (replay->socket_out < 0) {
+        log_msg(ERROR, "%s: socket() error %s", __func__, strerror(errno));
+        return 1;
+    }
+    for (i = 0; i < config->downstream_num; i++) {
+        (config->health_client + i)->alive = 1;
+    }
+    rebuild_routing(&(config->routing));
+    config->replay = replay;
+    return 0;
+}
+
+static void replay_done_cb(struct ev_loop *loop, struct ev_async *watcher, int revents) {
+    ev_break(loop, EVBREAK_ALL);
+}
+
+// this function starts replay thread, it's called once data threads are ready
+int start_replay(struct ev_loop *loop, struct sr_config_s *config) {
+    struct replay_s *replay = config->replay;
+
+    replay->loop = loop;
+    ev_async_init(&(replay->done_async), replay_done_cb);
+    ev_async_start(loop, &(replay->done_async));
+    log_msg(INFO, "%s: replaying %s", __func__, config->replay_file);
+    if (pthread_create(&(replay->thread), NULL, replay_thread, (void *)config) != 0) {
+        log_msg(ERROR, "%s: pthread_create() failed", __func__);
+        return 1;
+    }
+    return 0;
+}
@@ -2,9 +2,17 @@
 
 static void control_read_cb(struct ev_loop *loop, struct ev_io *watcher, int revents);
 
+// this function closes control connection and releases its watcher
+static void control_close(struct ev_io *watcher) {
+    close(watcher->fd);
+    free(((struct ev_io_control *)watcher)->stats_response);
+    free(watcher);
+}
+
 void control_write_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
-    char *response = ((struct ev_io_control *)watcher)->response;
-    int response_len = ((struct ev_io_control *)watcher)->response_len;
+    struct ev_io_control *control_watcher = (struct ev_io_control *)watcher;
+    char *response = control_watcher->response;
+    int response_len = control_watcher->response_len;
     int n;
 
     if (EV_ERROR & revents) {
@@ -12,10 +20,22 @@ void control_write_cb(struct ev_loop *loop, struct ev_io *watcher, int revents)
         return;
     }
 
-    ev_io_stop(loop, watcher);
     if (response_len > 0) {
         n = send(watcher->fd, response, response_len, 0);
+        // stats response can be too big for single send, rest is sent when socket is ready again
+        if (n > 0 && n < response_len) {
+            control_watcher->response += n;
+            control_watcher->response_len -= n;
+            return;
+        }
+        ev_io_stop(loop, watcher);
         if (n > 0) {
+            free(control_watcher->stats_response);
+            control_watcher->stats_response = NULL;
+            if (control_watcher->close_after_write) {
+                control_close(watcher);
+                return;
+            }
             ev_io_init(watcher, control_read_cb, watcher->fd, EV_READ);
             ev_io_start(loop, watcher);
             return;
@@ -23,10 +43,159 @@ void control_write_cb(struct ev_loop *loop, struct ev_io *watcher, int revents)
             log_msg(WARN, "%s: error while sending control response", __func__);
         }
     } else {
+        ev_io_stop(loop, watcher);
         log_msg(WARN, "%s: nothing to send", __func__);
     }
-    close(watcher->fd);
-    free(watcher);
+    control_close(watcher);
+}
+
+// stats served by control port, values are summed over threads for stats command
+static struct {
+    char *name;
+    char *help;
+    size_t offset;
+} stats_fields[] = {
+    {"datagrams", "Datagrams received", offsetof(struct thread_stats_s, datagrams)},
+    {"lines", "Lines parsed", offsetof(struct thread_stats_s, lines)},
+    {"invalid_lines", "Lines with invalid length or without metric name", offsetof(struct thread_stats_s, invalid_lines)},
+    {"dropped_lines", "Lines lost due to buffer overflow, memory limit, send errors or all downstreams being dead", offsetof(struct thread_stats_s, dropped_lines)},
+    {"bytes_sent", "Bytes sent to downstreams", offsetof(struct thread_stats_s, bytes_sent)},
+    {"packets_sent", "Packets sent to downstreams", offsetof(struct thread_stats_s, packets_sent)},
+    {"send_errors", "Failed sends to downstreams", offsetof(struct thread_stats_s, send_errors)},
+    {"kernel_drops", "Datagrams dropped by kernel since socket receive queue was full", offsetof(struct thread_stats_s, kernel_drops)},
+};
+
+#define STATS_FIELDS_NUM (sizeof(stats_fields) / sizeof(stats_fields[0]))
+
+// latency histograms served by control port, values are merged over threads
+static struct {
+    char *name;
+    char *help;
+    size_t offset;
+} latency_fields[] = {
+    {"send_latency", "Time line waits in router from receive till send to downstream", offsetof(struct thread_latency_s, send)},
+    {"read_time", "Time spent processing datagrams of single receive wakeup", offsetof(struct thread_latency_s, read)},
+};
+
+static double latency_percentiles[] = {50.0, 90.0, 99.0, 99.9};
+
+#define LATENCY_FIELDS_NUM (sizeof(latency_fields) / sizeof(latency_fields[0]))
+#define LATENCY_PERCENTILES_NUM (sizeof(latency_percentiles) / sizeof(latency_percentiles[0]))
+
+// this function reads stats field of thread, data thread may update it concurrently
+static long stats_value(struct thread_config_s *thread_config, int field) {
+    return __atomic_load_n((long *)((char *)&(thread_config->stats) + stats_fields[field].offset), __ATOMIC_RELAXED);
+}
+
+// this function merges latency histogram of all threads
+static void latency_total(struct sr_config_s *config, int field, struct latency_histogram_s *total) {
+    int j;
+
+    memset(total, 0, sizeof(struct latency_histogram_s));
+    for (j = 0; j < config->threads_num; j++) {
+        latency_add(total, (struct latency_histogram_s *)((char *)((config->thread_config + j)->latency) + latency_fields[field].offset));
+    }
+}
+
+// this function prints stats as name value lines: totals first, then per thread values
+static int format_stats(struct sr_config_s *config, char *buffer, int size) {
+    struct latency_histogram_s histogram;
+    long total;
+    int n = 0;
+    int i;
+    int j;
+
+    for (i = 0; i < STATS_FIELDS_NUM; i++) {
+        total = 0;
+        for (j = 0; j < config->threads_num; j++) {
+            total += stats_value(config->thread_config + j, i);
+        }
+        n += snprintf(buffer + n, size - n, "%s %ld\n", stats_fields[i].name, total);
+    }
+    for (j = 0; j < config->threads_num; j++) {
+        for (i = 0; i < STATS_FIELDS_NUM; i++) {
+            n += snprintf(buffer + n, size - n, "thread.%d.%s %ld\n", j, stats_fields[i].name, stats_value(config->thread_config + j, i));
+        }
+    }
+    for (i = 0; i < LATENCY_FIELDS_NUM && config->latency_histograms; i++) {
+        latency_total(config, i, &histogram);
+        n += snprintf(buffer + n, size - n, "%s_count %ld\n", latency_fields[i].name, histogram.count);
+        for (j = 0; j < LATENCY_PERCENTILES_NUM; j++) {
+            n += snprintf(buffer + n, size - n, "%s_p%g_us %ld\n", latency_fields[i].name, latency_percentiles[j],
+                latency_percentile(&histogram, latency_percentiles[j]));
+        }
+    }
+    return n;
+}
+
+// this function prints stats in prometheus text format, threads are distinguished by label
+static int format_prometheus_stats(struct sr_config_s *config, char *buffer, int size) {
+    struct latency_histogram_s histogram;
+    long count;
+    int n = 0;
+    int i;
+    int j;
+
+    for (i = 0; i < STATS_FIELDS_NUM; i++) {
+        n += snprintf(buffer + n, size - n, "# HELP %s%s_total %s\n# TYPE %s%s_total counter\n",
+            STATS_PROMETHEUS_PREFIX, stats_fields[i].name, stats_fields[i].help,
+            STATS_PROMETHEUS_PREFIX, stats_fields[i].name);
+        for (j = 0; j < config->threads_num; j++) {
+            n += snprintf(buffer + n, size - n, "%s%s_total{thread=\"%d\"} %ld\n",
+                STATS_PROMETHEUS_PREFIX, stats_fields[i].name, j, stats_value(config->thread_config + j, i));
+        }
+    }
+    // histogram buckets are cumulative, bucket i holds values below 2^i microseconds
+    for (i = 0; i < LATENCY_FIELDS_NUM && config->latency_histograms; i++) {
+        latency_total(config, i, &histogram);
+        n += snprintf(buffer + n, size - n, "# HELP %s%s_seconds %s\n# TYPE %s%s_seconds histogram\n",
+            STATS_PROMETHEUS_PREFIX, latency_fields[i].name, latency_fields[i].help,
+            STATS_PROMETHEUS_PREFIX, latency_fields[i].name);
+        count = 0;
+        for (j = 0; j < LATENCY_BUCKETS_NUM - 1; j++) {
+            count += histogram.bucket[j];
+            n += snprintf(buffer + n, size - n, "%s%s_seconds_bucket{le=\"%g\"} %ld\n",
+                STATS_PROMETHEUS_PREFIX, latency_fields[i].name, (double)(1L << j) / 1000000.0, count);
+        }
+        // count is derived from buckets, so it's consistent with them while threads keep recording
+        count += histogram.bucket[LATENCY_BUCKETS_NUM - 1];
+        n += snprintf(buffer + n, size - n, "%s%s_seconds_bucket{le=\"+Inf\"} %ld\n%s%s_seconds_sum %g\n%s%s_seconds_count %ld\n",
+            STATS_PROMETHEUS_PREFIX, latency_fields[i].name, count,
+            STATS_PROMETHEUS_PREFIX, latency_fields[i].name, (double)histogram.sum / 1000000.0,
+            STATS_PROMETHEUS_PREFIX, latency_fields[i].name, count);
+    }
+    return n;
+}
+
+// this function prepares stats response, http requests get prometheus metrics and connection is closed after response
+static int stats_response(struct ev_io_control *control_watcher, int http) {
+    struct sr_config_s *config = control_watcher->common;
+    char header[STATS_HTTP_HEADER_SIZE];
+    int size = STATS_HTTP_HEADER_SIZE + ((config->threads_num + 1) * STATS_FIELDS_NUM * 2 + LATENCY_FIELDS_NUM * (LATENCY_BUCKETS_NUM + 5)) * STATS_LINE_SIZE;
+    char *body;
+    int header_len;
+    int n;
+
+    control_watcher->stats_response = (char *)malloc(size);
+    if (control_watcher->stats_response == NULL) {
+        log_msg(ERROR, "%s: malloc() failed %s", __func__, strerror(errno));
+        return 1;
+    }
+    body = control_watcher->stats_response + STATS_HTTP_HEADER_SIZE;
+    if (!http) {
+        control_watcher->response = body;
+        control_watcher->response_len = format_stats(config, body, size - STATS_HTTP_HEADER_SIZE);
+        return 0;
+    }
+    n = format_prometheus_stats(config, body, size - STATS_HTTP_HEADER_SIZE);
+    // header is placed right before body, so response is sent with single buffer
+    header_len = snprintf(header, sizeof(header),
+        "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\nConnection: close\r\n\r\n", n);
+    control_watcher->response = body - header_len;
+    memcpy(control_watcher->response, header, header_len);
+    control_watcher->response_len = header_len + n;
+    control_watcher->close_after_write = 1;
+    return 0;
 }
 
 static void control_read_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
@@ -44,7 +213,7 @@ static void control_read_cb(struct ev_loop *loop, struct ev_io *watcher, int rev
     ev_io_stop(loop, watcher);
     request_len = recv(watcher->fd, request, CONTROL_REQUEST_BUF_SIZE - 1, 0);
     if (request_len > 0) {
-        while (request[request_len - 1] == '\n' || request[request_len - 1] == ' ') {
+        while (request_len > 0 && (request[request_len - 1] == '\n' || request[request_len - 1] == ' ')) {
             request_len--;
         }
         request[request_len] = 0;
@@ -64,14 +233,19 @@ static void control_read_cb(struct ev_loop *loop, struct ev_io *watcher, int rev
             control_watcher->response = control_watcher->health_response;
             control_watcher->response_len = *control_watcher->health_response_len;
         }
+        if (STRLEN(STATS_REQUEST) == cmd_length && strncmp(STATS_REQUEST, request, cmd_length) == 0) {
+            stats_response(control_watcher, 0);
+        }
+        if (STRLEN(STATS_HTTP_REQUEST) == cmd_length && strncmp(STATS_HTTP_REQUEST, request, cmd_length) == 0) {
+            stats_response(control_watcher, 1);
+        }
         ev_io_init(watcher, control_write_cb, watcher->fd, EV_WRITE);
         ev_io_start(loop, watcher);
         return;
     }
     // we are here because error happened or socket is closing
     log_msg(WARN, "%s: error while reading health check request", __func__);
-    close(watcher->fd);
-    free(watcher);
+    control_close(watcher);
 }
 
 void control_accept_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
@@ -86,12 +260,15 @@ void control_accept_cb(struct ev_loop *loop, struct ev_io *watcher, int revents)
     }
 
     control_watcher = (struct ev_io*) malloc (sizeof(struct ev_io_control));
-    ((struct ev_io_control *)control_watcher)->health_response_len = ((struct ev_io_control *)watcher)->health_response_len;
-    ((struct ev_io_control *)control_watcher)->health_response = ((struct ev_io_control *)watcher)->health_response;
     if (control_watcher == NULL) {
         log_msg(ERROR, "%s: malloc() failed %s", __func__, strerror(errno));
         return;
     }
+    ((struct ev_io_control *)control_watcher)->health_response_len = ((struct ev_io_control *)watcher)->health_response_len;
+    ((struct ev_io_control *)control_watcher)->health_response = ((struct ev_io_control *)watcher)->health_response;
+    ((struct ev_io_control *)control_watcher)->common = ((struct ev_io_control *)watcher)->common;
+    ((struct ev_io_control *)control_watcher)->stats_response = NULL;
+    ((struct ev_io_control *)control_watcher)->close_after_write = 0;
     client_socket = accept(watcher->fd, (struct sockaddr *)&client_addr, &client_addr_len);
 
     if (client_socket < 0) {
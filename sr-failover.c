@@ -0,0 +1,97 @@
+#include "sr-main.h"
+
+// this function returns number of lines in buffer, GSO padding (empty lines) isn't counted
+int count_lines(struct ds_buffer_s *buffer) {
+    char *p = buffer->data;
+    char *end = buffer->data + buffer->length;
+    char *nl;
+    int n = 0;
+
+    while (p < end && (nl = memchr(p, '\n', end - p)) != NULL) {
+        if (nl != p) {
+            n++;
+        }
+        p = nl + 1;
+    }
+    return n;
+}
+
+// this function routes lines of buffer which was filled for dead downstream to their new owners and frees buffer
+static void failover_buffer(struct thread_config_s *thread_config, struct downstream_s *ds, struct ds_buffer_s *buffer, struct ev_loop *loop) {
+    struct line_span_s span[SCAN_SPAN_NUM];
+    struct line_span_s *s;
+    char *line;
+    int offset = 0;
+    int i;
+    int n;
+
+    while (offset < buffer->length) {
+        n = scan_lines(buffer->data + offset, buffer->length - offset, span, SCAN_SPAN_NUM);
+        if (n == 0) {
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            s = span + i;
+            line = buffer->data + offset + s->offset;
+            // lines were already validated when they were added to buffer, only padding is skipped
+            if (s->length == 1) {
+                continue;
+            }
+            // if all downstreams are dead line is counted as dropped by find_downstream()
+            if (find_downstream(line, hash(line, s->name_length), s->length, thread_config->common->downstream_num, thread_config->downstream, loop) == 0) {
+                thread_config->failover_saved_counter++;
+            }
+        }
+        offset += span[n - 1].offset + span[n - 1].length;
+    }
+    ds_buffer_free(ds->pool, buffer);
+}
+
+// this function routes all buffered lines of downstream to current downstreams of thread
+// downstream stays in socket flush queue, it's removed from there by flush callback since it has no buffers
+void failover_downstream(struct thread_config_s *thread_config, struct downstream_s *ds, struct ev_loop *loop) {
+    struct ds_buffer_s *buffer;
+
+    while ((buffer = ds->ready_head) != NULL) {
+        ds->ready_head = buffer->next;
+        ds->ready_num--;
+        failover_buffer(thread_config, ds, buffer, loop);
+    }
+    ds->ready_tail = NULL;
+    if ((buffer = ds->active_buffer) != NULL) {
+        ds->active_buffer = NULL;
+        failover_buffer(thread_config, ds, buffer, loop);
+    }
+}
+
+// this function moves data of downstreams which were marked dead to alive ones
+// routing is already rebuilt by health client, so lines can't get back to dead downstream
+static void failover_async_cb(struct ev_loop *loop, struct ev_async *watcher, int revents) {
+    struct thread_config_s *thread_config = (struct thread_config_s *)watcher->data;
+    struct downstream_s *ds;
+    int i;
+
+    for (i = 0; i < thread_config->common->downstream_num; i++) {
+        ds = thread_config->downstream + i;
+        if (!ds->health_client->alive) {
+            failover_downstream(thread_config, ds, loop);
+        }
+    }
+}
+
+// this function starts failover watcher of data thread
+void init_failover_thread(struct ev_loop *loop, struct thread_config_s *thread_config) {
+    thread_config->failover_saved_counter = 0;
+    ev_async_init(&(thread_config->failover_async), failover_async_cb);
+    thread_config->failover_async.data = thread_config;
+    ev_async_start(loop, &(thread_config->failover_async));
+}
+
+// this function is called by health client when downstream dies, data threads reroute its buffered lines
+void failover_notify(struct sr_config_s *config) {
+    int i;
+
+    for (i = 0; i < config->threads_num; i++) {
+        ev_async_send((config->thread_config + i)->loop, &((config->thread_config + i)->failover_async));
+    }
+}
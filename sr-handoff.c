@@ -0,0 +1,156 @@
+#include "sr-main.h"
+
+// record header in handoff ring, line bytes follow it, zero length marks wrap to ring start
+// length goes first, so wrap marker fits into the smallest rest of ring
+struct handoff_record_s {
+    int length;
+    int name_length;
+    unsigned long hash;
+    // receive time of datagram line came from, latency of handed off line is measured from it
+    long recv_time;
+};
+
+#define HANDOFF_ALIGN sizeof(long)
+#define HANDOFF_RECORD_SIZE(length) (sizeof(struct handoff_record_s) + (((length) + HANDOFF_ALIGN - 1) & ~(HANDOFF_ALIGN - 1)))
+
+// this function allocates handoff rings for all pairs of data threads
+// it should be called before threads are started
+int init_handoff(struct sr_config_s *config) {
+    struct handoff_ring_s *ring;
+    int n = config->threads_num * config->threads_num;
+    int i;
+
+    // rings are cache line aligned, so producer and consumer positions of different rings don't share lines
+    if (posix_memalign((void **)&(config->handoff_ring), CACHE_LINE_SIZE, n * sizeof(struct handoff_ring_s)) != 0) {
+        log_msg(ERROR, "%s: malloc() failed", __func__);
+        return 1;
+    }
+    memset(config->handoff_ring, 0, n * sizeof(struct handoff_ring_s));
+    for (i = 0; i < n; i++) {
+        // thread doesn't need ring to itself
+        if (i / config->threads_num == i % config->threads_num) {
+            continue;
+        }
+        ring = config->handoff_ring + i;
+        ring->size = config->name_sharding_ring_size;
+        if (posix_memalign((void **)&(ring->data), HANDOFF_ALIGN, ring->size) != 0) {
+            log_msg(ERROR, "%s: malloc() failed", __func__);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// this function returns ring used by producer thread to pass lines to consumer thread
+static inline struct handoff_ring_s *handoff_ring(struct sr_config_s *config, int producer, int consumer) {
+    return config->handoff_ring + producer * config->threads_num + consumer;
+}
+
+// this function passes line to owner thread, returns 1 if ring is full
+int handoff_push(struct thread_config_s *thread_config, int owner, char *line, int length, int name_length, unsigned long hash) {
+    struct handoff_ring_s *ring = handoff_ring(thread_config->common, thread_config->index, owner);
+    struct handoff_record_s *record;
+    unsigned long need = HANDOFF_RECORD_SIZE(length);
+    // tail is published once, so consumer sees wrap marker and record together
+    unsigned long tail = ring->tail;
+    unsigned long offset = tail & (ring->size - 1);
+    unsigned long total = need;
+
+    // record is never split, the rest of ring is skipped if record doesn't fit there
+    if (ring->size - offset < need) {
+        total += ring->size - offset;
+    }
+    if (tail + total - ring->head_cache > ring->size) {
+        ring->head_cache = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+        if (tail + total - ring->head_cache > ring->size) {
+            thread_config->handoff_full_counter++;
+            return 1;
+        }
+    }
+    if (total != need) {
+        ((struct handoff_record_s *)(ring->data + offset))->length = 0;
+        tail += ring->size - offset;
+        offset = 0;
+    }
+    record = (struct handoff_record_s *)(ring->data + offset);
+    record->hash = hash;
+    record->length = length;
+    record->name_length = name_length;
+    record->recv_time = thread_config->recv_time;
+    memcpy(record + 1, line, length);
+    __atomic_store_n(&(ring->tail), tail + need, __ATOMIC_RELEASE);
+    // owner is woken up once per loop iteration
+    *(thread_config->handoff_pending + owner) = 1;
+    thread_config->handoff_counter++;
+    return 0;
+}
+
+// this function wakes up owners of lines passed during this loop iteration
+static void handoff_prepare_cb(struct ev_loop *loop, struct ev_prepare *watcher, int revents) {
+    struct thread_config_s *thread_config = (struct thread_config_s *)watcher->data;
+    struct thread_config_s *owner;
+    int i;
+
+    for (i = 0; i < thread_config->common->threads_num; i++) {
+        if (*(thread_config->handoff_pending + i)) {
+            *(thread_config->handoff_pending + i) = 0;
+            owner = thread_config->common->thread_config + i;
+            ev_async_send(owner->loop, &(owner->handoff_async));
+        }
+    }
+}
+
+// this function routes lines passed by other threads, it returns number of routed lines
+int handoff_drain(struct thread_config_s *thread_config, struct ev_loop *loop) {
+    struct handoff_ring_s *ring;
+    struct handoff_record_s *record;
+    unsigned long head;
+    unsigned long tail;
+    unsigned long offset;
+    int routed = 0;
+    int i;
+
+    for (i = 0; i < thread_config->common->threads_num; i++) {
+        if (i == thread_config->index) {
+            continue;
+        }
+        ring = handoff_ring(thread_config->common, i, thread_config->index);
+        head = ring->head;
+        tail = __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            offset = head & (ring->size - 1);
+            record = (struct handoff_record_s *)(ring->data + offset);
+            if (record->length == 0) {
+                head += ring->size - offset;
+                continue;
+            }
+            thread_config->recv_time = record->recv_time;
+            route_data_line((char *)(record + 1), record->length, record->name_length, record->hash,
+                thread_config->common->downstream_num, thread_config->downstream, loop);
+            head += HANDOFF_RECORD_SIZE(record->length);
+            routed++;
+        }
+        __atomic_store_n(&(ring->head), head, __ATOMIC_RELEASE);
+    }
+    return routed;
+}
+
+static void handoff_async_cb(struct ev_loop *loop, struct ev_async *watcher, int revents) {
+    handoff_drain((struct thread_config_s *)watcher->data, loop);
+}
+
+// this function starts handoff watchers of data thread
+int init_handoff_thread(struct ev_loop *loop, struct thread_config_s *thread_config) {
+    thread_config->handoff_pending = (char *)calloc(thread_config->common->threads_num, sizeof(char));
+    if (thread_config->handoff_pending == NULL) {
+        log_msg(ERROR, "%s: malloc() failed %s", __func__, strerror(errno));
+        return 1;
+    }
+    ev_async_init(&(thread_config->handoff_async), handoff_async_cb);
+    thread_config->handoff_async.data = thread_config;
+    ev_async_start(loop, &(thread_config->handoff_async));
+    ev_prepare_init(&(thread_config->handoff_prepare), handoff_prepare_cb);
+    thread_config->handoff_prepare.data = thread_config;
+    ev_prepare_start(loop, &(thread_config->handoff_prepare));
+    return 0;
+}
@@ -6,15 +6,61 @@ static int setnonblock(int fd) {
     return fcntl(fd, F_SETFL, flags);
 }
 
-static void ds_mark_down(struct ev_io *watcher) {
-    struct ds_health_client_s *health_client = (struct ds_health_client_s *)watcher;
+// this function returns delay till next check of downstream
+// checks are spread by jitter, so downstreams aren't checked in the same loop iteration
+static ev_tstamp ds_health_check_delay(struct sr_config_s *config, double spread) {
+    return config->downstream_health_check_interval * (1.0 + config->downstream_health_check_jitter * spread);
+}
+
+static void ds_health_close(struct ev_loop *loop, struct ds_health_client_s *health_client) {
+    struct ev_io *watcher = (struct ev_io *)health_client;
+
+    ev_io_stop(loop, watcher);
     if (watcher->fd > 0) {
         close(watcher->fd);
         watcher->fd = -1;
     }
+}
+
+// this function completes current check, next one is scheduled after interval
+// check timer can still be armed here when connection is refused, so it's stopped before it's set again
+static void ds_health_check_done(struct ev_loop *loop, struct ds_health_client_s *health_client) {
+    ev_timer_stop(loop, &(health_client->timeout_timer));
+    ev_timer_stop(loop, &(health_client->check_timer));
+    ev_timer_set(&(health_client->check_timer), ds_health_check_delay(health_client->common, 2.0 * drand48() - 1.0), 0.0);
+    ev_timer_start(loop, &(health_client->check_timer));
+}
+
+static void ds_mark_down(struct ds_health_client_s *health_client) {
     if (health_client->alive == 1) {
         health_client->alive = 0;
         log_msg(DEBUG, "%s downstream %d is down", __func__, health_client->id);
+        rebuild_routing(health_client->routing);
+        failover_notify(health_client->common);
+    }
+}
+
+// this function counts failed check, downstream is marked down after downstream_health_down_threshold failures in a row
+static void ds_health_failed(struct ev_loop *loop, struct ds_health_client_s *health_client) {
+    ds_health_close(loop, health_client);
+    health_client->successes = 0;
+    health_client->failures++;
+    if (health_client->failures >= health_client->common->downstream_health_down_threshold) {
+        ds_mark_down(health_client);
+    }
+    ds_health_check_done(loop, health_client);
+}
+
+static void ds_health_connect(struct ev_loop *loop, struct ds_health_client_s *health_client);
+
+// this function handles connection closed by downstream
+// idle persistent connection can be closed by downstream restart, so single fresh connection is tried before check fails
+static void ds_health_connection_lost(struct ev_loop *loop, struct ds_health_client_s *health_client) {
+    ds_health_close(loop, health_client);
+    if (health_client->reused) {
+        ds_health_connect(loop, health_client);
+    } else {
+        ds_health_failed(loop, health_client);
     }
 }
 
@@ -23,30 +69,35 @@ static void ds_health_read_cb(struct ev_loop *loop, struct ev_io *watcher, int r
     char buffer[DOWNSTREAM_HEALTH_CHECK_BUF_SIZE];
     int health_fd = watcher->fd;
     ev_io_stop(loop, watcher);
-    int n = recv(health_fd, buffer, DOWNSTREAM_HEALTH_CHECK_BUF_SIZE, 0);
+    int n = recv(health_fd, buffer, DOWNSTREAM_HEALTH_CHECK_BUF_SIZE - 1, 0);
     if (n <= 0) {
-        log_msg(WARN, "%s: recv() failed %s", __func__, strerror(errno));
-        ds_mark_down(watcher);
+        log_msg(WARN, "%s: recv() failed %s", __func__, (n == 0) ? "connection closed" : strerror(errno));
+        ds_health_connection_lost(loop, health_client);
         return;
     }
     buffer[n] = 0;
     if (memcmp(buffer, HEALTH_CHECK_UP_RESPONSE, STRLEN(HEALTH_CHECK_UP_RESPONSE)) != 0) {
-        ds_mark_down(watcher);
+        ds_health_failed(loop, health_client);
         return;
     }
-    if (health_client->alive == 0) {
+    health_client->failures = 0;
+    health_client->successes++;
+    if (health_client->alive == 0 && health_client->successes >= health_client->common->downstream_health_up_threshold) {
         health_client->alive = 1;
         log_msg(DEBUG, "%s downstream %d is up", __func__, health_client->id);
+        rebuild_routing(health_client->routing);
     }
+    // connection is kept open for next check
+    ds_health_check_done(loop, health_client);
 }
 
 static void ds_health_send_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
     int health_fd = watcher->fd;
     ev_io_stop(loop, watcher);
-    int n = send(health_fd, HEALTH_CHECK_REQUEST, STRLEN(HEALTH_CHECK_REQUEST), 0);
+    int n = send(health_fd, HEALTH_CHECK_REQUEST, STRLEN(HEALTH_CHECK_REQUEST), MSG_NOSIGNAL);
     if (n <= 0) {
         log_msg(WARN, "%s: send() failed %s", __func__, strerror(errno));
-        ds_mark_down(watcher);
+        ds_health_connection_lost(loop, (struct ds_health_client_s *)watcher);
         return;
     }
     ev_io_init(watcher, ds_health_read_cb, health_fd, EV_READ);
@@ -61,7 +112,7 @@ static void ds_health_connect_cb(struct ev_loop *loop, struct ev_io *watcher, in
     ev_io_stop(loop, watcher);
     getsockopt(health_fd, SOL_SOCKET, SO_ERROR, &err, &len);
     if (err) {
-        ds_mark_down(watcher);
+        ds_health_failed(loop, (struct ds_health_client_s *)watcher);
         return;
     } else {
         ev_io_init(watcher, ds_health_send_cb, health_fd, EV_WRITE);
@@ -69,48 +120,127 @@ static void ds_health_connect_cb(struct ev_loop *loop, struct ev_io *watcher, in
     }
 }
 
-// TODO this code behaves oddly if the remote health server crashes after reading request
+// this function opens new health connection to downstream
+static void ds_health_connect(struct ev_loop *loop, struct ds_health_client_s *health_client) {
+    struct ev_io *watcher = (struct ev_io *)health_client;
+    int health_fd;
+    int n;
+
+    health_client->reused = 0;
+    health_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (health_fd == -1) {
+        log_msg(WARN, "%s: socket() failed %s", __func__, strerror(errno));
+        ds_health_check_done(loop, health_client);
+        return;
+    }
+    if (setnonblock(health_fd) == -1) {
+        close(health_fd);
+        log_msg(WARN, "%s: setnonblock() failed %s", __func__, strerror(errno));
+        ds_health_check_done(loop, health_client);
+        return;
+    }
+    n = connect(health_fd, (struct sockaddr *)&(health_client->sa_in), sizeof(health_client->sa_in));
+    if (n == -1 && errno != EINPROGRESS) {
+        log_msg(WARN, "%s: connect() failed %s", __func__, strerror(errno));
+        close(health_fd);
+        ds_health_failed(loop, health_client);
+        return;
+    }
+    ev_io_init(watcher, ds_health_connect_cb, health_fd, EV_WRITE);
+    ev_io_start(loop, watcher);
+}
+
+// this function starts health check of single downstream, connection of previous check is reused
+static void ds_health_check_cb(struct ev_loop *loop, struct ev_timer *timer, int revents) {
+    struct ds_health_client_s *health_client = (struct ds_health_client_s *)timer->data;
+    struct ev_io *watcher = (struct ev_io *)health_client;
+
+    ev_timer_set(&(health_client->timeout_timer), health_client->common->downstream_health_check_timeout, 0.0);
+    ev_timer_start(loop, &(health_client->timeout_timer));
+    if (watcher->fd < 0) {
+        ds_health_connect(loop, health_client);
+        return;
+    }
+    health_client->reused = 1;
+    ev_io_init(watcher, ds_health_send_cb, watcher->fd, EV_WRITE);
+    ev_io_start(loop, watcher);
+}
+
+// slow or hung downstream fails the check instead of delaying all other checks
+static void ds_health_timeout_cb(struct ev_loop *loop, struct ev_timer *timer, int revents) {
+    struct ds_health_client_s *health_client = (struct ds_health_client_s *)timer->data;
+
+    log_msg(WARN, "%s: health check was not completed for downstream %d", __func__, health_client->id);
+    ds_health_failed(loop, health_client);
+}
 
-void ds_health_check_timer_cb(struct ev_loop *loop, struct ev_periodic *p, int revents) {
+// this function marks downstreams which refused data down right away, so their data is rerouted without waiting for next checks
+// downstream gets traffic again after downstream_health_up_threshold successful checks
+static void ds_health_refused_cb(struct ev_loop *loop, struct ev_async *watcher, int revents) {
+    struct sr_config_s *config = (struct sr_config_s *)watcher->data;
+    struct ds_health_client_s *health_client;
     int i;
-    int health_fd;
-    struct ev_io *watcher;
-    struct ev_periodic_health_client_s *ev_periodic_hc = (struct ev_periodic_health_client_s *)p;
-    int downstream_num = ev_periodic_hc->downstream_num;
-    struct ds_health_client_s *health_client = ev_periodic_hc->health_client;
-    int n = 0;
-
-    for (i = 0; i < downstream_num; i++) {
-        watcher = (struct ev_io *)(health_client + i);
-        health_fd = watcher->fd;
-        if (health_fd > 0 && ev_is_active(watcher)) {
-            log_msg(WARN, "%s: previous health check request was not completed for downstream %d", __func__, i);
-            ev_io_stop(loop, watcher);
-            ds_mark_down(watcher);
-            health_fd = -1;
-        }
-        if (health_fd < 0) {
-            health_fd = socket(AF_INET, SOCK_STREAM, 0);
-            if (health_fd == -1) {
-                log_msg(WARN, "%s: socket() failed %s", __func__, strerror(errno));
-                continue;
-            }
-            if (setnonblock(health_fd) == -1) {
-                close(health_fd);
-                log_msg(WARN, "%s: setnonblock() failed %s", __func__, strerror(errno));
-                continue;
-            }
-            n = connect(health_fd, (struct sockaddr *)&((health_client + i)->sa_in), sizeof((health_client + i)->sa_in));
-            if (n == -1 && errno == EINPROGRESS) {
-                ev_io_init(watcher, ds_health_connect_cb, health_fd, EV_WRITE);
-            } else {
-                log_msg(WARN, "%s: connect() failed %s", __func__, strerror(errno));
-                close(health_fd);
-                continue;
-            }
-        } else {
-            ev_io_init(watcher, ds_health_send_cb, health_fd, EV_WRITE);
+
+    for (i = 0; i < config->downstream_num; i++) {
+        health_client = config->health_client + i;
+        if (__atomic_exchange_n(&(health_client->refused), 0, __ATOMIC_RELAXED) && health_client->alive) {
+            log_msg(INFO, "%s: downstream %d refused data", __func__, health_client->id);
+            ds_health_close(loop, health_client);
+            health_client->successes = 0;
+            health_client->failures = health_client->common->downstream_health_down_threshold;
+            ds_mark_down(health_client);
+            ds_health_check_done(loop, health_client);
         }
-        ev_io_start(loop, watcher);
     }
 }
+
+// this function is called by data threads when downstream port is unreachable
+void ds_health_refused(struct ds_health_client_s *health_client) {
+    struct sr_config_s *config = health_client->common;
+
+    if (config->health_loop != NULL && __atomic_exchange_n(&(health_client->refused), 1, __ATOMIC_RELAXED) == 0) {
+        ev_async_send(config->health_loop, &(config->health_refused_async));
+    }
+}
+
+// this function starts health checks of all downstreams, it's called again with new downstreams on reload
+// first checks are spread over jitter part of interval, so routing is ready shortly after start
+void start_health_checks(struct ev_loop *loop, struct sr_config_s *config) {
+    struct ds_health_client_s *health_client;
+    int i;
+
+    for (i = 0; i < config->downstream_num; i++) {
+        health_client = config->health_client + i;
+        ev_init((struct ev_io *)health_client, NULL);
+        ((struct ev_io *)health_client)->fd = -1;
+        ev_init(&(health_client->timeout_timer), ds_health_timeout_cb);
+        health_client->timeout_timer.data = health_client;
+        ev_timer_init(&(health_client->check_timer), ds_health_check_cb,
+            config->downstream_health_check_interval * config->downstream_health_check_jitter * drand48(), 0.0);
+        health_client->check_timer.data = health_client;
+        ev_timer_start(loop, &(health_client->check_timer));
+    }
+}
+
+// this function stops health checks of all downstreams and closes their connections
+void stop_health_checks(struct ev_loop *loop, struct sr_config_s *config) {
+    struct ds_health_client_s *health_client;
+    int i;
+
+    for (i = 0; i < config->downstream_num; i++) {
+        health_client = config->health_client + i;
+        ds_health_close(loop, health_client);
+        ev_timer_stop(loop, &(health_client->check_timer));
+        ev_timer_stop(loop, &(health_client->timeout_timer));
+    }
+}
+
+// this function sets up health client in main loop and starts checks
+void init_health_checks(struct ev_loop *loop, struct sr_config_s *config) {
+    srand48(getpid() ^ time(NULL));
+    ev_async_init(&(config->health_refused_async), ds_health_refused_cb);
+    config->health_refused_async.data = config;
+    ev_async_start(loop, &(config->health_refused_async));
+    config->health_loop = loop;
+    start_health_checks(loop, config);
+}
@@ -1,8 +1,6 @@
 #include "sr-main.h"
 #include <sys/resource.h>
 
-#define HOST_NAME_SIZE 64
-
 static int init_sockaddr_in(struct sockaddr_in *sa_in, char *host, char *port) {
     struct hostent *he = gethostbyname(host);
 
@@ -17,8 +15,29 @@ static int init_sockaddr_in(struct sockaddr_in *sa_in, char *host, char *port) {
     return 0;
 }
 
+// this function allocates data thread configs and names their ping metrics
+static int init_thread_config(struct sr_config_s *config, char *hostname) {
+    int k;
+
+    // stats of each thread have own cache line, so array is aligned too
+    if (posix_memalign((void **)&(config->thread_config), CACHE_LINE_SIZE, sizeof(struct thread_config_s) * config->threads_num) != 0) {
+        log_msg(ERROR, "%s: thread_config malloc() failed", __func__);
+        return(1);
+    }
+    // stats can be requested via control port before data threads are started
+    memset(config->thread_config, 0, sizeof(struct thread_config_s) * config->threads_num);
+    for (k = 0; k < config->threads_num; k++) {
+        sprintf((config->thread_config + k)->alive_downstream_metric_name, "%s.%s-%d.%s", config->ping_prefix, hostname, (config->data_port) + k, HEALTHY_DOWNSTREAMS);
+        sprintf((config->thread_config + k)->metric_prefix, "%s.%s-%d", config->ping_prefix, hostname, (config->data_port) + k);
+        (config->thread_config + k)->cpu = (config->thread_cpu_num > 0) ? config->thread_cpu[k % config->thread_cpu_num] : -1;
+        (config->thread_config + k)->numa_node = (config->thread_numa_node_num > 0) ? config->thread_numa_node[k % config->thread_numa_node_num] : -1;
+    }
+    return 0;
+}
+
 // function to init downstreams from config file line
-static int init_downstream(struct sr_config_s *config, char *hostname) {
+// it's also used on reload, so it only touches downstreams, health clients and routing of config
+int init_downstream(struct sr_config_s *config, char *hostname) {
     int i = 0;
     int j = 0;
     int k = 0;
@@ -48,15 +67,6 @@ static int init_downstream(struct sr_config_s *config, char *hostname) {
         log_msg(ERROR, "%s: health client malloc() failed %s", __func__, strerror(errno));
         return 1;
     }
-    config->thread_config = (struct thread_config_s *)malloc(sizeof(struct thread_config_s) * config->threads_num);
-    if (config->thread_config == NULL) {
-        log_msg(ERROR, "%s: thread_config malloc() failed %s", __func__, strerror(errno));
-        return(1);
-    }
-    for (k = 0; k < config->threads_num; k++) {
-        sprintf((config->thread_config + k)->alive_downstream_metric_name, "%s.%s-%d.%s", config->ping_prefix, hostname, (config->data_port) + k, HEALTHY_DOWNSTREAMS);
-    }
-
     // now let's initialize downstreams and health clients
     for (i = 0; i < config->downstream_num; i++) {
         if (host == NULL) {
@@ -83,6 +93,12 @@ static int init_downstream(struct sr_config_s *config, char *hostname) {
         (config->health_client + i)->super.fd = -1;
         (config->health_client + i)->id = i;
         (config->health_client + i)->alive = 0;
+        (config->health_client + i)->failures = 0;
+        (config->health_client + i)->successes = 0;
+        (config->health_client + i)->reused = 0;
+        (config->health_client + i)->refused = 0;
+        (config->health_client + i)->routing = &config->routing;
+        (config->health_client + i)->common = config;
         if (init_sockaddr_in(&((config->health_client + i)->sa_in), host, health_port) != 0) {
             return 1;
         }
@@ -94,18 +110,17 @@ static int init_downstream(struct sr_config_s *config, char *hostname) {
                 *(metric_host_name + j) = *(host + j);
             }
         }
+        *(metric_host_name + j) = 0;
         for (k = 0; k < config->threads_num; k++) {
             ds = config->downstream + k * config->downstream_num + i;
-            ds->active_buffer_idx = 0;
-            ds->active_buffer = ds->buffer;
-            ds->active_buffer_length = 0;
-            ds->flush_buffer_idx = 0;
+            ds->active_buffer = NULL;
+            ds->ready_head = NULL;
+            ds->ready_tail = NULL;
+            ds->ready_num = 0;
+            ds->overflow_policy = config->buffer_overflow_policy;
             ds->downstream_traffic_counter = 0;
             ds->downstream_packet_counter = 0;
             ds->health_client = config->health_client + i;
-            for (j = 0; j < DOWNSTREAM_BUF_NUM; j++) {
-                ds->buffer_length[j] = 0;
-            }
             if (init_sockaddr_in(&(ds->sa_in_data), host, data_port) != 0) {
                 return 1;
             }
@@ -119,6 +134,10 @@ static int init_downstream(struct sr_config_s *config, char *hostname) {
         }
         host = next_host;
     }
+    if (init_routing(&config->routing, config->routing.mode, config->routing.table_size, config->downstream_num, config->health_client) != 0) {
+        log_msg(ERROR, "%s: init_routing() failed", __func__);
+        return 1;
+    }
     return 0;
 }
 
@@ -140,16 +159,146 @@ static int process_config_line(char *line, struct sr_config_s *config) {
         config->downstream_flush_interval = atof(value_ptr);
     } else if (strcmp("downstream_health_check_interval", line) == 0) {
         config->downstream_health_check_interval = atof(value_ptr);
+    } else if (strcmp("downstream_health_check_timeout", line) == 0) {
+        config->downstream_health_check_timeout = atof(value_ptr);
+    } else if (strcmp("downstream_health_check_jitter", line) == 0) {
+        config->downstream_health_check_jitter = atof(value_ptr);
+    } else if (strcmp("downstream_health_down_threshold", line) == 0) {
+        config->downstream_health_down_threshold = atoi(value_ptr);
+    } else if (strcmp("downstream_health_up_threshold", line) == 0) {
+        config->downstream_health_up_threshold = atoi(value_ptr);
     } else if (strcmp("downstream_ping_interval", line) == 0) {
         config->downstream_ping_interval = atof(value_ptr);
     } else if (strcmp("log_level", line) == 0) {
         log_level = atoi(value_ptr);
+    } else if (strcmp("log_rate_limit", line) == 0) {
+        log_rate_limit = atoi(value_ptr);
     } else if (strcmp("threads_num", line) == 0) {
         config->threads_num = atoi(value_ptr);
         if (config->threads_num < 1) {
             log_msg(ERROR, "%s: threads_num should be >= 1", __func__);
             return 1;
         }
+    } else if (strcmp("recv_batch_size", line) == 0) {
+        config->recv_batch_size = atoi(value_ptr);
+    } else if (strcmp("recv_buffer_size", line) == 0) {
+        config->recv_buffer_size = atoi(value_ptr);
+    } else if (strcmp("socket_rcvbuf", line) == 0) {
+        config->socket_rcvbuf = atoi(value_ptr);
+    } else if (strcmp("recv_gro", line) == 0) {
+        config->recv_gro = atoi(value_ptr);
+    } else if (strcmp("io_backend", line) == 0) {
+        if (strcmp("libev", value_ptr) == 0) {
+            config->io_backend = IO_BACKEND_LIBEV;
+        } else if (strcmp("io_uring", value_ptr) == 0) {
+            config->io_backend = IO_BACKEND_IO_URING;
+        } else {
+            log_msg(ERROR, "%s: unknown io_backend \"%s\"", __func__, value_ptr);
+            return 1;
+        }
+    } else if (strcmp("io_uring_entries", line) == 0) {
+        config->io_uring_entries = atoi(value_ptr);
+    } else if (strcmp("thread_cpu_affinity", line) == 0) {
+        config->thread_cpu_num = parse_cpu_list(value_ptr, config->thread_cpu, THREAD_AFFINITY_MAX);
+        if (config->thread_cpu_num < 0) {
+            log_msg(ERROR, "%s: bad thread_cpu_affinity \"%s\"", __func__, value_ptr);
+            return 1;
+        }
+    } else if (strcmp("thread_numa_affinity", line) == 0) {
+        config->thread_numa_node_num = parse_cpu_list(value_ptr, config->thread_numa_node, THREAD_AFFINITY_MAX);
+        if (config->thread_numa_node_num < 0) {
+            log_msg(ERROR, "%s: bad thread_numa_affinity \"%s\"", __func__, value_ptr);
+            return 1;
+        }
+    } else if (strcmp("name_sharding", line) == 0) {
+        config->name_sharding = atoi(value_ptr);
+    } else if (strcmp("name_sharding_ring_size", line) == 0) {
+        config->name_sharding_ring_size = atoi(value_ptr);
+    } else if (strcmp("work_stealing", line) == 0) {
+        config->work_stealing = atoi(value_ptr);
+    } else if (strcmp("latency_histograms", line) == 0) {
+        config->latency_histograms = atoi(value_ptr);
+    } else if (strcmp("latency_ping_metrics", line) == 0) {
+        config->latency_ping_metrics = atoi(value_ptr);
+    } else if (strcmp("reuseport_steering", line) == 0) {
+        if (strcmp("none", value_ptr) == 0) {
+            config->reuseport_steering = REUSEPORT_STEERING_NONE;
+        } else if (strcmp("incoming_cpu", value_ptr) == 0) {
+            config->reuseport_steering = REUSEPORT_STEERING_INCOMING_CPU;
+        } else if (strcmp("cbpf", value_ptr) == 0) {
+            config->reuseport_steering = REUSEPORT_STEERING_CBPF;
+        } else {
+            log_msg(ERROR, "%s: unknown reuseport_steering \"%s\"", __func__, value_ptr);
+            return 1;
+        }
+    } else if (strcmp("aggregation", line) == 0) {
+        config->aggregation = atoi(value_ptr);
+    } else if (strcmp("aggregation_timers", line) == 0) {
+        config->aggregation_timers = atoi(value_ptr);
+    } else if (strcmp("aggregation_table_size", line) == 0) {
+        config->aggregation_table_size = atoi(value_ptr);
+    } else if (strcmp("aggregation_arena_size", line) == 0) {
+        config->aggregation_arena_size = atoi(value_ptr);
+    } else if (strcmp("downstream_packet_size", line) == 0) {
+        config->downstream_packet_size = atoi(value_ptr);
+    } else if (strcmp("downstream_gso_segments", line) == 0) {
+        config->downstream_gso_segments = atoi(value_ptr);
+    } else if (strcmp("buffer_memory_limit", line) == 0) {
+        config->buffer_memory_limit = atol(value_ptr);
+    } else if (strcmp("buffer_pool_size", line) == 0) {
+        config->buffer_pool_size = atoi(value_ptr);
+    } else if (strcmp("buffer_overflow_policy", line) == 0) {
+        if (strcmp("drop_new", value_ptr) == 0) {
+            config->buffer_overflow_policy = BUFFER_OVERFLOW_DROP_NEW;
+        } else if (strcmp("drop_oldest", value_ptr) == 0) {
+            config->buffer_overflow_policy = BUFFER_OVERFLOW_DROP_OLDEST;
+        } else {
+            log_msg(ERROR, "%s: unknown buffer_overflow_policy \"%s\"", __func__, value_ptr);
+            return 1;
+        }
+    } else if (strcmp("downstream_connected_sockets", line) == 0) {
+        config->downstream_connected_sockets = atoi(value_ptr);
+    } else if (strcmp("routing_mode", line) == 0) {
+        if (strcmp("compat", value_ptr) == 0) {
+            config->routing.mode = ROUTING_MODE_COMPAT;
+        } else if (strcmp("table", value_ptr) == 0) {
+            config->routing.mode = ROUTING_MODE_TABLE;
+        } else {
+            log_msg(ERROR, "%s: unknown routing_mode \"%s\"", __func__, value_ptr);
+            return 1;
+        }
+    } else if (strcmp("routing_table_size", line) == 0) {
+        config->routing.table_size = atoi(value_ptr);
+    } else if (strcmp("capture_file", line) == 0) {
+        n = strlen(value_ptr) + 1;
+        config->capture_file = (char *)malloc(n);
+        if (config->capture_file == NULL) {
+            log_msg(ERROR, "%s: malloc() failed", __func__);
+            return 1;
+        }
+        strncpy(config->capture_file, value_ptr, n);
+    } else if (strcmp("capture_size", line) == 0) {
+        config->capture_size = atol(value_ptr);
+    } else if (strcmp("replay_file", line) == 0) {
+        n = strlen(value_ptr) + 1;
+        config->replay_file = (char *)malloc(n);
+        if (config->replay_file == NULL) {
+            log_msg(ERROR, "%s: malloc() failed", __func__);
+            return 1;
+        }
+        strncpy(config->replay_file, value_ptr, n);
+    } else if (strcmp("replay_speed", line) == 0) {
+        config->replay_speed = atof(value_ptr);
+    } else if (strcmp("upgrade_socket", line) == 0) {
+        n = strlen(value_ptr) + 1;
+        config->upgrade_socket = (char *)malloc(n);
+        if (config->upgrade_socket == NULL) {
+            log_msg(ERROR, "%s: malloc() failed", __func__);
+            return 1;
+        }
+        strncpy(config->upgrade_socket, value_ptr, n);
+    } else if (strcmp("drain_timeout", line) == 0) {
+        config->drain_timeout = atof(value_ptr);
     } else if (strcmp("ping_prefix", line) == 0) {
         n = strlen(value_ptr) + 1;
         config->ping_prefix = (char *)malloc(n);
@@ -173,12 +322,12 @@ static int process_config_line(char *line, struct sr_config_s *config) {
     return 0;
 }
 
-// this function is called if SIGHUP is received
+// this function is called if SIGHUP is received before main loop is started or in replay mode, config is reloaded on SIGHUP later
 static void on_sighup(int sig) {
     log_msg(INFO, "%s: sighup received", __func__);
 }
 
-// this function is called if SIGINT is received
+// this function is called if SIGINT is received before main loop is started, router drains on SIGINT later
 static void on_sigint(int sig) {
     log_msg(INFO, "%s: sigint received", __func__);
     exit(0);
@@ -198,6 +347,10 @@ static int verify_config(struct sr_config_s *config) {
         failures++;
         log_msg(ERROR, "%s: log_level should be in the %d-%d range", __func__, TRACE, ERROR);
     }
+    if (log_rate_limit < 0) {
+        failures++;
+        log_msg(ERROR, "%s: log_rate_limit should be >= 0", __func__);
+    }
     if (config->downstream_str == NULL) {
         failures++;
         log_msg(ERROR, "%s: downstream is not set", __func__);
@@ -210,6 +363,21 @@ static int verify_config(struct sr_config_s *config) {
         failures++;
         log_msg(ERROR, "%s: downstream_health_check_interval should be > 0", __func__);
     }
+    if (config->downstream_health_check_timeout < 0.0) {
+        failures++;
+        log_msg(ERROR, "%s: downstream_health_check_timeout should be >= 0", __func__);
+    } else if (config->downstream_health_check_timeout == 0.0) {
+        // incomplete check used to fail when the next one was due
+        config->downstream_health_check_timeout = config->downstream_health_check_interval;
+    }
+    if (config->downstream_health_check_jitter < 0.0 || config->downstream_health_check_jitter >= 1.0) {
+        failures++;
+        log_msg(ERROR, "%s: downstream_health_check_jitter should be in the 0-1 range", __func__);
+    }
+    if (config->downstream_health_down_threshold < 1 || config->downstream_health_up_threshold < 1) {
+        failures++;
+        log_msg(ERROR, "%s: downstream_health_down_threshold and downstream_health_up_threshold should be >= 1", __func__);
+    }
     if (config->downstream_flush_interval <= 0.0) {
         failures++;
         log_msg(ERROR, "%s: downstream_flush_interval should be > 0", __func__);
@@ -218,6 +386,103 @@ static int verify_config(struct sr_config_s *config) {
         failures++;
         log_msg(ERROR, "%s: downstream_ping_interval should be > 0", __func__);
     }
+    if (config->recv_batch_size < 1 || config->recv_batch_size > RECV_BATCH_SIZE_MAX) {
+        failures++;
+        log_msg(ERROR, "%s: recv_batch_size should be in the 1-%d range", __func__, RECV_BATCH_SIZE_MAX);
+    }
+    if (config->recv_buffer_size < RECV_BUFFER_SIZE_MIN || config->recv_buffer_size > RECV_BUFFER_SIZE_MAX) {
+        failures++;
+        log_msg(ERROR, "%s: recv_buffer_size should be in the %d-%d range", __func__, RECV_BUFFER_SIZE_MIN, RECV_BUFFER_SIZE_MAX);
+    }
+    if (config->aggregation_table_size < 1) {
+        failures++;
+        log_msg(ERROR, "%s: aggregation_table_size should be >= 1", __func__);
+    }
+    if (config->aggregation_arena_size < METRIC_SIZE) {
+        failures++;
+        log_msg(ERROR, "%s: aggregation_arena_size should be >= %d", __func__, METRIC_SIZE);
+    }
+    if (config->io_uring_entries < 1 || config->io_uring_entries > IO_URING_ENTRIES_MAX) {
+        failures++;
+        log_msg(ERROR, "%s: io_uring_entries should be in the 1-%d range", __func__, IO_URING_ENTRIES_MAX);
+    }
+    // overload is detected by full receive batch, batches are copied from receive arena slots
+    if (config->work_stealing && (config->recv_batch_size < 2 || config->recv_gro || config->io_backend != IO_BACKEND_LIBEV)) {
+        failures++;
+        log_msg(ERROR, "%s: work_stealing requires recv_batch_size >= 2, libev backend and no recv_gro", __func__);
+    }
+    if (config->latency_ping_metrics && !config->latency_histograms) {
+        failures++;
+        log_msg(ERROR, "%s: latency_ping_metrics requires latency_histograms", __func__);
+    }
+    // ring should hold at least couple of longest lines
+    if (config->name_sharding && ((config->name_sharding_ring_size & (config->name_sharding_ring_size - 1)) != 0
+        || config->name_sharding_ring_size < 4 * config->downstream_packet_size)) {
+        failures++;
+        log_msg(ERROR, "%s: name_sharding_ring_size should be power of 2 and >= 4 * downstream_packet_size", __func__);
+    }
+    // socket is bound to cpu of its thread
+    if (config->reuseport_steering == REUSEPORT_STEERING_INCOMING_CPU && config->thread_cpu_num == 0) {
+        failures++;
+        log_msg(ERROR, "%s: reuseport_steering incoming_cpu requires thread_cpu_affinity", __func__);
+    }
+    if (config->socket_rcvbuf < 0) {
+        failures++;
+        log_msg(ERROR, "%s: socket_rcvbuf should be >= 0", __func__);
+    }
+    // multishot receive doesn't deliver GRO segment size
+    if (config->recv_gro && config->io_backend == IO_BACKEND_IO_URING) {
+        failures++;
+        log_msg(ERROR, "%s: recv_gro can't be used with io_uring backend", __func__);
+    }
+    if (config->downstream_packet_size < METRIC_SIZE || config->downstream_packet_size > DOWNSTREAM_BUF_SIZE_MAX) {
+        failures++;
+        log_msg(ERROR, "%s: downstream_packet_size should be in the %d-%d range", __func__, METRIC_SIZE, DOWNSTREAM_BUF_SIZE_MAX);
+    }
+    if (config->downstream_gso_segments < 1 || config->downstream_gso_segments > DOWNSTREAM_GSO_SEGMENTS_MAX) {
+        failures++;
+        log_msg(ERROR, "%s: downstream_gso_segments should be in the 1-%d range", __func__, DOWNSTREAM_GSO_SEGMENTS_MAX);
+    } else if ((long)config->downstream_packet_size * config->downstream_gso_segments > DOWNSTREAM_BUF_SIZE_MAX) {
+        failures++;
+        log_msg(ERROR, "%s: downstream_packet_size * downstream_gso_segments should be <= %d", __func__, DOWNSTREAM_BUF_SIZE_MAX);
+    }
+    if (config->buffer_memory_limit < (long)config->downstream_packet_size * config->downstream_gso_segments) {
+        failures++;
+        log_msg(ERROR, "%s: buffer_memory_limit should be >= downstream_packet_size * downstream_gso_segments", __func__);
+    }
+    if (config->buffer_pool_size < 0) {
+        failures++;
+        log_msg(ERROR, "%s: buffer_pool_size should be >= 0", __func__);
+    }
+    if (config->routing.table_size < 1) {
+        failures++;
+        log_msg(ERROR, "%s: routing_table_size should be >= 1", __func__);
+    }
+    if (config->capture_size < (long)sizeof(struct capture_header_s) + CAPTURE_RECORD_SIZE(DOWNSTREAM_BUF_SIZE)) {
+        failures++;
+        log_msg(ERROR, "%s: capture_size should be >= %ld", __func__, (long)sizeof(struct capture_header_s) + CAPTURE_RECORD_SIZE(DOWNSTREAM_BUF_SIZE));
+    }
+    if (config->replay_speed < 0.0) {
+        failures++;
+        log_msg(ERROR, "%s: replay_speed should be >= 0", __func__);
+    }
+    // replay can't overwrite its own capture
+    if (config->capture_file != NULL && config->replay_file != NULL) {
+        failures++;
+        log_msg(ERROR, "%s: capture_file and replay_file can't be used together", __func__);
+    }
+    if (config->upgrade_socket != NULL && strlen(config->upgrade_socket) >= sizeof(((struct sockaddr_un *)0)->sun_path)) {
+        failures++;
+        log_msg(ERROR, "%s: upgrade_socket path is too long", __func__);
+    }
+    if (config->upgrade_socket != NULL && config->replay_file != NULL) {
+        failures++;
+        log_msg(ERROR, "%s: upgrade_socket and replay_file can't be used together", __func__);
+    }
+    if (config->drain_timeout <= 0.0) {
+        failures++;
+        log_msg(ERROR, "%s: drain_timeout should be > 0", __func__);
+    }
     return failures;
 }
 
@@ -231,31 +496,74 @@ static void cleanup(int status, void *args) {
     for (i = 0; i < config->threads_num; i++) {
         tc = config->thread_config + i;
         close(tc->socket_in);
-        for (j = 0; j < config->socket_out_num; j++) {
-            close(*(tc->socket_out + j));
+        // router can exit before data threads have created their sockets
+        for (j = 0; j < config->socket_out_num && tc->socket_out != NULL; j++) {
+            close((tc->socket_out + j)->super.fd);
         }
     }
 }
 
-// this function loads config file and initializes config fields
-int init_config(char *filename, struct sr_config_s *config) {
+// this function reads config file into config fields, it's also used to read new config on reload
+int load_config(char *filename, struct sr_config_s *config) {
     size_t n = 0;
     int l = 0;
     int failures = 0;
-    char *buffer;
-    char hostname[HOST_NAME_SIZE];
-    struct rlimit rlim;
-    int socket_out_num = 0;
+    char *buffer = NULL;
 
+    memset(config, 0, sizeof(struct sr_config_s));
     config->data_port = 0;
     config->control_port = 0;
     log_level = 0;
+    log_rate_limit = LOG_RATE_LIMIT;
     config->downstream_health_check_interval = 0.0;
+    config->downstream_health_check_timeout = 0.0;
+    config->downstream_health_check_jitter = 0.1;
+    config->downstream_health_down_threshold = 1;
+    config->downstream_health_up_threshold = 1;
+    config->health_loop = NULL;
+    config->downstream_connected_sockets = 0;
     config->downstream_flush_interval = 0.0;
     config->downstream_ping_interval = 0.0;
     config->threads_num = 1;
+    config->recv_batch_size = 1;
+    config->recv_buffer_size = DATA_BUF_SIZE;
+    config->socket_rcvbuf = 0;
+    config->recv_gro = 0;
+    config->io_backend = IO_BACKEND_LIBEV;
+    config->io_uring_entries = IO_URING_ENTRIES;
+    config->thread_cpu_num = 0;
+    config->thread_numa_node_num = 0;
+    config->reuseport_steering = REUSEPORT_STEERING_NONE;
+    config->name_sharding = 0;
+    config->work_stealing = 0;
+    config->name_sharding_ring_size = NAME_SHARDING_RING_SIZE;
+    config->latency_histograms = 0;
+    config->latency_ping_metrics = 0;
+    config->aggregation = 0;
+    config->aggregation_timers = 0;
+    config->aggregation_table_size = AGGREGATION_TABLE_SIZE;
+    config->aggregation_arena_size = AGGREGATION_ARENA_SIZE;
+    config->downstream_packet_size = DOWNSTREAM_BUF_SIZE;
+    config->downstream_gso_segments = 1;
+    config->buffer_memory = 0;
+    config->buffer_memory_limit = BUFFER_MEMORY_LIMIT;
+    config->buffer_pool_size = BUFFER_POOL_SIZE;
+    config->buffer_overflow_policy = BUFFER_OVERFLOW_DROP_NEW;
+    config->routing.mode = ROUTING_MODE_COMPAT;
+    config->routing.table_size = ROUTING_TABLE_SIZE;
     config->downstream_str = NULL;
     config->ping_prefix = NULL;
+    config->capture_file = NULL;
+    config->capture_size = CAPTURE_SIZE;
+    config->capture = NULL;
+    config->replay_file = NULL;
+    config->replay_speed = 1.0;
+    config->upgrade_socket = NULL;
+    config->upgrade_listen_fd = -1;
+    config->upgrade_fd = -1;
+    config->control_socket = -1;
+    config->drain_timeout = DRAIN_TIMEOUT;
+    config->replay = NULL;
 
     FILE *config_file = fopen(filename, "rt");
     if (config_file == NULL) {
@@ -283,6 +591,49 @@ int init_config(char *filename, struct sr_config_s *config) {
         log_msg(ERROR, "%s: failed to verify config file", __func__);
         return 1;
     }
+    return 0;
+}
+
+// this function calculates how many outgoing sockets each data thread can open
+int init_socket_out_num(struct sr_config_s *config) {
+    struct rlimit rlim;
+    int socket_out_num = 0;
+
+    if (getrlimit(RLIMIT_NOFILE, &rlim) != 0) {
+        log_msg(ERROR, "%s: getrlimit() failed", __func__);
+        return 1;
+    }
+    // how many file handlers we can allocate per thread for downstreams? Here is what is used:
+    // 3 - stdin, stdout, stderr
+    // 1 - health server per statsd-router instance
+    // config->downstream_num - connections to the downstream health ports per statsd-router instance
+    // 1 - incoming connections per thread
+    // let's calculate how much will be left
+    socket_out_num = ((int)rlim.rlim_cur - 3 - 1 - (config->downstream_num) - (config->threads_num)) / config->threads_num;
+    if (socket_out_num < 1) {
+        log_msg(ERROR, "%s: socket_out_num should be >= 1", __func__);
+        return 1;
+    }
+    if (socket_out_num >= config->downstream_num) {
+        config->socket_out_num = config->downstream_num;
+    } else if (config->downstream_connected_sockets) {
+        log_msg(ERROR, "%s: downstream_connected_sockets requires %d free file handles per thread, only %d are available", __func__, config->downstream_num, socket_out_num);
+        return 1;
+    } else {
+        config->socket_out_num = socket_out_num;
+        log_msg(WARN, "%s: %d downstreams are present but only %d free file handles, some downstreams will share outgoing sockets", __func__, config->downstream_num, config->socket_out_num);
+    }
+    return 0;
+}
+
+// this function loads config file and initializes config fields
+int init_config(char *filename, struct sr_config_s *config) {
+    char hostname[HOST_NAME_SIZE];
+
+    if (load_config(filename, config) != 0) {
+        return 1;
+    }
+    config->config_file = filename;
     if (on_exit(cleanup, (void *)config) != 0) {
         log_msg(ERROR, "%s: on_exit() failed", __func__);
         return 1;
@@ -295,36 +646,20 @@ int init_config(char *filename, struct sr_config_s *config) {
         log_msg(ERROR, "%s: signal() for sigint failed", __func__);
         return 1;
     }
-    n = gethostname(hostname, HOST_NAME_SIZE);
-    if (n < 0) {
+    if (gethostname(hostname, HOST_NAME_SIZE) < 0) {
         log_msg(ERROR, "%s: gethostname() failed", __func__);
         return 1;
     }
-    if (init_downstream(config, hostname) != 0) {
-        log_msg(ERROR, "%s: init_downstream() failed", __func__);
+    if (init_thread_config(config, hostname) != 0) {
         return 1;
     }
-    if (getrlimit(RLIMIT_NOFILE, &rlim) != 0) {
-        log_msg(ERROR, "%s: getrlimit() failed", __func__);
+    if (init_downstream(config, hostname) != 0) {
+        log_msg(ERROR, "%s: init_downstream() failed", __func__);
         return 1;
     }
-    // how many file handlers we can allocate per thread for downstreams? Here is what is used:
-    // 3 - stdin, stdout, stderr
-    // 1 - health server per statsd-router instance
-    // config->downstream_num - connections to the downstream health ports per statsd-router instance
-    // 1 - incoming connections per thread
-    // let's calculate how much will be left
-    socket_out_num = ((int)rlim.rlim_cur - 3 - 1 - (config->downstream_num) - (config->threads_num)) / config->threads_num;
-    if (socket_out_num < 1) {
-        log_msg(ERROR, "%s: socket_out_num should be >= 1", __func__);
+    if (init_socket_out_num(config) != 0) {
         return 1;
     }
-    if (socket_out_num > config->downstream_num) {
-        config->socket_out_num = config->downstream_num;
-    } else {
-        config->socket_out_num = socket_out_num;
-        log_msg(WARN, "%s: %d downstreams are present but only %d free file handles, some downstreams will share outgoing sockets", __func__, config->downstream_num, config->socket_out_num);
-    }
     strncpy(config->health_check_response_buf, HEALTH_CHECK_UP_RESPONSE, STRLEN(HEALTH_CHECK_UP_RESPONSE));
     config->health_check_response_buf_length = STRLEN(HEALTH_CHECK_UP_RESPONSE);
     return 0;
@@ -0,0 +1,102 @@
+#include "sr-main.h"
+
+// this function returns wall clock time in nanoseconds, kernel receive timestamps use the same clock
+long latency_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// this function sets receive time of data routed by thread to current time
+// it's used for data without kernel timestamp: timers, io_uring receives, lines passed by other threads
+void latency_mark(struct thread_config_s *thread_config) {
+    if (thread_config->latency != NULL) {
+        thread_config->recv_time = latency_now();
+    }
+}
+
+// this function returns kernel receive timestamp of datagram, current time if timestamp is missing
+long latency_recv_time(struct msghdr *msg) {
+    struct cmsghdr *cmsg;
+    struct timespec ts;
+
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            return ts.tv_sec * 1000000000L + ts.tv_nsec;
+        }
+    }
+    return latency_now();
+}
+
+// this function adds value in nanoseconds to histogram
+// histogram has single writer, so load and store are enough to let control thread read it without locks
+void latency_record(struct latency_histogram_s *histogram, long ns) {
+    long us = (ns > 0) ? ns / 1000 : 0;
+    int i = (us == 0) ? 0 : 8 * sizeof(long) - __builtin_clzl(us);
+
+    if (i >= LATENCY_BUCKETS_NUM) {
+        i = LATENCY_BUCKETS_NUM - 1;
+    }
+    __atomic_store_n(histogram->bucket + i, histogram->bucket[i] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&(histogram->count), histogram->count + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&(histogram->sum), histogram->sum + us, __ATOMIC_RELAXED);
+}
+
+// this function adds histogram of other thread to total, histogram can be updated concurrently
+void latency_add(struct latency_histogram_s *total, struct latency_histogram_s *histogram) {
+    int i;
+
+    for (i = 0; i < LATENCY_BUCKETS_NUM; i++) {
+        total->bucket[i] += __atomic_load_n(histogram->bucket + i, __ATOMIC_RELAXED);
+    }
+    total->count += __atomic_load_n(&(histogram->count), __ATOMIC_RELAXED);
+    total->sum += __atomic_load_n(&(histogram->sum), __ATOMIC_RELAXED);
+}
+
+// this function fills histogram of values recorded since last call, it's called by histogram owner
+void latency_interval(struct latency_histogram_s *current, struct latency_histogram_s *last, struct latency_histogram_s *interval) {
+    int i;
+
+    for (i = 0; i < LATENCY_BUCKETS_NUM; i++) {
+        interval->bucket[i] = current->bucket[i] - last->bucket[i];
+    }
+    interval->count = current->count - last->count;
+    interval->sum = current->sum - last->sum;
+    memcpy(last, current, sizeof(struct latency_histogram_s));
+}
+
+// this function returns upper bound of bucket holding given percentile in microseconds, 0 if histogram is empty
+long latency_percentile(struct latency_histogram_s *histogram, double percentile) {
+    long rank = (long)(histogram->count * percentile / 100.0);
+    long n = 0;
+    int i;
+
+    if (histogram->count == 0) {
+        return 0;
+    }
+    if (rank >= histogram->count) {
+        rank = histogram->count - 1;
+    }
+    for (i = 0; i < LATENCY_BUCKETS_NUM - 1; i++) {
+        n += histogram->bucket[i];
+        if (n > rank) {
+            break;
+        }
+    }
+    return 1L << i;
+}
+
+// this function allocates latency histograms of data thread
+int init_latency_thread(struct thread_config_s *thread_config) {
+    if (posix_memalign((void **)&(thread_config->latency), CACHE_LINE_SIZE, sizeof(struct thread_latency_s)) != 0
+        || posix_memalign((void **)&(thread_config->ping_latency), CACHE_LINE_SIZE, sizeof(struct thread_latency_s)) != 0) {
+        log_msg(ERROR, "%s: malloc() failed", __func__);
+        return 1;
+    }
+    memset(thread_config->latency, 0, sizeof(struct thread_latency_s));
+    memset(thread_config->ping_latency, 0, sizeof(struct thread_latency_s));
+    thread_config->recv_time = latency_now();
+    return 0;
+}
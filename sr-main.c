@@ -17,78 +17,232 @@
 
 #include "sr-main.h"
 
-// this function flushes data to downstream
+// this function drops oldest queued buffer of downstream, returns 1 if queue is empty
+// downstream stays in socket flush queue, downstreams without buffers are removed from it by ds_flush_cb()
+static int ds_drop_oldest(struct downstream_s *ds, struct ev_loop *loop) {
+    struct ds_buffer_s *buffer = ds->ready_head;
+
+    if (buffer == NULL) {
+        return 1;
+    }
+    STATS_ADD((struct thread_config_s *)ev_userdata(loop), dropped_lines, count_lines(buffer));
+    ds->ready_head = buffer->next;
+    if (ds->ready_head == NULL) {
+        ds->ready_tail = NULL;
+    }
+    ds->ready_num--;
+    ds_buffer_free(ds->pool, buffer);
+    return 0;
+}
+
+// this function flushes all ready buffers of downstreams queued on this socket
 void ds_flush_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
-    int bytes_send;
-    struct downstream_s *ds = (struct downstream_s *)watcher;
-    int flush_buffer_idx = ds->flush_buffer_idx;
+    struct ds_socket_out_s *socket_out = (struct ds_socket_out_s *)watcher;
+    struct thread_config_s *thread_config = (struct thread_config_s *)ev_userdata(loop);
+    struct downstream_s *ds;
+    struct ds_buffer_s *buffer;
+    struct mmsghdr *msg;
+    struct iovec *iov;
+    int msg_num = 0;
+    int sent = 0;
+    long now = 0;
+    int i;
+    int n;
 
     if (EV_ERROR & revents) {
         log_msg(WARN, "%s: invalid event %s", __func__, strerror(errno));
         return;
     }
 
-    bytes_send = sendto(watcher->fd,
-        ds->buffer + flush_buffer_idx * DOWNSTREAM_BUF_SIZE,
-        ds->buffer_length[flush_buffer_idx],
-        0,
-        (struct sockaddr *)&(ds->sa_in_data),
-        sizeof(ds->sa_in_data));
-    // update flush time
-    ds->buffer_length[flush_buffer_idx] = 0;
-    ds->flush_buffer_idx = (flush_buffer_idx + 1) % DOWNSTREAM_BUF_NUM;
-    if (ds->flush_buffer_idx == ds->active_buffer_idx) {
-        ev_io_stop(loop, watcher);
+    // let's collect filled buffers in queue order
+    for (ds = socket_out->flush_queue_head; ds != NULL && msg_num < DOWNSTREAM_SEND_BATCH_SIZE; ds = ds->flush_queue_next) {
+        for (buffer = ds->ready_head; buffer != NULL && msg_num < DOWNSTREAM_SEND_BATCH_SIZE; buffer = buffer->next) {
+            msg = socket_out->send_msg + msg_num;
+            iov = socket_out->send_iov + msg_num;
+            iov->iov_base = buffer->data;
+            iov->iov_len = buffer->length;
+            // connected socket has its route cached, address isn't passed
+            msg->msg_hdr.msg_name = socket_out->connected ? NULL : &(ds->sa_in_data);
+            msg->msg_hdr.msg_namelen = socket_out->connected ? 0 : sizeof(ds->sa_in_data);
+            msg->msg_hdr.msg_iov = iov;
+            msg->msg_hdr.msg_iovlen = 1;
+            msg_num++;
+        }
     }
-    if (bytes_send < 0) {
-        log_msg(WARN, "%s: sendto() failed %s", __func__, strerror(errno));
+
+    // queue can contain downstreams without filled buffers if they were dropped
+    n = 0;
+    if (msg_num > 0) {
+        thread_config->syscall_counter++;
+        n = sendmmsg(watcher->fd, socket_out->send_msg, msg_num, 0);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                return;
+            }
+            // kernel reports port unreachable of earlier send once, sending stops and data is kept
+            // health client marks downstream down and its data is rerouted, otherwise send is retried on next flush
+            if (errno == ECONNREFUSED && socket_out->connected) {
+                STATS_ADD(thread_config, send_errors, 1);
+                ds_health_refused(socket_out->flush_queue_head->health_client);
+                ev_io_stop(loop, watcher);
+                return;
+            }
+            log_msg(WARN, "%s: sendmmsg() failed %s", __func__, strerror(errno));
+            STATS_ADD(thread_config, send_errors, 1);
+            // first buffer can't be sent, let's drop it so queue can make progress
+            // failed buffer belongs to first downstream in queue which has buffers
+            ds = socket_out->flush_queue_head;
+            while (ds->ready_head == NULL) {
+                ds = ds->flush_queue_next;
+            }
+            STATS_ADD(thread_config, dropped_lines, count_lines(ds->ready_head));
+            n = 1;
+        } else {
+            sent = n;
+            for (i = 0; i < n; i++) {
+                STATS_ADD(thread_config, bytes_sent, (socket_out->send_iov + i)->iov_len);
+                STATS_ADD(thread_config, packets_sent, ((socket_out->send_iov + i)->iov_len + thread_config->buffer_pool.segment_size - 1) / thread_config->buffer_pool.segment_size);
+            }
+        }
+    }
+
+    if (sent > 0 && thread_config->latency != NULL) {
+        now = latency_now();
+    }
+    // now let's release sent buffers, they were collected in queue order
+    while ((ds = socket_out->flush_queue_head) != NULL) {
+        while (n > 0 && (buffer = ds->ready_head) != NULL) {
+            if (sent > 0 && thread_config->latency != NULL) {
+                latency_record(&(thread_config->latency->send), now - buffer->recv_time);
+                sent--;
+            }
+            ds->ready_head = buffer->next;
+            ds->ready_num--;
+            ds_buffer_free(ds->pool, buffer);
+            n--;
+        }
+        if (ds->ready_head != NULL) {
+            break;
+        }
+        ds->ready_tail = NULL;
+        socket_out->flush_queue_head = ds->flush_queue_next;
+        ds->flush_queue_next = NULL;
+        ds->flush_queued = 0;
+    }
+    if (socket_out->flush_queue_head == NULL) {
+        socket_out->flush_queue_tail = NULL;
+        ev_io_stop(loop, watcher);
     }
 }
 
-// this function switches active and flush buffers, registers handler to send data when socket would be ready
+// this function moves active buffer to the queue of filled buffers, queues downstream on its socket to send data when socket would be ready
 void ds_schedule_flush(struct downstream_s *ds, struct ev_loop *loop) {
-    struct ev_io *watcher = (struct ev_io *)ds;
-    int new_active_buffer_idx = (ds->active_buffer_idx + 1) % DOWNSTREAM_BUF_NUM;
-    // if active_buffer_idx == flush_buffer_idx this means that all previous
-    // flushes are done (no filled buffers in the queue) and we need to schedule new one
-    int need_to_schedule_flush = (ds->active_buffer_idx == ds->flush_buffer_idx);
-
-    if (ds->buffer_length[new_active_buffer_idx] > 0) {
-        log_msg(WARN, "%s: previous flush is not completed, loosing data.", __func__);
-        ds->active_buffer_length = 0;
+    struct ds_buffer_s *buffer = ds->active_buffer;
+
+    if (buffer == NULL || buffer->length == 0) {
+        // send stopped by refused data is retried even if there is nothing new
+        if (ds->ready_head != NULL) {
+            ds_queue_flush(ds, loop);
+        }
         return;
     }
-    ds->downstream_packet_counter++;
-    ds->downstream_traffic_counter += ds->active_buffer_length;
-    ds->buffer_length[ds->active_buffer_idx] = ds->active_buffer_length;
-    ds->active_buffer = ds->buffer + new_active_buffer_idx * DOWNSTREAM_BUF_SIZE;
-    ds->active_buffer_length = 0;
-    ds->active_buffer_idx = new_active_buffer_idx;
-    if (need_to_schedule_flush) {
-        ev_io_init(watcher, ds_flush_cb, *ds->socket_out, EV_WRITE);
-        ev_io_start(loop, watcher);
+    if (ds->ready_num >= DOWNSTREAM_BUF_NUM) {
+        if (ds->overflow_policy == BUFFER_OVERFLOW_DROP_NEW) {
+            log_msg(WARN, "%s: previous flush is not completed, loosing data.", __func__);
+            STATS_ADD((struct thread_config_s *)ev_userdata(loop), dropped_lines, count_lines(buffer));
+            buffer->length = 0;
+            return;
+        }
+        log_msg(WARN, "%s: previous flush is not completed, dropping oldest buffer.", __func__);
+        ds_drop_oldest(ds, loop);
+    }
+    ds->downstream_packet_counter += (buffer->length + ds->pool->segment_size - 1) / ds->pool->segment_size;
+    ds->downstream_traffic_counter += buffer->length;
+    buffer->next = NULL;
+    if (ds->ready_tail != NULL) {
+        ds->ready_tail->next = buffer;
+    } else {
+        ds->ready_head = buffer;
+    }
+    ds->ready_tail = buffer;
+    ds->ready_num++;
+    ds->active_buffer = NULL;
+    ds_queue_flush(ds, loop);
+}
+
+// this function puts downstream with ready buffers into flush queue of its socket
+void ds_queue_flush(struct downstream_s *ds, struct ev_loop *loop) {
+    struct ds_socket_out_s *socket_out = ds->socket_out;
+
+    // if downstream is not in socket flush queue this means that all previous
+    // flushes are done and we need to schedule new one
+    if (!ds->flush_queued) {
+        ds->flush_queued = 1;
+        ds->flush_queue_next = NULL;
+        if (socket_out->flush_queue_tail != NULL) {
+            socket_out->flush_queue_tail->flush_queue_next = ds;
+        } else {
+            socket_out->flush_queue_head = ds;
+        }
+        socket_out->flush_queue_tail = ds;
+    }
+    // io_uring backend submits queued sends before event loop blocks
+    // watcher of queued downstream isn't active if its send was refused
+    if (socket_out->uring == NULL && !ev_is_active((struct ev_io *)socket_out)) {
+        ev_io_start(loop, (struct ev_io *)socket_out);
     }
 }
 
 void push_to_downstream(struct downstream_s *ds, char *line, int length, struct ev_loop *loop) {
-    // check if we new data would fit in buffer
-    if (ds->active_buffer_length + length > DOWNSTREAM_BUF_SIZE) {
-        // buffer is full, let's flush data
-        ds_schedule_flush(ds, loop);
+    struct ds_buffer_s *buffer = ds->active_buffer;
+    int segment_size = ds->pool->segment_size;
+    int pad;
+
+    if (buffer != NULL) {
+        // with UDP GSO buffer is cut into equal segments, line can't cross segment border
+        // so segment is padded with new lines, statsd ignores empty lines
+        pad = segment_size - buffer->length % segment_size;
+        if (pad < length && pad < segment_size && buffer->length + pad + length <= ds->pool->buffer_size) {
+            memset(buffer->data + buffer->length, '\n', pad);
+            buffer->length += pad;
+        }
+        // check if we new data would fit in buffer
+        if (buffer->length + length > ds->pool->buffer_size || (buffer->length % segment_size) + length > segment_size) {
+            // buffer is full, let's flush data
+            ds_schedule_flush(ds, loop);
+        }
+    }
+    if (ds->active_buffer == NULL) {
+        ds->active_buffer = ds_buffer_alloc(ds->pool);
+        // memory limit is reached, let's reuse oldest buffer if policy allows
+        if (ds->active_buffer == NULL && ds->overflow_policy == BUFFER_OVERFLOW_DROP_OLDEST && ds_drop_oldest(ds, loop) == 0) {
+            log_msg(WARN, "%s: buffer memory limit is reached, dropping oldest buffer.", __func__);
+            ds->active_buffer = ds_buffer_alloc(ds->pool);
+        }
+        if (ds->active_buffer == NULL) {
+            log_msg(WARN, "%s: buffer memory limit is reached, loosing data.", __func__);
+            STATS_ADD((struct thread_config_s *)ev_userdata(loop), dropped_lines, 1);
+            return;
+        }
+    }
+    // buffer latency is measured from its oldest line
+    if (ds->active_buffer->length == 0) {
+        ds->active_buffer->recv_time = ((struct thread_config_s *)ev_userdata(loop))->recv_time;
     }
     // let's add new data to buffer
-    memcpy(ds->active_buffer + ds->active_buffer_length, line, length);
+    memcpy(ds->active_buffer->data + ds->active_buffer->length, line, length);
     // update buffer length
-    ds->active_buffer_length += length;
+    ds->active_buffer->length += length;
 }
 
-// this function pushes data to appropriate downstream using metrics name hash
-int find_downstream(char *line, unsigned long hash, int length, int downstream_num, struct downstream_s *downstream, struct ev_loop *loop) {
+// this function returns alive downstream for given hash using consistent hashing, -1 if all downstreams are dead
+// downstreams are reshuffled using hash value, first alive one in this order owns the hash
+// so if downstream dies only metrics owned by it are moved to other downstreams
+static int consistent_hash(unsigned long hash, int downstream_num, struct ds_health_client_s *health_client) {
     // array to store downstreams for consistent hashing
     int ds_index[downstream_num];
     int i, j, k;
 
-    log_msg(TRACE, "%s: hash = %lx, length = %d, line = %.*s", __func__, hash, length, length, line);
     // array is ordered before reshuffling
     for (i = 0; i < downstream_num; i++) {
         ds_index[i] = i;
@@ -98,12 +252,8 @@ int find_downstream(char *line, unsigned long hash, int length, int downstream_n
         j = hash % i;
         k = ds_index[j];
         // k is downstream number for this metric, is it alive?
-        if ((downstream + k)->health_client->alive) {
-            log_msg(TRACE, "%s: pushing to downstream %d", __func__, k);
-            push_to_downstream(downstream + k, line, length, loop);
-            return 0;
-        } else {
-            (downstream + k)->active_buffer_length = 0;
+        if ((health_client + k)->alive) {
+            return k;
         }
         if (j != i - 1) {
             ds_index[j] = ds_index[i - 1];
@@ -112,81 +262,340 @@ int find_downstream(char *line, unsigned long hash, int length, int downstream_n
         // quasi random number sequence, distribution is bad without this trick
         hash = (hash * 7 + 5) / 3;
     }
-    log_msg(WARN, "%s: all downstreams are dead", __func__);
-    return 1;
+    return -1;
 }
 
-// sdbm hashing (http://www.cse.yorku.ca/~oz/hash.html)
-int hash(char *s, int length, unsigned long *result) {
+// this function fills routing table, bucket owners are calculated the same way as in compat mode
+// bucket number is mixed to get better distribution for small numbers
+void rebuild_routing(struct ds_routing_s *routing) {
+    int *table;
+    int i;
+
+    if (routing->mode != ROUTING_MODE_TABLE) {
+        return;
+    }
+    table = (routing->active_table == routing->table[0]) ? routing->table[1] : routing->table[0];
+    // data thread can still read inactive table if it took it before previous rebuild, generation tells it to retry
+    __atomic_store_n(&routing->generation, routing->generation + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for (i = 0; i < routing->table_size; i++) {
+        table[i] = consistent_hash((unsigned long)i * 0x9e3779b97f4a7c15UL, routing->downstream_num, routing->health_client);
+    }
+    __atomic_store_n(&routing->active_table, table, __ATOMIC_RELEASE);
+    __atomic_store_n(&routing->generation, routing->generation + 1, __ATOMIC_RELEASE);
+    log_msg(DEBUG, "%s: routing table rebuilt", __func__);
+}
+
+int init_routing(struct ds_routing_s *routing, enum routing_mode_e mode, int table_size, int downstream_num, struct ds_health_client_s *health_client) {
+    routing->mode = mode;
+    routing->table_size = table_size;
+    routing->downstream_num = downstream_num;
+    routing->health_client = health_client;
+    routing->active_table = NULL;
+    routing->generation = 0;
+    if (mode != ROUTING_MODE_TABLE) {
+        return 0;
+    }
+    routing->table[0] = (int *)malloc(table_size * sizeof(int));
+    routing->table[1] = (int *)malloc(table_size * sizeof(int));
+    if (routing->table[0] == NULL || routing->table[1] == NULL) {
+        log_msg(ERROR, "%s: malloc() failed %s", __func__, strerror(errno));
+        return 1;
+    }
+    rebuild_routing(routing);
+    return 0;
+}
+
+// this function pushes data to appropriate downstream using metrics name hash
+int find_downstream(char *line, unsigned long hash, int length, int downstream_num, struct downstream_s *downstream, struct ev_loop *loop) {
+    struct ds_routing_s *routing = &((struct thread_config_s *)ev_userdata(loop))->common->routing;
+    unsigned long generation;
+    int *table;
+    int k;
+
+    log_msg(TRACE, "%s: hash = %lx, length = %d, line = %.*s", __func__, hash, length, length, line);
+    if (routing->mode == ROUTING_MODE_TABLE) {
+        // bucket is looked up again if table was rebuilt meanwhile
+        do {
+            generation = __atomic_load_n(&routing->generation, __ATOMIC_ACQUIRE);
+            table = __atomic_load_n(&routing->active_table, __ATOMIC_ACQUIRE);
+            k = __atomic_load_n(table + hash % routing->table_size, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        } while ((generation & 1) || generation != __atomic_load_n(&routing->generation, __ATOMIC_RELAXED));
+    } else {
+        // first downstream in reshuffled order is hash % downstream_num, no need to reshuffle if it is alive
+        // data buffered for dead downstream is rerouted by failover_async_cb()
+        k = hash % downstream_num;
+        if (!(downstream + k)->health_client->alive) {
+            k = consistent_hash(hash, downstream_num, downstream->health_client);
+        }
+    }
+    if (k < 0) {
+        log_msg(WARN, "%s: all downstreams are dead", __func__);
+        STATS_ADD((struct thread_config_s *)ev_userdata(loop), dropped_lines, 1);
+        return 1;
+    }
+    log_msg(TRACE, "%s: pushing to downstream %d", __func__, k);
+    push_to_downstream(downstream + k, line, length, loop);
+    return 0;
+}
+
+// sdbm hashing (http://www.cse.yorku.ca/~oz/hash.html) of metric name
+unsigned long hash(char *s, int length) {
     int i;
-    char c;
     unsigned long h = 0;
 
     for (i = 0; i < length; i++) {
-        c = *(s + i);
-        if (c == ':') {
-            *result = h;
-            return 0;
-        }
-        h = (h << 6) + (h << 16) - h + c;
+        h = (h << 6) + (h << 16) - h + *(s + i);
     }
-    return 1;
+    return h;
+}
+
+// returns length of metric name (position of first ':'), -1 if line has no ':'
+static int name_length(char *line, int length) {
+    char *delimiter_ptr = memchr(line, ':', length);
+    return (delimiter_ptr == NULL) ? -1 : delimiter_ptr - line;
 }
 
 // function to process single metrics line
-int process_data_line(char *line, int length, int downstream_num, struct downstream_s *downstream, struct ev_loop *loop) {
-    unsigned long h = 0;
+// this function routes line with known name hash via aggregation or directly to downstream
+void route_data_line(char *line, int length, int name_length, unsigned long hash, int downstream_num, struct downstream_s *downstream, struct ev_loop *loop) {
+    struct aggregation_s *aggregation = ((struct thread_config_s *)ev_userdata(loop))->aggregation;
+
+    // aggregated metrics are pushed to downstreams on flush
+    if (aggregation != NULL && aggregate_line(aggregation, line, length, name_length, hash) == 0) {
+        return;
+    }
+    find_downstream(line, hash, length, downstream_num, downstream, loop);
+}
+
+int process_data_line(char *line, int length, int name_length, int downstream_num, struct downstream_s *downstream, struct ev_loop *loop) {
+    struct thread_config_s *thread_config = (struct thread_config_s *)ev_userdata(loop);
+    unsigned long h;
+    int owner;
+
     // if ':' wasn't found this is not valid statsd metric
-    if (hash(line, length, &h) != 0) {
-        *(line + length - 1) = 0;
-        log_msg(WARN, "%s: invalid metric %s", __func__, line);
+    if (name_length < 0) {
+        log_msg(WARN, "%s: invalid metric %.*s", __func__, length - 1, line);
+        STATS_ADD(thread_config, invalid_lines, 1);
         return 1;
     }
-    find_downstream(line, h, length, downstream_num, downstream, loop);
+    h = hash(line, name_length);
+    // with name sharding line is routed by thread owning its name
+    // if owner's ring is full line is routed here, so data isn't lost
+    if (thread_config->common->name_sharding) {
+        owner = h % thread_config->common->threads_num;
+        if (owner != thread_config->index && handoff_push(thread_config, owner, line, length, name_length, h) == 0) {
+            return 0;
+        }
+    }
+    route_data_line(line, length, name_length, h, downstream_num, downstream, loop);
     return 0;
 }
 
+// function to split single datagram into lines and process them
+// buffer should have at least one spare byte after length bytes of data
+void process_datagram(char *buffer, int bytes_in_buffer, int downstream_num, struct downstream_s *downstream, struct ev_loop *loop) {
+    struct thread_config_s *thread_config = (struct thread_config_s *)ev_userdata(loop);
+    struct line_span_s span[SCAN_SPAN_NUM];
+    struct line_span_s *s;
+    char *line;
+    int max_length = thread_config->common->downstream_packet_size;
+    int offset = 0;
+    int i;
+    int n;
+
+    if (bytes_in_buffer > 0) {
+        if (buffer[bytes_in_buffer - 1] != '\n') {
+            buffer[bytes_in_buffer++] = '\n';
+        }
+        log_msg(TRACE, "%s: got packet %.*s", __func__, bytes_in_buffer, buffer);
+        // scanner finds line boundaries and metric names in one pass over the datagram
+        while (offset < bytes_in_buffer) {
+            n = scan_lines(buffer + offset, bytes_in_buffer - offset, span, SCAN_SPAN_NUM);
+            STATS_ADD(thread_config, lines, n);
+            for (i = 0; i < n; i++) {
+                s = span + i;
+                line = buffer + offset + s->offset;
+                // minimum metrics line should look like X:1|c\n
+                // so lines with length less than 6 can be ignored
+                if (s->length > 5 && s->length < max_length) {
+                    // if line has valid length let's process it
+                    process_data_line(line, s->length, s->name_length, downstream_num, downstream, loop);
+                } else {
+                    log_msg(WARN, "%s: invalid length %d of metric %.*s", __func__, s->length, s->length, line);
+                    STATS_ADD(thread_config, invalid_lines, 1);
+                }
+            }
+            // datagram is always terminated by new line, so at least one span is found
+            offset += span[n - 1].offset + span[n - 1].length;
+        }
+    }
+}
+
+// this function updates kernel drop counter of thread, kernel counter is 32 bit and may wrap
+// low 32 bits of thread counter always hold last kernel value, so difference is added
+static void set_kernel_drops(struct thread_config_s *thread_config, unsigned int drops) {
+    STATS_ADD(thread_config, kernel_drops, (unsigned int)(drops - (unsigned int)thread_config->stats.kernel_drops));
+}
+
+// this function takes kernel drop counter from control message of received datagram
+// kernel adds it only if socket has dropped something, counter is cumulative so last datagram of batch is enough
+static void recv_kernel_drops(struct thread_config_s *thread_config, struct msghdr *msg) {
+    struct cmsghdr *cmsg;
+    unsigned int drops;
+
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+            memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+            set_kernel_drops(thread_config, drops);
+            return;
+        }
+    }
+}
+
+// this function reads kernel drop counter of socket, it's used when datagrams are received without control messages
+static void read_kernel_drops(struct thread_config_s *thread_config) {
+    unsigned int meminfo[SK_MEMINFO_VARS];
+    socklen_t length = sizeof(meminfo);
+
+    if (getsockopt(thread_config->socket_in, SOL_SOCKET, SO_MEMINFO, meminfo, &length) == 0 && length > SK_MEMINFO_DROPS * sizeof(unsigned int)) {
+        set_kernel_drops(thread_config, meminfo[SK_MEMINFO_DROPS]);
+    }
+}
+
+// this function returns size of datagrams coalesced by UDP GRO, whole buffer is single datagram if kernel didn't coalesce
+static int gro_segment_size(struct mmsghdr *msg) {
+    struct cmsghdr *cmsg;
+    int segment_size = msg->msg_len;
+
+    for (cmsg = CMSG_FIRSTHDR(&msg->msg_hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg->msg_hdr, cmsg)) {
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+            memcpy(&segment_size, CMSG_DATA(cmsg), sizeof(int));
+            break;
+        }
+    }
+    if (segment_size <= 0 || segment_size > msg->msg_len) {
+        segment_size = msg->msg_len;
+    }
+    return segment_size;
+}
+
+// this function splits buffer coalesced by UDP GRO into original datagrams
+// segment size is passed in control message, if it's missing buffer holds single datagram
+static void process_gro_datagram(char *buffer, struct mmsghdr *msg, int downstream_num, struct downstream_s *downstream, struct ev_loop *loop) {
+    struct thread_config_s *thread_config = (struct thread_config_s *)ev_userdata(loop);
+    int length = msg->msg_len;
+    int segment_size = gro_segment_size(msg);
+    int offset;
+    int l;
+    char c;
+
+    for (offset = 0; offset < length; offset += segment_size) {
+        l = (length - offset < segment_size) ? length - offset : segment_size;
+        // process_datagram() may terminate datagram with new line,
+        // byte after segment belongs to next one, so it's restored afterwards
+        c = buffer[offset + l];
+        process_datagram(buffer + offset, l, downstream_num, downstream, loop);
+        buffer[offset + l] = c;
+        STATS_ADD(thread_config, datagrams, 1);
+    }
+}
+
+// this function records received datagrams to capture file
+// datagrams coalesced by UDP GRO are recorded one by one, so replay sends them as clients did
+static void capture_batch(struct thread_config_s *thread_config, struct ev_io_ds_s *ds_watcher, int n) {
+    struct mmsghdr *msg;
+    char *buffer;
+    long time;
+    int segment_size;
+    int offset;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        msg = ds_watcher->recv_msg + i;
+        buffer = ds_watcher->recv_buffer + i * ds_watcher->recv_buffer_size;
+        time = latency_recv_time(&(msg->msg_hdr));
+        segment_size = ds_watcher->recv_gro ? gro_segment_size(msg) : msg->msg_len;
+        for (offset = 0; offset < msg->msg_len; offset += segment_size) {
+            capture_datagram(thread_config->common->capture, thread_config->index, buffer + offset,
+                (msg->msg_len - offset < segment_size) ? msg->msg_len - offset : segment_size, time);
+        }
+    }
+}
+
 void udp_read_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
-    char buffer[DATA_BUF_SIZE];
-    ssize_t bytes_in_buffer;
-    char *buffer_ptr = buffer;
-    char *delimiter_ptr = buffer;
-    int line_length = 0;
-    int downstream_num = ((struct ev_io_ds_s *)watcher)->downstream_num;
-    struct downstream_s *downstream = ((struct ev_io_ds_s *)watcher)->downstream;
+    struct ev_io_ds_s *ds_watcher = (struct ev_io_ds_s *)watcher;
+    struct thread_config_s *thread_config = ds_watcher->thread_config;
+    int downstream_num = ds_watcher->downstream_num;
+    struct downstream_s *downstream = ds_watcher->downstream;
+    long start = 0;
+    int last;
+    int i;
+    int n;
 
     if (EV_ERROR & revents) {
         log_msg(WARN, "%s: invalid event %s", __func__, strerror(errno));
         return;
     }
 
-    bytes_in_buffer = recv(watcher->fd, buffer, DATA_BUF_SIZE - 1, 0);
-
-    if (bytes_in_buffer < 0) {
-        log_msg(WARN, "%s: recv() failed %s", __func__, strerror(errno));
+    if (ds_watcher->recv_control != NULL) {
+        // kernel overwrites control length on every receive
+        for (i = 0; i < ds_watcher->recv_batch_size; i++) {
+            (ds_watcher->recv_msg + i)->msg_hdr.msg_controllen = RECV_CONTROL_SIZE;
+        }
+    }
+    // let's pull as many datagrams as we can fit in receive arena with single syscall
+    thread_config->syscall_counter++;
+    n = recvmmsg(watcher->fd, ds_watcher->recv_msg, ds_watcher->recv_batch_size, MSG_DONTWAIT, NULL);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            log_msg(WARN, "%s: recvmmsg() failed %s", __func__, strerror(errno));
+        }
         return;
     }
-
-    if (bytes_in_buffer > 0) {
-        if (buffer[bytes_in_buffer - 1] != '\n') {
-            buffer[bytes_in_buffer++] = '\n';
+    thread_config->recv_call_counter++;
+    if (thread_config->latency != NULL) {
+        start = latency_now();
+    }
+    if (n > 0) {
+        recv_kernel_drops(thread_config, &((ds_watcher->recv_msg + n - 1)->msg_hdr));
+    }
+    // datagrams are captured as received, before they are offloaded or modified by parsing
+    if (thread_config->common->capture != NULL) {
+        capture_batch(thread_config, ds_watcher, n);
+    }
+    // datagrams are counted by receiving thread, including ones given to idle threads
+    // datagrams coalesced by UDP GRO are counted one by one by process_gro_datagram()
+    if (!ds_watcher->recv_gro) {
+        STATS_ADD(thread_config, datagrams, n);
+    }
+    last = n;
+    if (thread_config->common->work_stealing) {
+        // full batch means socket has more data than thread can handle, second half of it is given to idle threads
+        if (n == ds_watcher->recv_batch_size && steal_offload(thread_config, ds_watcher, n / 2, n, loop) == 0) {
+            last = n / 2;
         }
-        log_msg(TRACE, "%s: got packet %.*s", __func__, bytes_in_buffer, buffer);
-        while ((delimiter_ptr = memchr(buffer_ptr, '\n', bytes_in_buffer)) != NULL) {
-            delimiter_ptr++;
-            line_length = delimiter_ptr - buffer_ptr;
-            // minimum metrics line should look like X:1|c\n
-            // so lines with length less than 6 can be ignored
-            if (line_length > 5 && line_length < DOWNSTREAM_BUF_SIZE) {
-                // if line has valid length let's process it
-                process_data_line(buffer_ptr, line_length, downstream_num, downstream, loop);
-            } else {
-                log_msg(WARN, "%s: invalid length %d of metric %.*s", __func__, line_length, line_length, buffer_ptr);
-            }
-            // this is not last metric, let's advance line start pointer
-            buffer_ptr = delimiter_ptr;
-            bytes_in_buffer -= line_length;
+    }
+    for (i = 0; i < last; i++) {
+        if (thread_config->latency != NULL) {
+            thread_config->recv_time = latency_recv_time(&((ds_watcher->recv_msg + i)->msg_hdr));
         }
+        if (ds_watcher->recv_gro) {
+            process_gro_datagram(ds_watcher->recv_buffer + i * ds_watcher->recv_buffer_size,
+                ds_watcher->recv_msg + i, downstream_num, downstream, loop);
+        } else {
+            process_datagram(ds_watcher->recv_buffer + i * ds_watcher->recv_buffer_size,
+                (ds_watcher->recv_msg + i)->msg_len,
+                downstream_num, downstream, loop);
+        }
+    }
+    // thread isn't overloaded anymore, so batches nobody has stolen are processed here
+    if (thread_config->common->work_stealing && n < ds_watcher->recv_batch_size) {
+        steal_drain(thread_config, loop);
+    }
+    if (thread_config->latency != NULL) {
+        latency_record(&(thread_config->latency->read), latency_now() - start);
     }
 }
 
@@ -195,12 +604,25 @@ void ds_flush_timer_cb(struct ev_loop *loop, struct ev_periodic *p, int revents)
     int i;
     struct downstream_s *downstream = ((struct ev_periodic_ds_s *)p)->downstream;
     int downstream_num = ((struct ev_periodic_ds_s *)p)->downstream_num;
+    struct thread_config_s *thread_config = ((struct ev_periodic_ds_s *)p)->thread_config;
 
+    // aggregated lines are counted from flush
+    latency_mark(thread_config);
+    if (thread_config->aggregation != NULL) {
+        flush_aggregation(thread_config->aggregation, downstream_num, downstream, loop);
+    }
     for (i = 0; i < downstream_num; i++) {
-        if ((downstream + i)->active_buffer_length > 0) {
-            ds_schedule_flush(downstream + i, loop);
-        }
+        ds_schedule_flush(downstream + i, loop);
+    }
+}
+
+// this function routes internal metric line formatted by ping_cb, line cut by long ping_prefix is dropped
+static void ping_line(char *buffer, int n, int downstream_num, struct downstream_s *downstream, struct ev_loop *loop) {
+    if (n < 0 || n >= METRIC_SIZE) {
+        log_msg(WARN, "%s: internal metric is longer than %d bytes, ping_prefix is too long", __func__, METRIC_SIZE);
+        return;
     }
+    process_data_line(buffer, n, name_length(buffer, n), downstream_num, downstream, loop);
 }
 
 void ping_cb(struct ev_loop *loop, struct ev_periodic *p, int revents) {
@@ -214,7 +636,20 @@ void ping_cb(struct ev_loop *loop, struct ev_periodic *p, int revents) {
     int downstream_num = ((struct ev_periodic_ds_s *)p)->downstream_num;
     struct downstream_s *downstream = ((struct ev_periodic_ds_s *)p)->downstream;
     char *alive_downstream_metric_name = ((struct ev_periodic_ds_s *)p)->string;
+    struct thread_config_s *thread_config = ((struct ev_periodic_ds_s *)p)->thread_config;
+    long datagrams = thread_config->stats.datagrams - thread_config->ping_stats.datagrams;
+    long dropped_lines = thread_config->stats.dropped_lines - thread_config->ping_stats.dropped_lines;
+    long kernel_drops;
+    struct latency_histogram_s send_latency;
+    struct latency_histogram_s read_time;
+    double recv_batch_fill = 0.0;
 
+    // io_uring receives don't carry control messages
+    if (thread_config->uring != NULL) {
+        read_kernel_drops(thread_config);
+    }
+    kernel_drops = thread_config->stats.kernel_drops - thread_config->ping_stats.kernel_drops;
+    latency_mark(thread_config);
     for (i = 0; i < downstream_num; i++) {
         ds = downstream + i;
         if (ds->health_client->alive) {
@@ -228,14 +663,131 @@ void ping_cb(struct ev_loop *loop, struct ev_periodic *p, int revents) {
         n = sprintf(buffer, "%s:%d|c\n%s:%d|c\n",
             ds->downstream_traffic_counter_metric, traffic,
             ds->downstream_packet_counter_metric, packets);
-        process_data_line(buffer, n, downstream_num, downstream, loop);
+        process_data_line(buffer, n, name_length(buffer, n), downstream_num, downstream, loop);
     }
     n = sprintf(buffer, "%s:%d|g\n", alive_downstream_metric_name, count);
-    process_data_line(buffer, n, downstream_num, downstream, loop);
+    process_data_line(buffer, n, name_length(buffer, n), downstream_num, downstream, loop);
+    // average number of datagrams pulled per wakeup, helps to tune recv_batch_size
+    if (thread_config->recv_call_counter > 0) {
+        recv_batch_fill = (double)datagrams / thread_config->recv_call_counter;
+    }
+    n = snprintf(buffer, METRIC_SIZE, "%s.%s:%.2f|g\n", thread_config->metric_prefix, RECV_BATCH_FILL, recv_batch_fill);
+    ping_line(buffer, n, downstream_num, downstream, loop);
+    n = snprintf(buffer, METRIC_SIZE, "%s.%s:%ld|c\n", thread_config->metric_prefix, RECV_DATAGRAM_COUNTER, datagrams);
+    ping_line(buffer, n, downstream_num, downstream, loop);
+    n = snprintf(buffer, METRIC_SIZE, "%s.%s:%ld|c\n", thread_config->metric_prefix, SYSCALL_COUNTER, thread_config->syscall_counter);
+    ping_line(buffer, n, downstream_num, downstream, loop);
+    thread_config->recv_call_counter = 0;
+    thread_config->syscall_counter = 0;
+    if (thread_config->common->name_sharding) {
+        n = snprintf(buffer, METRIC_SIZE, "%s.%s:%ld|c\n%s.%s:%ld|c\n",
+            thread_config->metric_prefix, HANDOFF_COUNTER, thread_config->handoff_counter,
+            thread_config->metric_prefix, HANDOFF_FULL_COUNTER, thread_config->handoff_full_counter);
+        ping_line(buffer, n, downstream_num, downstream, loop);
+        thread_config->handoff_counter = 0;
+        thread_config->handoff_full_counter = 0;
+    }
+    n = snprintf(buffer, METRIC_SIZE, "%s.%s:%ld|c\n%s.%s:%ld|c\n",
+        thread_config->metric_prefix, FAILOVER_SAVED_COUNTER, thread_config->failover_saved_counter,
+        thread_config->metric_prefix, DROPPED_LINES_COUNTER, dropped_lines);
+    ping_line(buffer, n, downstream_num, downstream, loop);
+    n = snprintf(buffer, METRIC_SIZE, "%s.%s:%ld|c\n", thread_config->metric_prefix, KERNEL_DROPS_COUNTER, kernel_drops);
+    ping_line(buffer, n, downstream_num, downstream, loop);
+    thread_config->failover_saved_counter = 0;
+    if (thread_config->common->work_stealing) {
+        n = snprintf(buffer, METRIC_SIZE, "%s.%s:%ld|c\n%s.%s:%ld|c\n",
+            thread_config->metric_prefix, STEAL_OFFLOAD_COUNTER, thread_config->steal_offload_counter,
+            thread_config->metric_prefix, STEAL_COUNTER, thread_config->steal_counter);
+        ping_line(buffer, n, downstream_num, downstream, loop);
+        thread_config->steal_offload_counter = 0;
+        thread_config->steal_counter = 0;
+    }
+    if (thread_config->aggregation != NULL) {
+        n = snprintf(buffer, METRIC_SIZE, "%s.%s:%ld|c\n%s.%s:%ld|c\n",
+            thread_config->metric_prefix, AGGREGATION_INPUT_COUNTER, thread_config->aggregation->input_counter,
+            thread_config->metric_prefix, AGGREGATION_OUTPUT_COUNTER, thread_config->aggregation->output_counter);
+        ping_line(buffer, n, downstream_num, downstream, loop);
+        thread_config->aggregation->input_counter = 0;
+        thread_config->aggregation->output_counter = 0;
+    }
+    if (thread_config->common->latency_ping_metrics) {
+        latency_interval(&(thread_config->latency->send), &(thread_config->ping_latency->send), &send_latency);
+        latency_interval(&(thread_config->latency->read), &(thread_config->ping_latency->read), &read_time);
+        n = snprintf(buffer, METRIC_SIZE, "%s.%s:%ld|g\n%s.%s:%ld|g\n",
+            thread_config->metric_prefix, SEND_LATENCY_P50, latency_percentile(&send_latency, 50.0),
+            thread_config->metric_prefix, SEND_LATENCY_P99, latency_percentile(&send_latency, 99.0));
+        ping_line(buffer, n, downstream_num, downstream, loop);
+        n = snprintf(buffer, METRIC_SIZE, "%s.%s:%ld|g\n%s.%s:%ld|g\n",
+            thread_config->metric_prefix, READ_TIME_P50, latency_percentile(&read_time, 50.0),
+            thread_config->metric_prefix, READ_TIME_P99, latency_percentile(&read_time, 99.0));
+        ping_line(buffer, n, downstream_num, downstream, loop);
+    }
+    thread_config->ping_stats.datagrams += datagrams;
+    thread_config->ping_stats.dropped_lines += dropped_lines;
+    thread_config->ping_stats.kernel_drops += kernel_drops;
+}
+
+// this function creates outgoing sockets of data thread and spreads its downstreams over them
+// it's also called on reload, buffers of previous downstreams are moved by caller
+int init_socket_out(struct thread_config_s *thread_config, struct mmsghdr *send_msg, struct iovec *send_iov) {
+    struct sr_config_s *config = thread_config->common;
+    struct ds_socket_out_s *socket_out;
+    struct downstream_s *ds;
+    int fd;
+    int i;
+
+    thread_config->socket_out = (struct ds_socket_out_s *)malloc(config->socket_out_num * sizeof(struct ds_socket_out_s));
+    if (thread_config->socket_out == NULL) {
+        log_msg(ERROR, "%s: socket_out malloc() failed %s", __func__, strerror(errno));
+        return 1;
+    }
+    for (i = 0; i < config->socket_out_num; i++) {
+        socket_out = thread_config->socket_out + i;
+        fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if (fd < 0 ) {
+            log_msg(ERROR, "%s: socket_out socket() error %s", __func__, strerror(errno));
+            return 1;
+        }
+        ev_io_init((struct ev_io *)socket_out, ds_flush_cb, fd, EV_WRITE);
+        socket_out->flush_queue_head = NULL;
+        socket_out->flush_queue_tail = NULL;
+        socket_out->send_msg = send_msg;
+        socket_out->send_iov = send_iov;
+        socket_out->uring = thread_config->uring;
+        socket_out->connected = 0;
+    }
+    for (i = 0; i < config->downstream_num; i++) {
+        ds = thread_config->downstream + i;
+        ds->socket_out = thread_config->socket_out + (i % config->socket_out_num);
+        ds->flush_queue_next = NULL;
+        ds->flush_queued = 0;
+        ds->pool = &thread_config->buffer_pool;
+    }
+    // with connected sockets route lookup is done once and ICMP port unreachable is reported to sender
+    for (i = 0; i < config->downstream_num && config->downstream_connected_sockets; i++) {
+        ds = thread_config->downstream + i;
+        if (connect(ds->socket_out->super.fd, (struct sockaddr *)&(ds->sa_in_data), sizeof(ds->sa_in_data)) != 0) {
+            log_msg(WARN, "%s: connect() of downstream %d socket failed %s, socket stays unconnected", __func__, i, strerror(errno));
+            continue;
+        }
+        ds->socket_out->connected = 1;
+    }
+    return 0;
+}
+
+// this function enables UDP GSO on outgoing sockets of data thread
+int init_socket_out_gso(struct thread_config_s *thread_config, int packet_size) {
+    int i;
+
+    for (i = 0; i < thread_config->common->socket_out_num; i++) {
+        if (setsockopt((thread_config->socket_out + i)->super.fd, SOL_UDP, UDP_SEGMENT, &packet_size, sizeof(packet_size)) != 0) {
+            return 1;
+        }
+    }
+    return 0;
 }
 
 void *data_pipe_thread(void *args) {
-    struct sockaddr_in addr;
     struct ev_loop *loop = ev_loop_new(0);
     struct thread_config_s *thread_config = (struct thread_config_s *)args;
     struct ev_io_ds_s socket_watcher;
@@ -246,127 +798,292 @@ void *data_pipe_thread(void *args) {
     int socket_in = -1;
     ev_tstamp downstream_flush_interval = thread_config->common->downstream_flush_interval;
     int downstream_num = thread_config->common->downstream_num;
-    struct downstream_s *downstream = thread_config->common->downstream + thread_config->index * downstream_num;
+    struct downstream_s *downstream;
+    int recv_batch_size = thread_config->common->recv_batch_size;
+    int recv_buffer_size = thread_config->common->recv_buffer_size;
+    struct mmsghdr *send_msg;
+    struct iovec *send_iov;
+    int packet_size;
+    int gso_segments;
+    int rc;
     int i = 0;
     int optval = 1;
 
-    socket_in = socket(PF_INET, SOCK_DGRAM, 0);
-    if (socket_in < 0 ) {
-        log_msg(ERROR, "%s: socket_in socket() error %s", __func__, strerror(errno));
-        return NULL;
+    // router can't run without all data threads and main thread waits for them on barrier,
+    // so init failure exits instead of returning
+    // thread is placed first, so everything it allocates is local to its node
+    if (init_thread_placement(thread_config) != 0) {
+        exit(1);
     }
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(thread_config->common->data_port);
-    addr.sin_addr.s_addr = INADDR_ANY;
-
-    if (setsockopt(socket_in, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) != 0) {
-        log_msg(ERROR, "%s: setsockopt() failed %s", __func__, strerror(errno));
-        return NULL;
+    ev_set_userdata(loop, thread_config);
+    thread_config->loop = loop;
+    downstream = (struct downstream_s *)malloc(downstream_num * sizeof(struct downstream_s));
+    if (downstream == NULL) {
+        log_msg(ERROR, "%s: downstream malloc() failed %s", __func__, strerror(errno));
+        exit(1);
     }
-
-    if (bind(socket_in, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
-        log_msg(ERROR, "%s: bind() failed %s", __func__, strerror(errno));
-        return NULL;
+    memcpy(downstream, thread_config->common->downstream + thread_config->index * downstream_num, downstream_num * sizeof(struct downstream_s));
+    thread_config->downstream = downstream;
+    socket_in = thread_config->socket_in;
+    send_msg = (struct mmsghdr *)calloc(DOWNSTREAM_SEND_BATCH_SIZE, sizeof(struct mmsghdr));
+    send_iov = (struct iovec *)calloc(DOWNSTREAM_SEND_BATCH_SIZE, sizeof(struct iovec));
+    if (send_msg == NULL || send_iov == NULL) {
+        log_msg(ERROR, "%s: malloc() failed %s", __func__, strerror(errno));
+        exit(1);
     }
-
-    thread_config->socket_in = socket_in;
-    thread_config->socket_out = (int *)malloc(thread_config->common->socket_out_num * sizeof(int));
-    if (thread_config->socket_out == NULL) {
+    thread_config->uring = NULL;
+    if (init_socket_out(thread_config, send_msg, send_iov) != 0) {
+        exit(1);
+    }
+    // with UDP GSO each buffer holds several packets, kernel splits it
+    packet_size = thread_config->common->downstream_packet_size;
+    gso_segments = thread_config->common->downstream_gso_segments;
+    if (gso_segments > 1 && init_socket_out_gso(thread_config, packet_size) != 0) {
+        log_msg(WARN, "%s: UDP GSO is not supported %s, sending packets one by one", __func__, strerror(errno));
+        gso_segments = 1;
+    }
+    init_buffer_pool(&thread_config->buffer_pool, packet_size * gso_segments, packet_size, thread_config->common->buffer_pool_size,
+        &thread_config->common->buffer_memory, thread_config->common->buffer_memory_limit);
+    // coalesced datagrams can take up to 64KB, so slots should be big enough
+    socket_watcher.recv_gro = 0;
+    if (thread_config->common->recv_gro) {
+        if (setsockopt(socket_in, SOL_UDP, UDP_GRO, &optval, sizeof(optval)) != 0) {
+            log_msg(WARN, "%s: UDP GRO is not supported %s, receiving datagrams one by one", __func__, strerror(errno));
+        } else {
+            socket_watcher.recv_gro = 1;
+            recv_buffer_size = RECV_BUFFER_SIZE_MAX;
+        }
+    }
+    // latency is measured from kernel receive timestamp, captured datagrams are stamped with it too
+    thread_config->latency = NULL;
+    thread_config->ping_latency = NULL;
+    thread_config->recv_time = 0;
+    if (thread_config->common->latency_histograms && init_latency_thread(thread_config) != 0) {
+        exit(1);
+    }
+    if (thread_config->common->latency_histograms || thread_config->common->capture != NULL) {
+        if (setsockopt(socket_in, SOL_SOCKET, SO_TIMESTAMPNS, &optval, sizeof(optval)) != 0) {
+            log_msg(WARN, "%s: receive timestamps are not supported %s, latency is measured from processing", __func__, strerror(errno));
+        }
+    }
+    // control messages are always received, kernel reports drop counter in them
+    socket_watcher.recv_control = (char *)calloc(recv_batch_size, RECV_CONTROL_SIZE);
+    if (socket_watcher.recv_control == NULL) {
         log_msg(ERROR, "%s: malloc() failed %s", __func__, strerror(errno));
-        return NULL;
+        exit(1);
     }
-    for (i = 0; i < thread_config->common->socket_out_num; i++) {
-        *(thread_config->socket_out + i) = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-        if (*(thread_config->socket_out + i) < 0 ) {
-            log_msg(ERROR, "%s: socket_out socket() error %s", __func__, strerror(errno));
-            return NULL;
+    // receive arena, one slot per datagram in batch
+    socket_watcher.recv_batch_size = recv_batch_size;
+    socket_watcher.recv_buffer_size = recv_buffer_size;
+    socket_watcher.recv_buffer = (char *)malloc(recv_batch_size * recv_buffer_size);
+    socket_watcher.recv_msg = (struct mmsghdr *)calloc(recv_batch_size, sizeof(struct mmsghdr));
+    socket_watcher.recv_iov = (struct iovec *)calloc(recv_batch_size, sizeof(struct iovec));
+    if (socket_watcher.recv_buffer == NULL || socket_watcher.recv_msg == NULL || socket_watcher.recv_iov == NULL) {
+        log_msg(ERROR, "%s: receive arena malloc() failed %s", __func__, strerror(errno));
+        exit(1);
+    }
+    for (i = 0; i < recv_batch_size; i++) {
+        // one byte is reserved to terminate last line in datagram
+        (socket_watcher.recv_iov + i)->iov_base = socket_watcher.recv_buffer + i * recv_buffer_size;
+        (socket_watcher.recv_iov + i)->iov_len = recv_buffer_size - 1;
+        (socket_watcher.recv_msg + i)->msg_hdr.msg_iov = socket_watcher.recv_iov + i;
+        (socket_watcher.recv_msg + i)->msg_hdr.msg_iovlen = 1;
+        if (socket_watcher.recv_control != NULL) {
+            (socket_watcher.recv_msg + i)->msg_hdr.msg_control = socket_watcher.recv_control + i * RECV_CONTROL_SIZE;
+            (socket_watcher.recv_msg + i)->msg_hdr.msg_controllen = RECV_CONTROL_SIZE;
         }
     }
-    for (i = 0; i < downstream_num; i++) {
-        (downstream + i)->socket_out = thread_config->socket_out + (i % thread_config->common->socket_out_num);
+    thread_config->recv_call_counter = 0;
+    thread_config->syscall_counter = 0;
+    thread_config->handoff_counter = 0;
+    thread_config->handoff_full_counter = 0;
+    thread_config->steal_offload_counter = 0;
+    thread_config->steal_counter = 0;
+    thread_config->aggregation = NULL;
+    if (thread_config->common->aggregation || thread_config->common->aggregation_timers) {
+        thread_config->aggregation = init_aggregation(thread_config->common->aggregation, thread_config->common->aggregation_timers,
+            thread_config->common->aggregation_table_size, thread_config->common->aggregation_arena_size,
+            thread_config->common->downstream_packet_size);
+        if (thread_config->aggregation == NULL) {
+            exit(1);
+        }
     }
+    socket_watcher.thread_config = thread_config;
     socket_watcher.downstream_num = downstream_num;
     socket_watcher.downstream = downstream;
     ev_io_init((struct ev_io *)&socket_watcher, udp_read_cb, socket_in, EV_READ);
-    ev_io_start(loop, (struct ev_io *)&socket_watcher);
+    if (thread_config->common->io_backend == IO_BACKEND_IO_URING) {
+        thread_config->uring = init_uring(loop, thread_config, &socket_watcher, thread_config->common->io_uring_entries);
+        if (thread_config->uring == NULL) {
+            log_msg(WARN, "%s: io_uring backend is not available, falling back to libev", __func__);
+        }
+    }
+    // with io_uring socket watcher is only started if kernel can't do multishot receive
+    if (thread_config->uring == NULL) {
+        ev_io_start(loop, (struct ev_io *)&socket_watcher);
+    }
 
     ds_flush_timer_watcher.downstream_num = downstream_num;
     ds_flush_timer_watcher.downstream = downstream;
+    ds_flush_timer_watcher.thread_config = thread_config;
     ev_periodic_init ((struct ev_periodic *)(&ds_flush_timer_watcher), ds_flush_timer_cb, ds_flush_timer_at, downstream_flush_interval, 0);
     ev_periodic_start (loop, (struct ev_periodic *)(&ds_flush_timer_watcher));
 
     ping_timer_watcher.downstream_num = downstream_num;
     ping_timer_watcher.downstream = downstream;
     ping_timer_watcher.string = thread_config->alive_downstream_metric_name;
+    ping_timer_watcher.thread_config = thread_config;
     ev_periodic_init((struct ev_periodic *)&ping_timer_watcher, ping_cb, ping_timer_at, thread_config->common->downstream_ping_interval, 0);
     ev_periodic_start (loop, (struct ev_periodic *)&ping_timer_watcher);
 
+    thread_config->socket_watcher = &socket_watcher;
+    thread_config->flush_timer = &ds_flush_timer_watcher;
+    thread_config->ping_timer = &ping_timer_watcher;
+    init_reload_thread(loop, thread_config);
+    init_drain_thread(loop, thread_config);
+
+    if (thread_config->common->name_sharding && init_handoff_thread(loop, thread_config) != 0) {
+        exit(1);
+    }
+    init_failover_thread(loop, thread_config);
+    if (thread_config->common->work_stealing && init_steal_thread(loop, thread_config) != 0) {
+        exit(1);
+    }
+    rc = pthread_barrier_wait(&(thread_config->common->thread_barrier));
+    if (rc != 0 && rc != PTHREAD_BARRIER_SERIAL_THREAD) {
+        log_msg(ERROR, "%s: pthread_barrier_wait() failed", __func__);
+        return NULL;
+    }
     ev_loop(loop, 0);
     log_msg(ERROR, "%s: ev_loop() exited", __func__);
     return NULL;
 }
 
-int main(int argc, char *argv[]) {
-    struct ev_loop *loop = ev_loop_new(0);
+// this function opens control port
+static int init_control_socket(struct sr_config_s *config) {
     struct sockaddr_in addr;
-    struct ev_io_control control_socket_watcher;
-    struct ev_periodic_health_client_s ds_health_check_timer_watcher;
-    int i;
     int optval = 1;
-    int control_socket = -1;
-    ev_tstamp ds_health_check_timer_at = 0.0;
-    struct sr_config_s config;
-
-   if (argc != 2) {
-        fprintf(stdout, "Usage: %s config.file\n", argv[0]);
-        exit(1);
-    }
-    if (init_config(argv[1], &config) != 0) {
-        log_msg(ERROR, "%s: init_config() failed", __func__);
-        exit(1);
-    }
+    int control_socket;
 
     control_socket = socket(PF_INET, SOCK_STREAM, 0);
     if (control_socket < 0 ) {
         log_msg(ERROR, "%s: socket() error %s", __func__, strerror(errno));
-        return(1);
+        return 1;
     }
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
-    addr.sin_port = htons(config.control_port);
+    addr.sin_port = htons(config->control_port);
     addr.sin_addr.s_addr = INADDR_ANY;
 
+    // http stats connections are closed by router, so port can be in TIME_WAIT on restart
+    setsockopt(control_socket, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
     if (bind(control_socket, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
         log_msg(ERROR, "%s: bind() failed %s", __func__, strerror(errno));
-        return(1);
+        return 1;
     }
 
-    setsockopt(control_socket, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
     if (listen(control_socket, 4096) < 0) {
         log_msg(ERROR, "%s: listen() error %s", __func__, strerror(errno));
-        return(1);
+        return 1;
     }
+    config->control_socket = control_socket;
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    struct ev_loop *loop = ev_loop_new(0);
+    struct ev_io_control control_socket_watcher;
+    int i;
+    struct sr_config_s config;
 
+   if (argc != 2) {
+        fprintf(stdout, "Usage: %s config.file\n", argv[0]);
+        exit(1);
+    }
+    if (init_config(argv[1], &config) != 0) {
+        log_msg(ERROR, "%s: init_config() failed", __func__);
+        exit(1);
+    }
+    // data threads and health checks don't block on stdout, their messages are written by log writer thread
+    if (init_log() != 0) {
+        exit(1);
+    }
+    init_scan();
+    // running router passes its sockets to the new one, so datagrams queued in them aren't lost
+    if (config.upgrade_socket != NULL && upgrade_connect(&config) != 0) {
+        log_msg(ERROR, "%s: upgrade_connect() failed", __func__);
+        exit(1);
+    }
+    // replayed datagrams are received from loopback sockets instead of data port
+    if (config.replay_file != NULL) {
+        if (init_replay(&config) != 0) {
+            log_msg(ERROR, "%s: init_replay() failed", __func__);
+            exit(1);
+        }
+    } else if (config.upgrade_fd < 0 && init_data_sockets(&config) != 0) {
+        log_msg(ERROR, "%s: init_data_sockets() failed", __func__);
+        exit(1);
+    }
+    if (config.capture_file != NULL && init_capture(&config) != 0) {
+        log_msg(ERROR, "%s: init_capture() failed", __func__);
+        exit(1);
+    }
+    if (pthread_barrier_init(&(config.thread_barrier), NULL, config.threads_num + 1) != 0) {
+        log_msg(ERROR, "%s: pthread_barrier_init() failed", __func__);
+        exit(1);
+    }
+    if (config.name_sharding && init_handoff(&config) != 0) {
+        log_msg(ERROR, "%s: init_handoff() failed", __func__);
+        exit(1);
+    }
 
-    config.control_socket = control_socket;
+    if (config.upgrade_fd < 0 && init_control_socket(&config) != 0) {
+        return(1);
+    }
     control_socket_watcher.health_response = config.health_check_response_buf;
     control_socket_watcher.health_response_len = &config.health_check_response_buf_length;
-    ev_io_init((struct ev_io *)&control_socket_watcher, control_accept_cb, control_socket, EV_READ);
+    control_socket_watcher.common = &config;
+    control_socket_watcher.stats_response = NULL;
+    control_socket_watcher.close_after_write = 0;
+    ev_io_init((struct ev_io *)&control_socket_watcher, control_accept_cb, config.control_socket, EV_READ);
     ev_io_start(loop, (struct ev_io *)&control_socket_watcher);
 
-    ds_health_check_timer_watcher.downstream_num = config.downstream_num;
-    ds_health_check_timer_watcher.health_client = config.health_client;
-    ev_periodic_init((struct ev_periodic *)&ds_health_check_timer_watcher, ds_health_check_timer_cb, ds_health_check_timer_at, config.downstream_health_check_interval, 0);
-    ev_periodic_start(loop, (struct ev_periodic *)&ds_health_check_timer_watcher);
+    // downstreams are considered alive during replay, replay runs with downstreams of its config until it's done
+    if (config.replay == NULL) {
+        init_health_checks(loop, &config);
+        init_reload(loop, &config);
+    }
+    init_drain(loop, &config);
 
     for (i = 0; i < config.threads_num; i++) {
         (config.thread_config + i)->index = i;
         (config.thread_config + i)->common = &config;
         pthread_create(&(config.thread_config + i)->thread, NULL, data_pipe_thread, (void *)(config.thread_config + i));
     }
+    // health client can notify data threads only after they are initialized
+    i = pthread_barrier_wait(&(config.thread_barrier));
+    if (i != 0 && i != PTHREAD_BARRIER_SERIAL_THREAD) {
+        log_msg(ERROR, "%s: pthread_barrier_wait() failed", __func__);
+        exit(1);
+    }
+    if (config.upgrade_fd >= 0) {
+        upgrade_ready(&config);
+    }
+    // router stays usable if it can't listen for next upgrade
+    if (config.upgrade_socket != NULL && init_upgrade(loop, &config) != 0) {
+        log_msg(WARN, "%s: init_upgrade() failed, upgrade is disabled", __func__);
+    }
+    if (config.replay != NULL && start_replay(loop, &config) != 0) {
+        log_msg(ERROR, "%s: start_replay() failed", __func__);
+        exit(1);
+    }
 
     ev_loop(loop, 0);
+    // loop is stopped only when replay is done
+    // exit() keeps config on the stack for exit handlers, return would release it
+    if (config.replay != NULL) {
+        exit(0);
+    }
     log_msg(ERROR, "%s: ev_loop() exited", __func__);
     return(0);
 }
@@ -19,6 +19,7 @@
 #define _SR_MAIN_H
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdio.h>
 #include <netinet/in.h>
@@ -31,6 +32,9 @@
 #include <unistd.h>
 #include <errno.h>
 #include <pthread.h>
+#include <netinet/udp.h>
+#include <linux/sock_diag.h>
+#include <sys/un.h>
 
 #include "sr-util.h"
 #include "sr-types.h"
@@ -41,15 +45,146 @@
 #define PER_DOWNSTREAM_COUNTER_METRIC_SUFFIX "connections:1|c"
 #define DOWNSTREAM_PACKET_COUNTER "packets"
 #define DOWNSTREAM_TRAFFIC_COUNTER "traffic"
+#define RECV_BATCH_FILL "recv_batch_fill"
+#define RECV_DATAGRAM_COUNTER "datagrams"
+#define SYSCALL_COUNTER "syscalls"
+#define HANDOFF_COUNTER "handoff_lines"
+#define HANDOFF_FULL_COUNTER "handoff_ring_full"
+#define FAILOVER_SAVED_COUNTER "failover_saved_lines"
+#define DROPPED_LINES_COUNTER "dropped_lines"
+#define KERNEL_DROPS_COUNTER "kernel_drops"
+#define SEND_LATENCY_P50 "send_latency_p50_us"
+#define SEND_LATENCY_P99 "send_latency_p99_us"
+#define READ_TIME_P50 "read_time_p50_us"
+#define READ_TIME_P99 "read_time_p99_us"
+#define STEAL_OFFLOAD_COUNTER "offloaded_datagrams"
+#define STEAL_COUNTER "stolen_datagrams"
+#define AGGREGATION_INPUT_COUNTER "aggregation_input"
+#define AGGREGATION_OUTPUT_COUNTER "aggregation_output"
+
+// UDP GSO socket option, older headers don't define it
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+// stats have single writer, so load and store are enough to let other threads read them without locks
+#define STATS_ADD(thread_config, field, n) __atomic_store_n(&((thread_config)->stats.field), (thread_config)->stats.field + (n), __ATOMIC_RELAXED)
+// control message space for GRO segment size, receive timestamp and kernel drop counter
+#define RECV_CONTROL_SIZE (CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(struct timespec)) + CMSG_SPACE(sizeof(unsigned int)))
 
 // Size of other temporary buffers
 #define DATA_BUF_SIZE 4096
+// Limits for receive batching
+#define RECV_BATCH_SIZE_MAX 1024
+#define RECV_BUFFER_SIZE_MIN 64
+#define RECV_BUFFER_SIZE_MAX 65536
+// Default aggregation limits
+#define AGGREGATION_TABLE_SIZE 65536
+#define AGGREGATION_ARENA_SIZE (16 * 1024 * 1024)
+// Default outgoing buffers limits
+#define BUFFER_MEMORY_LIMIT (256L * 1024 * 1024)
+#define BUFFER_POOL_SIZE 1024
+// How many lines are scanned at once
+#define SCAN_SPAN_NUM 64
+// Default size of routing table
+#define ROUTING_TABLE_SIZE 65536
+#define NAME_SHARDING_RING_SIZE (256 * 1024)
+// max number of batches stolen per wakeup
+#define STEAL_BATCH_LIMIT 16
+// io_uring submission queue size
+#define IO_URING_ENTRIES 1024
+#define IO_URING_ENTRIES_MAX 32768
 #define DOWNSTREAM_HEALTH_CHECK_BUF_SIZE 32
-#define CONTROL_REQUEST_BUF_SIZE 32
+// large enough for http request headers of prometheus scraper
+#define CONTROL_REQUEST_BUF_SIZE 4096
+#define STATS_REQUEST "stats"
+#define STATS_HTTP_REQUEST "GET"
+// space for single stats line and for http response header
+#define STATS_LINE_SIZE 128
+#define STATS_HTTP_HEADER_SIZE 256
+#define STATS_PROMETHEUS_PREFIX "statsd_router_"
 #define LOG_BUF_SIZE 2048
+// Default capture file size
+#define CAPTURE_SIZE (1024L * 1024 * 1024)
+// records are 8 byte aligned, so record headers in mapped file are aligned too
+#define CAPTURE_RECORD_SIZE(length) ((sizeof(struct capture_record_s) + (length) + 7) & ~7L)
+// how many datagrams are replayed with single sendmmsg()
+#define REPLAY_BATCH_SIZE 64
+// receive buffer of replay sockets, replay waits while it's half full
+#define REPLAY_RCVBUF (8 * 1024 * 1024)
+#define REPLAY_WAIT_NS 20000
+#define HOST_NAME_SIZE 64
+// Default drain limits
+#define DRAIN_TIMEOUT 5.0
+#define DRAIN_CHECK_INTERVAL 0.01
 
 int init_config(char *filename, struct sr_config_s *config);
+int load_config(char *filename, struct sr_config_s *config);
+int init_downstream(struct sr_config_s *config, char *hostname);
+int init_socket_out_num(struct sr_config_s *config);
 void control_accept_cb(struct ev_loop *loop, struct ev_io *watcher, int revents);
-void ds_health_check_timer_cb(struct ev_loop *loop, struct ev_periodic *p, int revents);
+void init_health_checks(struct ev_loop *loop, struct sr_config_s *config);
+void start_health_checks(struct ev_loop *loop, struct sr_config_s *config);
+void stop_health_checks(struct ev_loop *loop, struct sr_config_s *config);
+void ds_health_refused(struct ds_health_client_s *health_client);
+void init_scan(void);
+extern int (*scan_lines)(char *buffer, int length, struct line_span_s *span, int max_spans);
+void init_buffer_pool(struct ds_buffer_pool_s *pool, int buffer_size, int segment_size, int free_max, long *memory, long memory_limit);
+struct ds_buffer_s *ds_buffer_alloc(struct ds_buffer_pool_s *pool);
+void ds_buffer_free(struct ds_buffer_pool_s *pool, struct ds_buffer_s *buffer);
+unsigned long hash(char *s, int length);
+void push_to_downstream(struct downstream_s *ds, char *line, int length, struct ev_loop *loop);
+void ds_schedule_flush(struct downstream_s *ds, struct ev_loop *loop);
+void ds_queue_flush(struct downstream_s *ds, struct ev_loop *loop);
+int init_socket_out(struct thread_config_s *thread_config, struct mmsghdr *send_msg, struct iovec *send_iov);
+int init_socket_out_gso(struct thread_config_s *thread_config, int packet_size);
+void ds_flush_cb(struct ev_loop *loop, struct ev_io *watcher, int revents);
+int process_data_line(char *line, int length, int name_length, int downstream_num, struct downstream_s *downstream, struct ev_loop *loop);
+int find_downstream(char *line, unsigned long hash, int length, int downstream_num, struct downstream_s *downstream, struct ev_loop *loop);
+struct aggregation_s *init_aggregation(int basic, int timers, int table_size, int arena_size, int line_size);
+int aggregate_line(struct aggregation_s *aggregation, char *line, int length, int name_length, unsigned long name_hash);
+void flush_aggregation(struct aggregation_s *aggregation, int downstream_num, struct downstream_s *downstream, struct ev_loop *loop);
+int init_routing(struct ds_routing_s *routing, enum routing_mode_e mode, int table_size, int downstream_num, struct ds_health_client_s *health_client);
+void rebuild_routing(struct ds_routing_s *routing);
+void process_datagram(char *buffer, int bytes_in_buffer, int downstream_num, struct downstream_s *downstream, struct ev_loop *loop);
+int parse_cpu_list(char *s, int *list, int max);
+int init_thread_placement(struct thread_config_s *thread_config);
+int init_data_sockets(struct sr_config_s *config);
+void route_data_line(char *line, int length, int name_length, unsigned long hash, int downstream_num, struct downstream_s *downstream, struct ev_loop *loop);
+int init_handoff(struct sr_config_s *config);
+int init_handoff_thread(struct ev_loop *loop, struct thread_config_s *thread_config);
+int handoff_push(struct thread_config_s *thread_config, int owner, char *line, int length, int name_length, unsigned long hash);
+int handoff_drain(struct thread_config_s *thread_config, struct ev_loop *loop);
+int init_steal_thread(struct ev_loop *loop, struct thread_config_s *thread_config);
+int steal_offload(struct thread_config_s *thread_config, struct ev_io_ds_s *socket_watcher, int first, int last, struct ev_loop *loop);
+int steal_drain(struct thread_config_s *thread_config, struct ev_loop *loop);
+int count_lines(struct ds_buffer_s *buffer);
+void init_failover_thread(struct ev_loop *loop, struct thread_config_s *thread_config);
+void failover_downstream(struct thread_config_s *thread_config, struct downstream_s *ds, struct ev_loop *loop);
+long latency_now(void);
+void latency_mark(struct thread_config_s *thread_config);
+long latency_recv_time(struct msghdr *msg);
+void latency_record(struct latency_histogram_s *histogram, long ns);
+void latency_add(struct latency_histogram_s *total, struct latency_histogram_s *histogram);
+void latency_interval(struct latency_histogram_s *current, struct latency_histogram_s *last, struct latency_histogram_s *interval);
+long latency_percentile(struct latency_histogram_s *histogram, double percentile);
+int init_latency_thread(struct thread_config_s *thread_config);
+void failover_notify(struct sr_config_s *config);
+int init_capture(struct sr_config_s *config);
+void capture_datagram(struct capture_s *capture, int thread, char *buffer, int length, long time);
+int init_replay(struct sr_config_s *config);
+int start_replay(struct ev_loop *loop, struct sr_config_s *config);
+void init_reload(struct ev_loop *loop, struct sr_config_s *config);
+int upgrade_connect(struct sr_config_s *config);
+void upgrade_ready(struct sr_config_s *config);
+int init_upgrade(struct ev_loop *loop, struct sr_config_s *config);
+void init_drain(struct ev_loop *loop, struct sr_config_s *config);
+void init_drain_thread(struct ev_loop *loop, struct thread_config_s *thread_config);
+void uring_stop_recv(struct uring_s *uring, struct ev_loop *loop);
+int uring_pending_sends(struct uring_s *uring);
+void init_reload_thread(struct ev_loop *loop, struct thread_config_s *thread_config);
+struct uring_s *init_uring(struct ev_loop *loop, struct thread_config_s *thread_config, struct ev_io_ds_s *socket_watcher, int entries);
 
 #endif
@@ -0,0 +1,198 @@
+#include "sr-main.h"
+#include <sched.h>
+#include <linux/filter.h>
+
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+// memory policy mode, numaif.h is part of libnuma and may be missing
+#define MPOL_PREFERRED 1
+#define NUMA_NODE_MAX 1024
+#define NODE_CPU_LIST_PATH "/sys/devices/system/node/node%d/cpulist"
+
+// this function parses list of cpus or numa nodes like 0,2,4-7, returns number of entries or -1 on error
+int parse_cpu_list(char *s, int *list, int max) {
+    char *endptr;
+    int n = 0;
+    int first;
+    int last;
+
+    while (*s != 0 && *s != '\n') {
+        first = strtol(s, &endptr, 10);
+        if (endptr == s || first < 0) {
+            return -1;
+        }
+        last = first;
+        s = endptr;
+        if (*s == '-') {
+            s++;
+            last = strtol(s, &endptr, 10);
+            if (endptr == s || last < first) {
+                return -1;
+            }
+            s = endptr;
+        }
+        for (; first <= last; first++) {
+            if (n == max) {
+                return -1;
+            }
+            *(list + n++) = first;
+        }
+        if (*s == ',') {
+            s++;
+        } else if (*s != 0 && *s != '\n') {
+            return -1;
+        }
+    }
+    return n;
+}
+
+// this function fills cpu set with all cpus of numa node
+static int node_cpu_set(int node, cpu_set_t *cpu_set) {
+    char path[METRIC_SIZE];
+    char buffer[DATA_BUF_SIZE];
+    int cpu[CPU_SETSIZE];
+    FILE *f;
+    int n;
+    int i;
+
+    sprintf(path, NODE_CPU_LIST_PATH, node);
+    f = fopen(path, "r");
+    if (f == NULL) {
+        log_msg(ERROR, "%s: can't open %s %s", __func__, path, strerror(errno));
+        return 1;
+    }
+    n = (fgets(buffer, sizeof(buffer), f) == NULL) ? -1 : parse_cpu_list(buffer, cpu, CPU_SETSIZE);
+    fclose(f);
+    if (n <= 0) {
+        log_msg(ERROR, "%s: can't parse %s", __func__, path);
+        return 1;
+    }
+    CPU_ZERO(cpu_set);
+    for (i = 0; i < n; i++) {
+        CPU_SET(cpu[i], cpu_set);
+    }
+    return 0;
+}
+
+// this function pins calling data thread to its cpu or numa node and makes its memory allocations node local
+// it should be called by data thread itself before it allocates anything
+int init_thread_placement(struct thread_config_s *thread_config) {
+    unsigned long node_mask[NUMA_NODE_MAX / (8 * sizeof(unsigned long))];
+    cpu_set_t cpu_set;
+    int node = thread_config->numa_node;
+
+    if (thread_config->cpu >= 0) {
+        CPU_ZERO(&cpu_set);
+        CPU_SET(thread_config->cpu, &cpu_set);
+    } else if (node >= 0) {
+        if (node_cpu_set(node, &cpu_set) != 0) {
+            return 1;
+        }
+    } else {
+        return 0;
+    }
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) != 0) {
+        log_msg(ERROR, "%s: pthread_setaffinity_np() failed for thread %d", __func__, thread_config->index);
+        return 1;
+    }
+    if (node >= 0) {
+        // memory is preferred from the node, kernel falls back to other nodes if it's exhausted
+        memset(node_mask, 0, sizeof(node_mask));
+        node_mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+        if (syscall(__NR_set_mempolicy, MPOL_PREFERRED, node_mask, NUMA_NODE_MAX) != 0) {
+            log_msg(WARN, "%s: set_mempolicy() failed %s, thread %d memory won't be node local", __func__, strerror(errno), thread_config->index);
+        }
+    }
+    log_msg(INFO, "%s: thread %d is placed on cpu %d node %d", __func__, thread_config->index, thread_config->cpu, node);
+    return 0;
+}
+
+// this function attaches reuseport program which selects socket by cpu packet was received on
+// socket of thread pinned to that cpu is selected, for other cpus it's cpu % threads_num
+static int attach_reuseport_cbpf(struct sr_config_s *config, int fd) {
+    struct sock_filter code[2 * config->threads_num + 3];
+    struct sock_fprog prog;
+    int n = 0;
+    int i;
+
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+    for (i = 0; i < config->threads_num; i++) {
+        if ((config->thread_config + i)->cpu >= 0) {
+            code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (config->thread_config + i)->cpu, 0, 1);
+            code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, i);
+        }
+    }
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, config->threads_num);
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+    prog.len = n;
+    prog.filter = code;
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) != 0) {
+        log_msg(ERROR, "%s: setsockopt() failed %s", __func__, strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+// this function creates data sockets of all threads
+// sockets are bound in thread order, so socket index in reuseport group is equal to thread index
+int init_data_sockets(struct sr_config_s *config) {
+    struct thread_config_s *thread_config;
+    struct sockaddr_in addr;
+    socklen_t optlen = sizeof(int);
+    int optval = 1;
+    int rcvbuf;
+    int fd;
+    int i;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(config->data_port);
+    addr.sin_addr.s_addr = INADDR_ANY;
+    for (i = 0; i < config->threads_num; i++) {
+        thread_config = config->thread_config + i;
+        fd = socket(PF_INET, SOCK_DGRAM, 0);
+        if (fd < 0) {
+            log_msg(ERROR, "%s: socket() error %s", __func__, strerror(errno));
+            return 1;
+        }
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) != 0) {
+            log_msg(ERROR, "%s: setsockopt() failed %s", __func__, strerror(errno));
+            return 1;
+        }
+        // SO_RCVBUFFORCE isn't limited by net.core.rmem_max, but requires CAP_NET_ADMIN
+        if (config->socket_rcvbuf > 0
+            && setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &(config->socket_rcvbuf), sizeof(int)) != 0
+            && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &(config->socket_rcvbuf), sizeof(int)) != 0) {
+            log_msg(ERROR, "%s: setsockopt() failed %s", __func__, strerror(errno));
+            return 1;
+        }
+        // kernel passes counter of dropped datagrams with each received one
+        if (setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &optval, sizeof(optval)) != 0) {
+            log_msg(WARN, "%s: SO_RXQ_OVFL is not supported %s, kernel drops won't be reported", __func__, strerror(errno));
+        }
+        if (config->reuseport_steering == REUSEPORT_STEERING_INCOMING_CPU
+            && setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &(thread_config->cpu), sizeof(int)) != 0) {
+            log_msg(ERROR, "%s: setsockopt() failed %s", __func__, strerror(errno));
+            return 1;
+        }
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            log_msg(ERROR, "%s: bind() failed %s", __func__, strerror(errno));
+            return 1;
+        }
+        thread_config->socket_in = fd;
+    }
+    if (config->socket_rcvbuf > 0) {
+        // kernel doubles requested value, it's capped by net.core.rmem_max for SO_RCVBUF
+        if (getsockopt(config->thread_config->socket_in, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &optlen) == 0 && rcvbuf < config->socket_rcvbuf) {
+            log_msg(WARN, "%s: socket_rcvbuf is limited to %d by net.core.rmem_max", __func__, rcvbuf / 2);
+        }
+    }
+    if (config->reuseport_steering == REUSEPORT_STEERING_CBPF) {
+        return attach_reuseport_cbpf(config, config->thread_config->socket_in);
+    }
+    return 0;
+}
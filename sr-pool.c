@@ -0,0 +1,50 @@
+#include "sr-main.h"
+
+// this function initializes per thread pool of outgoing buffers
+void init_buffer_pool(struct ds_buffer_pool_s *pool, int buffer_size, int segment_size, int free_max, long *memory, long memory_limit) {
+    pool->free_list = NULL;
+    pool->free_num = 0;
+    pool->free_max = free_max;
+    pool->buffer_size = buffer_size;
+    pool->segment_size = segment_size;
+    pool->memory = memory;
+    pool->memory_limit = memory_limit;
+}
+
+// this function returns empty buffer, NULL if memory limit is reached
+struct ds_buffer_s *ds_buffer_alloc(struct ds_buffer_pool_s *pool) {
+    struct ds_buffer_s *buffer = pool->free_list;
+    long size = sizeof(struct ds_buffer_s) + pool->buffer_size;
+
+    if (buffer != NULL) {
+        pool->free_list = buffer->next;
+        pool->free_num--;
+    } else {
+        // memory limit is shared by all threads
+        if (__atomic_add_fetch(pool->memory, size, __ATOMIC_RELAXED) > pool->memory_limit) {
+            __atomic_sub_fetch(pool->memory, size, __ATOMIC_RELAXED);
+            return NULL;
+        }
+        buffer = (struct ds_buffer_s *)malloc(size);
+        if (buffer == NULL) {
+            __atomic_sub_fetch(pool->memory, size, __ATOMIC_RELAXED);
+            log_msg(WARN, "%s: malloc() failed %s", __func__, strerror(errno));
+            return NULL;
+        }
+    }
+    buffer->next = NULL;
+    buffer->length = 0;
+    return buffer;
+}
+
+// this function returns buffer to the pool, buffers above free_max are returned to the system
+void ds_buffer_free(struct ds_buffer_pool_s *pool, struct ds_buffer_s *buffer) {
+    if (pool->free_num < pool->free_max) {
+        buffer->next = pool->free_list;
+        pool->free_list = buffer;
+        pool->free_num++;
+        return;
+    }
+    free(buffer);
+    __atomic_sub_fetch(pool->memory, sizeof(struct ds_buffer_s) + pool->buffer_size, __ATOMIC_RELAXED);
+}
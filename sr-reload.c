@@ -0,0 +1,304 @@
+#include "sr-main.h"
+
+// settings which are applied only on restart, reload keeps their current values
+struct restart_field_s {
+    char *name;
+    size_t offset;
+    size_t size;
+};
+
+#define RESTART_FIELD(name, field) {name, offsetof(struct sr_config_s, field), sizeof(((struct sr_config_s *)0)->field)}
+
+static struct restart_field_s restart_fields[] = {
+    RESTART_FIELD("data_port", data_port),
+    RESTART_FIELD("control_port", control_port),
+    RESTART_FIELD("threads_num", threads_num),
+    RESTART_FIELD("recv_batch_size", recv_batch_size),
+    RESTART_FIELD("recv_buffer_size", recv_buffer_size),
+    RESTART_FIELD("socket_rcvbuf", socket_rcvbuf),
+    RESTART_FIELD("recv_gro", recv_gro),
+    RESTART_FIELD("io_backend", io_backend),
+    RESTART_FIELD("io_uring_entries", io_uring_entries),
+    RESTART_FIELD("thread_cpu_affinity", thread_cpu),
+    RESTART_FIELD("thread_cpu_affinity", thread_cpu_num),
+    RESTART_FIELD("thread_numa_affinity", thread_numa_node),
+    RESTART_FIELD("thread_numa_affinity", thread_numa_node_num),
+    RESTART_FIELD("reuseport_steering", reuseport_steering),
+    RESTART_FIELD("name_sharding", name_sharding),
+    RESTART_FIELD("name_sharding_ring_size", name_sharding_ring_size),
+    RESTART_FIELD("work_stealing", work_stealing),
+    RESTART_FIELD("latency_histograms", latency_histograms),
+    RESTART_FIELD("latency_ping_metrics", latency_ping_metrics),
+    RESTART_FIELD("aggregation", aggregation),
+    RESTART_FIELD("aggregation_timers", aggregation_timers),
+    RESTART_FIELD("aggregation_table_size", aggregation_table_size),
+    RESTART_FIELD("aggregation_arena_size", aggregation_arena_size),
+    RESTART_FIELD("downstream_packet_size", downstream_packet_size),
+    RESTART_FIELD("downstream_gso_segments", downstream_gso_segments),
+    RESTART_FIELD("buffer_memory_limit", buffer_memory_limit),
+    RESTART_FIELD("buffer_pool_size", buffer_pool_size),
+    RESTART_FIELD("downstream_connected_sockets", downstream_connected_sockets),
+    RESTART_FIELD("routing_mode", routing.mode),
+    RESTART_FIELD("routing_table_size", routing.table_size),
+    RESTART_FIELD("capture_size", capture_size),
+    RESTART_FIELD("replay_speed", replay_speed),
+};
+
+static struct restart_field_s restart_strings[] = {
+    RESTART_FIELD("ping_prefix", ping_prefix),
+    RESTART_FIELD("capture_file", capture_file),
+    RESTART_FIELD("replay_file", replay_file),
+    RESTART_FIELD("upgrade_socket", upgrade_socket),
+};
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
+
+static void reload_barrier_wait(struct sr_config_s *config) {
+    int rc = pthread_barrier_wait(&(config->thread_barrier));
+
+    if (rc != 0 && rc != PTHREAD_BARRIER_SERIAL_THREAD) {
+        log_msg(ERROR, "%s: pthread_barrier_wait() failed", __func__);
+        exit(1);
+    }
+}
+
+// this function reverts settings which can't be changed without restart to their current values
+static void reload_restart_fields(struct sr_config_s *config, struct sr_config_s *new) {
+    struct restart_field_s *f;
+    char *last = NULL;
+    char **old_string;
+    char **new_string;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(restart_fields); i++) {
+        f = restart_fields + i;
+        if (memcmp((char *)config + f->offset, (char *)new + f->offset, f->size) == 0) {
+            continue;
+        }
+        if (last != f->name) {
+            log_msg(WARN, "%s: %s can't be changed without restart", __func__, f->name);
+        }
+        last = f->name;
+        memcpy((char *)new + f->offset, (char *)config + f->offset, f->size);
+    }
+    for (i = 0; i < ARRAY_SIZE(restart_strings); i++) {
+        f = restart_strings + i;
+        old_string = (char **)((char *)config + f->offset);
+        new_string = (char **)((char *)new + f->offset);
+        if ((*old_string == NULL) != (*new_string == NULL) || (*old_string != NULL && strcmp(*old_string, *new_string) != 0)) {
+            log_msg(WARN, "%s: %s can't be changed without restart", __func__, f->name);
+        }
+        free(*new_string);
+        *new_string = *old_string;
+    }
+}
+
+// this function replaces downstreams of config with the new ones, data threads are parked meanwhile
+// health state of kept downstreams is carried over, so reload doesn't move their traffic
+static void reload_swap(struct sr_config_s *config, struct sr_config_s *new) {
+    struct ds_health_client_s *health_client;
+    struct ds_health_client_s *old;
+    int i;
+    int j;
+
+    for (i = 0; i < new->downstream_num; i++) {
+        health_client = new->health_client + i;
+        health_client->common = config;
+        health_client->routing = &config->routing;
+        for (j = 0; j < config->downstream_num; j++) {
+            old = config->health_client + j;
+            if (memcmp(&(old->sa_in), &(health_client->sa_in), sizeof(old->sa_in)) == 0) {
+                health_client->alive = old->alive;
+                health_client->failures = old->failures;
+                health_client->successes = old->successes;
+                break;
+            }
+        }
+    }
+    config->downstream_str = new->downstream_str;
+    config->downstream_num = new->downstream_num;
+    config->downstream = new->downstream;
+    config->health_client = new->health_client;
+    config->routing = new->routing;
+    config->socket_out_num = new->socket_out_num;
+    config->buffer_overflow_policy = new->buffer_overflow_policy;
+    config->downstream_flush_interval = new->downstream_flush_interval;
+    config->downstream_ping_interval = new->downstream_ping_interval;
+    config->downstream_health_check_interval = new->downstream_health_check_interval;
+    config->downstream_health_check_timeout = new->downstream_health_check_timeout;
+    config->downstream_health_check_jitter = new->downstream_health_check_jitter;
+    config->downstream_health_down_threshold = new->downstream_health_down_threshold;
+    config->downstream_health_up_threshold = new->downstream_health_up_threshold;
+    config->drain_timeout = new->drain_timeout;
+    config->reload_generation++;
+    rebuild_routing(&config->routing);
+}
+
+static void reload_free(struct sr_config_s *config) {
+    free(config->downstream_str);
+    free(config->downstream);
+    free(config->health_client);
+    free(config->routing.table[0]);
+    free(config->routing.table[1]);
+}
+
+// this function reads config file again and applies downstreams and intervals from it
+static void reload_signal_cb(struct ev_loop *loop, struct ev_signal *watcher, int revents) {
+    struct sr_config_s *config = (struct sr_config_s *)watcher->data;
+    struct sr_config_s *new;
+    struct sr_config_s old;
+    char hostname[HOST_NAME_SIZE];
+    int old_log_level = log_level;
+    int old_log_rate_limit = log_rate_limit;
+    int i;
+
+    if (config->draining) {
+        log_msg(WARN, "%s: sighup received while draining, config is not reloaded", __func__);
+        return;
+    }
+    log_msg(INFO, "%s: sighup received, reloading %s", __func__, config->config_file);
+    new = (struct sr_config_s *)malloc(sizeof(struct sr_config_s));
+    if (new == NULL) {
+        log_msg(ERROR, "%s: malloc() failed %s", __func__, strerror(errno));
+        return;
+    }
+    if (load_config(config->config_file, new) != 0) {
+        log_level = old_log_level;
+        log_rate_limit = old_log_rate_limit;
+        log_msg(ERROR, "%s: config is not reloaded", __func__);
+        free(new->ping_prefix);
+        free(new->capture_file);
+        free(new->replay_file);
+        free(new->upgrade_socket);
+        reload_free(new);
+        free(new);
+        return;
+    }
+    reload_restart_fields(config, new);
+    if (gethostname(hostname, HOST_NAME_SIZE) < 0 || init_downstream(new, hostname) != 0 || init_socket_out_num(new) != 0) {
+        log_level = old_log_level;
+        log_rate_limit = old_log_rate_limit;
+        log_msg(ERROR, "%s: config is not reloaded", __func__);
+        reload_free(new);
+        free(new);
+        return;
+    }
+    stop_health_checks(loop, config);
+    for (i = 0; i < config->threads_num; i++) {
+        ev_async_send((config->thread_config + i)->loop, &((config->thread_config + i)->reload_async));
+    }
+    // first barrier: all data threads are parked, second one: they can rebuild their downstreams
+    reload_barrier_wait(config);
+    old = *config;
+    reload_swap(config, new);
+    reload_barrier_wait(config);
+    reload_free(&old);
+    free(new);
+    start_health_checks(loop, config);
+    log_msg(INFO, "%s: config reloaded, %d downstreams", __func__, config->downstream_num);
+}
+
+// this function replaces downstreams and outgoing sockets of data thread with the ones of reloaded config
+// buffers of kept downstreams are moved to their new copies, lines of removed downstreams are routed to new owners
+static void reload_thread(struct thread_config_s *thread_config, struct downstream_s *old_downstream, int old_downstream_num,
+    struct ds_socket_out_s *old_socket_out, int old_socket_out_num, struct ev_loop *loop) {
+    struct sr_config_s *config = thread_config->common;
+    struct ds_buffer_pool_s *pool = &(thread_config->buffer_pool);
+    struct downstream_s *downstream;
+    struct downstream_s *ds;
+    struct downstream_s *old_ds;
+    int i;
+    int j;
+
+    downstream = (struct downstream_s *)malloc(config->downstream_num * sizeof(struct downstream_s));
+    if (downstream == NULL) {
+        log_msg(ERROR, "%s: downstream malloc() failed %s", __func__, strerror(errno));
+        exit(1);
+    }
+    memcpy(downstream, config->downstream + thread_config->index * config->downstream_num, config->downstream_num * sizeof(struct downstream_s));
+    for (i = 0; i < old_socket_out_num; i++) {
+        ev_io_stop(loop, (struct ev_io *)(old_socket_out + i));
+    }
+    thread_config->downstream = downstream;
+    if (init_socket_out(thread_config, old_socket_out->send_msg, old_socket_out->send_iov) != 0) {
+        exit(1);
+    }
+    if (pool->buffer_size > pool->segment_size && init_socket_out_gso(thread_config, pool->segment_size) != 0) {
+        log_msg(WARN, "%s: UDP GSO setsockopt() failed %s", __func__, strerror(errno));
+    }
+    for (j = 0; j < old_downstream_num; j++) {
+        old_ds = old_downstream + j;
+        for (i = 0; i < config->downstream_num; i++) {
+            ds = downstream + i;
+            if (ds->sa_in_data.sin_addr.s_addr != old_ds->sa_in_data.sin_addr.s_addr || ds->sa_in_data.sin_port != old_ds->sa_in_data.sin_port) {
+                continue;
+            }
+            // downstream listed twice keeps its buffers once, the rest is rerouted below
+            if (ds->active_buffer == NULL && ds->ready_head == NULL) {
+                ds->active_buffer = old_ds->active_buffer;
+                ds->ready_head = old_ds->ready_head;
+                ds->ready_tail = old_ds->ready_tail;
+                ds->ready_num = old_ds->ready_num;
+                ds->downstream_packet_counter = old_ds->downstream_packet_counter;
+                ds->downstream_traffic_counter = old_ds->downstream_traffic_counter;
+                old_ds->active_buffer = NULL;
+                old_ds->ready_head = NULL;
+                old_ds->ready_tail = NULL;
+                old_ds->ready_num = 0;
+                if (ds->ready_head != NULL) {
+                    ds_queue_flush(ds, loop);
+                }
+            }
+            break;
+        }
+    }
+    for (j = 0; j < old_downstream_num; j++) {
+        failover_downstream(thread_config, old_downstream + j, loop);
+    }
+    thread_config->socket_watcher->downstream_num = config->downstream_num;
+    thread_config->socket_watcher->downstream = downstream;
+    thread_config->flush_timer->downstream_num = config->downstream_num;
+    thread_config->flush_timer->downstream = downstream;
+    thread_config->ping_timer->downstream_num = config->downstream_num;
+    thread_config->ping_timer->downstream = downstream;
+    if (thread_config->flush_timer->super.interval != config->downstream_flush_interval) {
+        ev_periodic_set((struct ev_periodic *)thread_config->flush_timer, 0.0, config->downstream_flush_interval, 0);
+        ev_periodic_again(loop, (struct ev_periodic *)thread_config->flush_timer);
+    }
+    if (thread_config->ping_timer->super.interval != config->downstream_ping_interval) {
+        ev_periodic_set((struct ev_periodic *)thread_config->ping_timer, 0.0, config->downstream_ping_interval, 0);
+        ev_periodic_again(loop, (struct ev_periodic *)thread_config->ping_timer);
+    }
+    for (i = 0; i < old_socket_out_num; i++) {
+        close((old_socket_out + i)->super.fd);
+    }
+    free(old_socket_out);
+    free(old_downstream);
+}
+
+static void reload_async_cb(struct ev_loop *loop, struct ev_async *watcher, int revents) {
+    struct thread_config_s *thread_config = (struct thread_config_s *)watcher->data;
+    struct sr_config_s *config = thread_config->common;
+    struct downstream_s *old_downstream = thread_config->downstream;
+    struct ds_socket_out_s *old_socket_out = thread_config->socket_out;
+    int old_downstream_num = config->downstream_num;
+    int old_socket_out_num = config->socket_out_num;
+
+    reload_barrier_wait(config);
+    reload_barrier_wait(config);
+    reload_thread(thread_config, old_downstream, old_downstream_num, old_socket_out, old_socket_out_num, loop);
+}
+
+// this function starts reload watcher of data thread
+void init_reload_thread(struct ev_loop *loop, struct thread_config_s *thread_config) {
+    ev_async_init(&(thread_config->reload_async), reload_async_cb);
+    thread_config->reload_async.data = thread_config;
+    ev_async_start(loop, &(thread_config->reload_async));
+}
+
+// this function makes main loop reload config on SIGHUP
+void init_reload(struct ev_loop *loop, struct sr_config_s *config) {
+    ev_signal_init(&(config->reload_signal), reload_signal_cb, SIGHUP);
+    config->reload_signal.data = config;
+    ev_signal_start(loop, &(config->reload_signal));
+}
@@ -0,0 +1,125 @@
+#include "sr-main.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// scanner used by data threads, selected once by init_scan()
+int (*scan_lines)(char *buffer, int length, struct line_span_s *span, int max_spans);
+
+// records line ending at position pos, returns 1 if span array is full
+static inline int add_span(struct line_span_s *span, int *n, int *line_start, int *name_length, int pos, int max_spans) {
+    (span + *n)->offset = *line_start;
+    (span + *n)->length = pos + 1 - *line_start;
+    (span + *n)->name_length = *name_length;
+    (*n)++;
+    *line_start = pos + 1;
+    *name_length = -1;
+    return *n == max_spans;
+}
+
+// byte at a time scan of buffer tail, returns number of spans
+static inline int scan_tail(char *buffer, int pos, int length, struct line_span_s *span, int n, int max_spans, int line_start, int name_length) {
+    char c;
+
+    for (; pos < length; pos++) {
+        c = *(buffer + pos);
+        if (c == ':' && name_length < 0) {
+            name_length = pos - line_start;
+        } else if (c == '\n') {
+            if (add_span(span, &n, &line_start, &name_length, pos, max_spans)) {
+                break;
+            }
+        }
+    }
+    return n;
+}
+
+static int scan_lines_scalar(char *buffer, int length, struct line_span_s *span, int max_spans) {
+    return scan_tail(buffer, 0, length, span, 0, max_spans, 0, -1);
+}
+
+#if defined(__x86_64__)
+// newline and colon masks for one block are walked in byte order,
+// colon bits are only interesting until first colon of current line is found
+#define SCAN_BLOCK(nl_mask, colon_mask, block_size) \
+    while (1) { \
+        if (name_length < 0 && colon_mask != 0) { \
+            c = __builtin_ctzll(colon_mask); \
+            if (nl_mask == 0 || c < __builtin_ctzll(nl_mask)) { \
+                name_length = pos + c - line_start; \
+            } \
+        } \
+        if (nl_mask == 0) { \
+            break; \
+        } \
+        c = __builtin_ctzll(nl_mask); \
+        if (add_span(span, &n, &line_start, &name_length, pos + c, max_spans)) { \
+            return n; \
+        } \
+        nl_mask &= nl_mask - 1; \
+        colon_mask &= ~((2ULL << c) - 1); \
+    } \
+    pos += block_size;
+
+static int scan_lines_sse2(char *buffer, int length, struct line_span_s *span, int max_spans) {
+    __m128i nl = _mm_set1_epi8('\n');
+    __m128i colon = _mm_set1_epi8(':');
+    __m128i block;
+    unsigned long long nl_mask;
+    unsigned long long colon_mask;
+    int pos = 0;
+    int line_start = 0;
+    int name_length = -1;
+    int n = 0;
+    int c;
+
+    while (pos + 16 <= length) {
+        block = _mm_loadu_si128((__m128i *)(buffer + pos));
+        nl_mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(block, nl));
+        colon_mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(block, colon));
+        SCAN_BLOCK(nl_mask, colon_mask, 16)
+    }
+    return scan_tail(buffer, pos, length, span, n, max_spans, line_start, name_length);
+}
+
+__attribute__((target("avx2")))
+static int scan_lines_avx2(char *buffer, int length, struct line_span_s *span, int max_spans) {
+    __m256i nl = _mm256_set1_epi8('\n');
+    __m256i colon = _mm256_set1_epi8(':');
+    __m256i block;
+    unsigned long long nl_mask;
+    unsigned long long colon_mask;
+    int pos = 0;
+    int line_start = 0;
+    int name_length = -1;
+    int n = 0;
+    int c;
+
+    while (pos + 32 <= length) {
+        block = _mm256_loadu_si256((__m256i *)(buffer + pos));
+        nl_mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, nl));
+        colon_mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, colon));
+        SCAN_BLOCK(nl_mask, colon_mask, 32)
+    }
+    return scan_tail(buffer, pos, length, span, n, max_spans, line_start, name_length);
+}
+#endif
+
+// this function selects best scanner supported by cpu
+void init_scan(void) {
+    scan_lines = scan_lines_scalar;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan_lines = scan_lines_avx2;
+        log_msg(INFO, "%s: using avx2 line scanner", __func__);
+        return;
+    }
+    // sse2 is always present on x86_64
+    scan_lines = scan_lines_sse2;
+    log_msg(INFO, "%s: using sse2 line scanner", __func__);
+    return;
+#endif
+    log_msg(INFO, "%s: using scalar line scanner", __func__);
+}
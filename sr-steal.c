@@ -0,0 +1,195 @@
+#include "sr-main.h"
+
+// datagram record in stolen batch, datagram bytes follow it plus one spare byte
+struct steal_record_s {
+    int length;
+};
+
+#define STEAL_RECORD_SIZE(length) ((sizeof(struct steal_record_s) + (length) + 1 + sizeof(int) - 1) & ~(sizeof(int) - 1))
+
+// this function passes batch to thieves, returns 1 if queue is full
+// queue has single producer (owner thread) and many consumers (owner and other threads)
+static int steal_push(struct steal_queue_s *queue, struct steal_batch_s *batch) {
+    unsigned long tail = queue->tail;
+
+    if (tail - __atomic_load_n(&(queue->head), __ATOMIC_ACQUIRE) >= STEAL_QUEUE_SIZE) {
+        return 1;
+    }
+    __atomic_store_n(queue->batch + (tail % STEAL_QUEUE_SIZE), batch, __ATOMIC_RELAXED);
+    __atomic_store_n(&(queue->tail), tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// this function takes oldest batch from queue, NULL if queue is empty
+static struct steal_batch_s *steal_pop(struct steal_queue_s *queue) {
+    unsigned long head = __atomic_load_n(&(queue->head), __ATOMIC_ACQUIRE);
+    struct steal_batch_s *batch;
+
+    while (head != __atomic_load_n(&(queue->tail), __ATOMIC_ACQUIRE)) {
+        // slot can't be reused by producer until head is moved, so pointer read before successful exchange is valid
+        batch = __atomic_load_n(queue->batch + (head % STEAL_QUEUE_SIZE), __ATOMIC_RELAXED);
+        if (__atomic_compare_exchange_n(&(queue->head), &head, head + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return batch;
+        }
+    }
+    return NULL;
+}
+
+// this function routes all datagrams of batch via calling thread downstreams and frees batch
+static void steal_process(struct thread_config_s *thread_config, struct steal_batch_s *batch, struct ev_loop *loop) {
+    struct steal_record_s *record;
+    char *p = batch->data;
+    int i;
+
+    // receive timestamps aren't passed with batch, latency is measured from stealing
+    latency_mark(thread_config);
+    for (i = 0; i < batch->datagram_num; i++) {
+        record = (struct steal_record_s *)p;
+        process_datagram((char *)(record + 1), record->length, thread_config->common->downstream_num, thread_config->downstream, loop);
+        p += STEAL_RECORD_SIZE(record->length);
+    }
+    free(batch);
+}
+
+// this function wakes up one idle thread, threads are tried round robin
+static void steal_wake_thief(struct thread_config_s *thread_config) {
+    struct thread_config_s *thief;
+    int threads_num = thread_config->common->threads_num;
+    int i;
+
+    // batch is pushed before idle flags are read, thread going idle sets its flag before it looks at queues
+    // so either thread is woken up here or it sees the batch itself in steal_prepare_cb()
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (i = 1; i < threads_num; i++) {
+        thief = thread_config->common->thread_config + (thread_config->steal_next + i) % threads_num;
+        if (thief != thread_config && __atomic_load_n(&(thief->idle), __ATOMIC_RELAXED)) {
+            thread_config->steal_next = thief->index;
+            ev_async_send(thief->loop, &(thief->steal_async));
+            return;
+        }
+    }
+}
+
+// this function copies received datagrams from first to last - 1 into batch other threads can steal
+// returns 1 if datagrams should be processed by calling thread
+int steal_offload(struct thread_config_s *thread_config, struct ev_io_ds_s *socket_watcher, int first, int last, struct ev_loop *loop) {
+    struct steal_batch_s *batch;
+    struct steal_record_s *record;
+    struct steal_batch_s *oldest;
+    char *p;
+    int size = sizeof(struct steal_batch_s);
+    int length;
+    int i;
+
+    for (i = first; i < last; i++) {
+        size += STEAL_RECORD_SIZE((socket_watcher->recv_msg + i)->msg_len);
+    }
+    batch = (struct steal_batch_s *)malloc(size);
+    if (batch == NULL) {
+        return 1;
+    }
+    batch->datagram_num = last - first;
+    p = batch->data;
+    for (i = first; i < last; i++) {
+        length = (socket_watcher->recv_msg + i)->msg_len;
+        record = (struct steal_record_s *)p;
+        record->length = length;
+        memcpy(record + 1, socket_watcher->recv_buffer + i * socket_watcher->recv_buffer_size, length);
+        p += STEAL_RECORD_SIZE(length);
+    }
+    // nobody steals fast enough, owner processes oldest batch itself, so batches don't get stale
+    if (steal_push(thread_config->steal_queue, batch) != 0) {
+        if ((oldest = steal_pop(thread_config->steal_queue)) != NULL) {
+            steal_process(thread_config, oldest, loop);
+        }
+        if (steal_push(thread_config->steal_queue, batch) != 0) {
+            free(batch);
+            return 1;
+        }
+    }
+    thread_config->steal_offload_counter += last - first;
+    steal_wake_thief(thread_config);
+    return 0;
+}
+
+// this function processes batches left in thread own queue, it's called when thread is not overloaded anymore
+// it returns number of processed batches
+int steal_drain(struct thread_config_s *thread_config, struct ev_loop *loop) {
+    struct steal_batch_s *batch;
+    int processed = 0;
+
+    while ((batch = steal_pop(thread_config->steal_queue)) != NULL) {
+        steal_process(thread_config, batch, loop);
+        processed++;
+    }
+    return processed;
+}
+
+// this function steals batches from other threads
+static void steal_async_cb(struct ev_loop *loop, struct ev_async *watcher, int revents) {
+    struct thread_config_s *thread_config = (struct thread_config_s *)watcher->data;
+    struct thread_config_s *victim;
+    struct steal_batch_s *batch;
+    int stolen = 0;
+    int i;
+
+    for (i = 0; i < thread_config->common->threads_num; i++) {
+        victim = thread_config->common->thread_config + i;
+        if (victim == thread_config) {
+            continue;
+        }
+        while (stolen < STEAL_BATCH_LIMIT && (batch = steal_pop(victim->steal_queue)) != NULL) {
+            thread_config->steal_counter += batch->datagram_num;
+            steal_process(thread_config, batch, loop);
+            stolen++;
+        }
+    }
+    // own socket should be served too, so stealing is continued on next loop iteration
+    if (stolen == STEAL_BATCH_LIMIT) {
+        ev_async_send(loop, watcher);
+    }
+}
+
+// thread is considered idle when it's going to wait for events
+// batch pushed while thread was busy didn't wake it up, so queues of other threads are checked before it waits
+static void steal_prepare_cb(struct ev_loop *loop, struct ev_prepare *watcher, int revents) {
+    struct thread_config_s *thread_config = (struct thread_config_s *)watcher->data;
+    struct steal_queue_s *queue;
+    int i;
+
+    __atomic_store_n(&(thread_config->idle), 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (i = 0; i < thread_config->common->threads_num; i++) {
+        queue = (thread_config->common->thread_config + i)->steal_queue;
+        if (i != thread_config->index && __atomic_load_n(&(queue->head), __ATOMIC_RELAXED) != __atomic_load_n(&(queue->tail), __ATOMIC_RELAXED)) {
+            ev_async_send(loop, &(thread_config->steal_async));
+            return;
+        }
+    }
+}
+
+static void steal_check_cb(struct ev_loop *loop, struct ev_check *watcher, int revents) {
+    __atomic_store_n(&(((struct thread_config_s *)watcher->data)->idle), 0, __ATOMIC_RELAXED);
+}
+
+// this function starts work stealing watchers of data thread
+int init_steal_thread(struct ev_loop *loop, struct thread_config_s *thread_config) {
+    // queue positions are touched by all threads, so they have own cache lines
+    if (posix_memalign((void **)&(thread_config->steal_queue), CACHE_LINE_SIZE, sizeof(struct steal_queue_s)) != 0) {
+        log_msg(ERROR, "%s: malloc() failed", __func__);
+        return 1;
+    }
+    memset(thread_config->steal_queue, 0, sizeof(struct steal_queue_s));
+    thread_config->steal_next = thread_config->index;
+    thread_config->idle = 0;
+    ev_async_init(&(thread_config->steal_async), steal_async_cb);
+    thread_config->steal_async.data = thread_config;
+    ev_async_start(loop, &(thread_config->steal_async));
+    ev_prepare_init(&(thread_config->steal_prepare), steal_prepare_cb);
+    thread_config->steal_prepare.data = thread_config;
+    ev_prepare_start(loop, &(thread_config->steal_prepare));
+    ev_check_init(&(thread_config->steal_check), steal_check_cb);
+    thread_config->steal_check.data = thread_config;
+    ev_check_start(loop, &(thread_config->steal_check));
+    return 0;
+}
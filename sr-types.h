@@ -3,6 +3,7 @@
 
 #include <ev.h>
 #include <netinet/in.h>
+#include <sys/socket.h>
 
 // extended ev structure with buffer pointer and buffer length
 // used by control port connections
@@ -12,6 +13,46 @@ struct ev_io_control {
     int response_len;
     char *health_response;
     int *health_response_len;;
+    struct sr_config_s *common;
+    // buffer allocated for stats response, NULL for health response
+    char *stats_response;
+    // http clients get single response, connection is closed then
+    int close_after_write;
+};
+
+// line found in datagram by the scanner
+struct line_span_s {
+    // offset of line start in datagram
+    int offset;
+    // line length including terminating new line
+    int length;
+    // metric name length (position of first ':'), -1 if line has no ':'
+    int name_length;
+};
+
+// routing modes
+enum routing_mode_e {
+    // metrics name hash is consistently hashed on every line, placement is compatible with older releases
+    ROUTING_MODE_COMPAT,
+    // metrics name hash selects bucket in routing table, table is rebuilt on health changes
+    ROUTING_MODE_TABLE
+};
+
+struct ds_health_client_s;
+
+// precomputed metric routing
+struct ds_routing_s {
+    enum routing_mode_e mode;
+    int table_size;
+    int downstream_num;
+    struct ds_health_client_s *health_client;
+    // table currently used by data threads, points to one of the tables below
+    int *active_table;
+    // tables are swapped on each rebuild, so new table is built while data threads read current one
+    int *table[2];
+    // odd while table is rebuilt, data thread which read table still in use by earlier rebuild
+    // sees changed generation and looks its bucket up again, so partially built table isn't used
+    unsigned long generation;
 };
 
 struct ds_health_client_s {
@@ -23,28 +64,116 @@ struct ds_health_client_s {
     int id;
     // bit flag if this downstream is alive
     unsigned int alive:1;
+    // routing to rebuild when alive flag changes
+    struct ds_routing_s *routing;
+    // data threads are notified when downstream dies
+    struct sr_config_s *common;
+    // each downstream is checked on its own schedule, check fails if it isn't completed in time
+    struct ev_timer check_timer;
+    struct ev_timer timeout_timer;
+    // consecutive failed and successful checks
+    int failures;
+    int successes;
+    // connection of previous check is used
+    int reused;
+    // set by data threads when connected socket reports refused send
+    int refused;
 };
 
-// Size of buffer for outgoing packets. Should be below MTU.
-// TODO Probably should be configured via configuration file?
+// Default size of outgoing packets. Should be below MTU.
 #define DOWNSTREAM_BUF_SIZE 1450
+// Max UDP payload over IPv4
+#define DOWNSTREAM_BUF_SIZE_MAX 65507
+// Max number of segments kernel accepts in single UDP GSO send
+#define DOWNSTREAM_GSO_SEGMENTS_MAX 64
+#define CACHE_LINE_SIZE 64
+// Max number of datagram batches waiting to be stolen from thread
+#define STEAL_QUEUE_SIZE 64
+// Number of latency histogram buckets, enough for ~35 minutes in microseconds
+#define LATENCY_BUCKETS_NUM 32
+// Max length of thread cpu and numa node affinity lists
+#define THREAD_AFFINITY_MAX 256
+// How many filled buffers can be queued per downstream
 #define DOWNSTREAM_BUF_NUM 1024
 #define METRIC_SIZE 256
+// How many buffers we can send with single sendmmsg() call
+#define DOWNSTREAM_SEND_BATCH_SIZE 1024
+
+// outgoing packet buffer
+struct ds_buffer_s {
+    // next buffer in downstream queue or in pool free list
+    struct ds_buffer_s *next;
+    int length;
+    // receive time of first line in buffer, nanoseconds, set only if latency histograms are enabled
+    long recv_time;
+    char data[];
+};
+
+// per thread pool of outgoing buffers, buffers are allocated on demand
+struct ds_buffer_pool_s {
+    struct ds_buffer_s *free_list;
+    int free_num;
+    // how many free buffers we keep for reuse
+    int free_max;
+    int buffer_size;
+    // packet size, buffer holds buffer_size / segment_size packets if UDP GSO is used
+    int segment_size;
+    // memory used by buffers of all threads and its limit
+    long *memory;
+    long memory_limit;
+};
+
+// how data threads do network io
+enum io_backend_e {
+    IO_BACKEND_LIBEV,
+    IO_BACKEND_IO_URING
+};
+
+// how kernel picks data socket of reuseport group for incoming packet
+enum reuseport_steering_e {
+    REUSEPORT_STEERING_NONE,
+    REUSEPORT_STEERING_INCOMING_CPU,
+    REUSEPORT_STEERING_CBPF
+};
+
+// what to do if downstream queue is full or memory limit is reached
+enum buffer_overflow_policy_e {
+    // new data is dropped
+    BUFFER_OVERFLOW_DROP_NEW,
+    // oldest queued buffer of the same downstream is dropped
+    BUFFER_OVERFLOW_DROP_OLDEST
+};
 
 struct ev_io_ds_s;
+struct downstream_s;
+struct uring_s;
+
+// outgoing socket, can be shared by several downstreams
+struct ds_socket_out_s {
+    // ev_io structure used to flush data when socket is writable
+    struct ev_io super;
+    // downstreams with filled buffers waiting to be sent via this socket
+    struct downstream_s *flush_queue_head;
+    struct downstream_s *flush_queue_tail;
+    // scratch space for sendmmsg(), shared by all sockets of the thread
+    struct mmsghdr *send_msg;
+    struct iovec *send_iov;
+    // not NULL if sends are submitted via io_uring instead of this watcher
+    struct uring_s *uring;
+    // socket is connected to its only downstream, kernel reports refused sends
+    int connected;
+};
 
 struct downstream_s {
-    struct ev_io flush_watcher;
-    // buffer where data is added
-    int active_buffer_idx;
-    char *active_buffer;
-    int active_buffer_length;
-    // buffer ready for flush
-    int flush_buffer_idx;
-    // memory for active and flush buffers
-    char buffer[DOWNSTREAM_BUF_SIZE * DOWNSTREAM_BUF_NUM];
-    // lengths of buffers from the above array
-    int buffer_length[DOWNSTREAM_BUF_NUM];
+    // buffer where data is added, NULL until data arrives
+    struct ds_buffer_s *active_buffer;
+    // filled buffers waiting for flush, in order
+    struct ds_buffer_s *ready_head;
+    struct ds_buffer_s *ready_tail;
+    int ready_num;
+    // pool of the thread owning this downstream
+    struct ds_buffer_pool_s *pool;
+    enum buffer_overflow_policy_e overflow_policy;
     // sockaddr for data
     struct sockaddr_in sa_in_data;
     // metrics to detect downstreams with highest traffic
@@ -59,13 +188,11 @@ struct downstream_s {
     char per_downstream_counter_metric[METRIC_SIZE];
     int per_downstream_counter_metric_length;
     struct ds_health_client_s *health_client;
-    int *socket_out;
-};
-
-struct ev_periodic_health_client_s {
-    struct ev_periodic super;
-    int downstream_num;
-    struct ds_health_client_s *health_client;
+    struct ds_socket_out_s *socket_out;
+    // next downstream in socket flush queue
+    struct downstream_s *flush_queue_next;
+    // bit flag if this downstream is in socket flush queue
+    unsigned int flush_queued:1;
 };
 
 struct ev_periodic_ds_s {
@@ -73,6 +200,7 @@ struct ev_periodic_ds_s {
     int downstream_num;
     struct downstream_s *downstream;
     char *string;
+    struct thread_config_s *thread_config;
 };
 
 struct ev_io_ds_s {
@@ -80,15 +208,283 @@ struct ev_io_ds_s {
     int downstream_num;
     struct downstream_s *downstream;
     int socket_in;
+    struct thread_config_s *thread_config;
+    // arena for batched receive: recv_batch_size slots of recv_buffer_size bytes
+    int recv_batch_size;
+    int recv_buffer_size;
+    char *recv_buffer;
+    struct mmsghdr *recv_msg;
+    struct iovec *recv_iov;
+    // with UDP GRO each slot may hold several coalesced datagrams, segment size comes in control message
+    int recv_gro;
+    char *recv_control;
+};
+
+// metric types folded by aggregation
+enum aggregation_type_e {
+    AGGREGATION_COUNTER,
+    AGGREGATION_GAUGE,
+    AGGREGATION_SET,
+    AGGREGATION_TIMER,
+    AGGREGATION_HISTOGRAM
+};
+
+// timer or histogram value stored in aggregation arena
+struct aggregation_sample_s {
+    struct aggregation_sample_s *next;
+    int length;
+    char value[];
+};
+
+struct aggregation_entry_s {
+    // hash of metric name used for routing
+    unsigned long name_hash;
+    // hash of full key: type, name and set member (sample rate for timers)
+    unsigned long key_hash;
+    // name and set member are stored in arena, name is NULL for empty slot
+    char *name;
+    int name_length;
+    char *member;
+    int member_length;
+    enum aggregation_type_e type;
+    // counter sum or gauge value
+    double value;
+    // gauge was set to absolute value during this flush interval
+    int gauge_absolute;
+    // timer and histogram values in order of arrival
+    struct aggregation_sample_s *sample_head;
+    struct aggregation_sample_s *sample_tail;
 };
 
+// per thread aggregation of metrics during flush interval
+struct aggregation_s {
+    // fold counters, gauges and sets
+    int basic;
+    // pack timers and histograms
+    int timers;
+    // open addressing hash table, capacity is power of 2
+    struct aggregation_entry_s *entry;
+    int capacity;
+    int max_entries;
+    // slots used during this flush interval, in order of appearance
+    int *used_slot;
+    int used_num;
+    // memory for names and set members
+    char *arena;
+    int arena_size;
+    int arena_length;
+    // lines folded into table and lines emitted
+    long input_counter;
+    long output_counter;
+    // emitted lines should fit into outgoing packet
+    int line_size;
+    char *line_buffer;
+};
+
+// single producer single consumer ring passing lines from one data thread to another
+struct handoff_ring_s {
+    // producer position and last seen consumer position
+    unsigned long tail __attribute__((aligned(CACHE_LINE_SIZE)));
+    unsigned long head_cache;
+    // consumer position
+    unsigned long head __attribute__((aligned(CACHE_LINE_SIZE)));
+    char *data __attribute__((aligned(CACHE_LINE_SIZE)));
+    unsigned long size;
+};
+
+// rate limit state of single log_msg() call site, shared by all threads
+struct log_site_s {
+    char *file;
+    int line;
+    int level;
+    // second of current rate limit window and number of messages logged during it
+    long window;
+    int count;
+    // messages dropped by rate limit since last report
+    int suppressed;
+    // site is added to list of reported sites on first suppression
+    int listed;
+    struct log_site_s *next;
+};
+
+// single producer single consumer ring of log records, producer is thread which logs, consumer is log writer
+struct log_ring_s {
+    // producer position and last seen consumer position
+    unsigned long tail __attribute__((aligned(CACHE_LINE_SIZE)));
+    unsigned long head_cache;
+    // messages dropped because ring was full
+    long dropped;
+    // consumer position
+    unsigned long head __attribute__((aligned(CACHE_LINE_SIZE)));
+    long dropped_reported;
+    char *data;
+    long tid;
+    struct log_ring_s *next;
+};
+
+// batch of raw datagrams given away by overloaded thread
+struct steal_batch_s {
+    int datagram_num;
+    char data[];
+};
+
+// bounded queue of batches, filled by owner thread, emptied by owner and idle threads
+struct steal_queue_s {
+    unsigned long head __attribute__((aligned(CACHE_LINE_SIZE)));
+    unsigned long tail __attribute__((aligned(CACHE_LINE_SIZE)));
+    struct steal_batch_s *batch[STEAL_QUEUE_SIZE] __attribute__((aligned(CACHE_LINE_SIZE)));
+};
+
+// per thread counters, each thread writes only its own ones and control thread reads them without locks
+// counters have own cache line, so reads by control thread don't slow down neighbour threads
+struct thread_stats_s {
+    long datagrams;
+    long lines;
+    long invalid_lines;
+    // lines lost due to buffer overflow, memory limit, send errors or all downstreams being dead
+    long dropped_lines;
+    long bytes_sent;
+    long packets_sent;
+    long send_errors;
+    // datagrams dropped by kernel since socket receive queue was full, reported by kernel via SO_RXQ_OVFL
+    long kernel_drops;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+// log2 histogram of microseconds, bucket 0 counts values below 1us, bucket i counts values in [2^(i-1), 2^i)
+struct latency_histogram_s {
+    long bucket[LATENCY_BUCKETS_NUM];
+    long count;
+    long sum;
+};
+
+// latency histograms of thread, written by thread only and read by control thread without locks
+struct thread_latency_s {
+    // time line waits in router from receive by kernel till send to downstream
+    struct latency_histogram_s send;
+    // time spent processing datagrams of single receive wakeup
+    struct latency_histogram_s read;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
 struct thread_config_s {
     int index;
     pthread_t thread;
     struct sr_config_s *common;
+    // cpu and numa node thread is pinned to, -1 if not pinned
+    int cpu;
+    int numa_node;
+    // thread own copy of downstreams, allocated by thread itself so memory is local to its node
+    struct downstream_s *downstream;
     int socket_in;
-    int *socket_out;
+    struct ds_socket_out_s *socket_out;
     char alive_downstream_metric_name[METRIC_SIZE];
+    // prefix for per thread internal metrics: ping_prefix.hostname-data_port
+    char metric_prefix[METRIC_SIZE];
+    // counters served by stats command, never reset
+    struct thread_stats_s stats;
+    // stats values at last ping, ping metrics are deltas
+    struct thread_stats_s ping_stats;
+    // NULL if latency histograms are disabled
+    struct thread_latency_s *latency;
+    // histograms at last ping, ping metrics are percentiles of ping interval
+    struct thread_latency_s *ping_latency;
+    // receive time of data being routed, nanoseconds, lines added to empty buffer pass it to buffer
+    long recv_time;
+    // receive batching metric, updated by data thread only
+    long recv_call_counter;
+    // send and receive syscalls made by data thread
+    long syscall_counter;
+    // NULL if aggregation is disabled
+    struct aggregation_s *aggregation;
+    struct ds_buffer_pool_s buffer_pool;
+    // NULL if libev backend is used
+    struct uring_s *uring;
+    // loop of data thread, used by other threads to wake it up
+    struct ev_loop *loop;
+    // name sharding: lines are passed to owner thread, owner is woken up via its async watcher
+    struct ev_async handoff_async;
+    struct ev_prepare handoff_prepare;
+    char *handoff_pending;
+    long handoff_counter;
+    long handoff_full_counter;
+    // work stealing: thread is idle while it waits for events, overloaded thread wakes idle one via its async watcher
+    struct steal_queue_s *steal_queue;
+    int idle;
+    int steal_next;
+    struct ev_async steal_async;
+    struct ev_prepare steal_prepare;
+    struct ev_check steal_check;
+    long steal_offload_counter;
+    long steal_counter;
+    // data of dead downstreams is rerouted when health client wakes thread up via async watcher
+    struct ev_async failover_async;
+    long failover_saved_counter;
+    // config reload: thread is parked in reload watcher while main thread swaps downstreams, then rebuilds its copies
+    struct ev_async reload_async;
+    // watchers of data thread which refer to its downstreams, they live on thread stack
+    struct ev_io_ds_s *socket_watcher;
+    struct ev_periodic_ds_s *flush_timer;
+    struct ev_periodic_ds_s *ping_timer;
+    // drain: thread stops reading and flushes its buffers until everything is sent, drained is read by main thread
+    struct ev_async drain_async;
+    struct ev_timer drain_timer;
+    int drained;
+};
+
+// capture file starts with header, records follow it, each record is followed by datagram bytes
+#define CAPTURE_MAGIC "SRCAP01\n"
+
+struct capture_header_s {
+    char magic[8];
+    // offset of the end of last reserved record, appended by all data threads
+    long end;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct capture_record_s {
+    // receive time, nanoseconds since epoch
+    long time;
+    // index of thread datagram was received by
+    int thread;
+    // datagram length, record isn't completed while it's 0
+    int length;
+};
+
+// capture file mapped into memory, shared by data threads
+struct capture_s {
+    struct capture_header_s *header;
+    long size;
+    // set once file has no room for next datagram
+    int full;
+};
+
+// capture file being replayed via loopback sockets of data threads
+struct replay_s {
+    struct capture_header_s *header;
+    long size;
+    // addresses of data thread sockets
+    struct sockaddr_in *addr;
+    int socket_out;
+    pthread_t thread;
+    // main loop is stopped when replay is done
+    struct ev_loop *loop;
+    struct ev_async done_async;
+};
+
+// upgrade handoff: running router sends header with its sockets attached, health of its downstreams follows
+// new router replies with single byte once its data threads are running
+#define UPGRADE_MAGIC "SRUPG01\n"
+#define UPGRADE_READY 'R'
+
+struct upgrade_header_s {
+    char magic[8];
+    int threads_num;
+    int data_port;
+    int control_port;
+    int downstream_num;
+};
+
+struct upgrade_downstream_s {
+    struct sockaddr_in sa_in;
+    int alive;
 };
 
 #define HEALTH_CHECK_REQUEST "health"
@@ -104,13 +500,91 @@ struct sr_config_s {
     char *downstream_str;
     // how often we check downstream health
     ev_tstamp downstream_health_check_interval;
+    // how long single check can take, 0 means downstream_health_check_interval
+    ev_tstamp downstream_health_check_timeout;
+    // checks are spread by +-jitter part of interval
+    double downstream_health_check_jitter;
+    // how many checks in a row should fail to mark downstream down and succeed to mark it up
+    int downstream_health_down_threshold;
+    int downstream_health_up_threshold;
+    // data threads wake up health client via async watcher of main loop, NULL until health checks are started
+    struct ev_loop *health_loop;
+    struct ev_async health_refused_async;
     // how often we flush data
     ev_tstamp downstream_flush_interval;
     // how often we want to send ping metrics
     ev_tstamp downstream_ping_interval;
     // how many concurrent threads we run
     int threads_num;
+    // how many datagrams we pull from socket per wakeup
+    int recv_batch_size;
+    // size of each datagram slot in receive arena
+    int recv_buffer_size;
+    // receive buffer of data sockets, 0 keeps kernel default
+    int socket_rcvbuf;
+    // let kernel coalesce datagrams of the same flow via UDP GRO
+    int recv_gro;
+    // libev readiness or io_uring completions for data sockets
+    enum io_backend_e io_backend;
+    // size of io_uring submission queue, also number of receive buffers and sends in flight
+    int io_uring_entries;
+    // cpus and numa nodes data threads are pinned to, thread i uses entry i % num
+    int thread_cpu[THREAD_AFFINITY_MAX];
+    int thread_cpu_num;
+    int thread_numa_node[THREAD_AFFINITY_MAX];
+    int thread_numa_node_num;
+    enum reuseport_steering_e reuseport_steering;
+    // each metric name is routed by single thread, lines are passed via rings of name_sharding_ring_size bytes
+    int name_sharding;
+    int name_sharding_ring_size;
+    struct handoff_ring_s *handoff_ring;
+    // overloaded thread gives part of received datagrams to idle threads
+    int work_stealing;
+    // data threads wait for each other before receiving data, so cross thread wakeups always find initialized watchers
+    pthread_barrier_t thread_barrier;
+    // config file is read again on SIGHUP
+    char *config_file;
+    struct ev_signal reload_signal;
+    // incremented on each reload, sends completed after reload can't refer to new downstreams by index
+    int reload_generation;
+    // unix socket running router passes its sockets through to new one, NULL if upgrade is disabled
+    char *upgrade_socket;
+    // listening socket of running router and connection to previous router during startup, -1 if not used
+    int upgrade_listen_fd;
+    int upgrade_fd;
+    struct ev_io upgrade_watcher;
+    // on SIGINT and after upgrade reading stops and buffered data is flushed, router exits once it's sent or after drain_timeout
+    ev_tstamp drain_timeout;
+    int draining;
+    int drain_checks;
+    ev_tstamp drain_start;
+    struct ev_signal drain_signal;
+    struct ev_timer drain_timer;
+    // record receive to send latency and receive processing time
+    int latency_histograms;
+    // report latency percentiles with ping metrics
+    int latency_ping_metrics;
+    // fold counters, gauges and sets during flush interval
+    int aggregation;
+    // pack timer and histogram samples during flush interval
+    int aggregation_timers;
+    // how many distinct metrics each thread can aggregate during flush interval
+    int aggregation_table_size;
+    // memory for metric names each thread can use during flush interval
+    int aggregation_arena_size;
+    // memory used by outgoing buffers of all threads and its limit
+    long buffer_memory;
+    long buffer_memory_limit;
+    // how many free outgoing buffers each thread keeps for reuse
+    int buffer_pool_size;
+    // size of outgoing packets
+    int downstream_packet_size;
+    // how many packets are sent with single UDP GSO send, 1 if GSO is disabled
+    int downstream_gso_segments;
+    enum buffer_overflow_policy_e buffer_overflow_policy;
     int socket_out_num;
+    // each downstream has own connected outgoing socket in each thread
+    int downstream_connected_sockets;
     char *ping_prefix;
     int downstream_num;
     struct downstream_s *downstream;
@@ -119,6 +593,16 @@ struct sr_config_s {
     struct ds_health_client_s *health_client;
     struct thread_config_s *thread_config;
     int control_socket;
+    struct ds_routing_s routing;
+    // received datagrams are appended to capture_file of capture_size bytes, NULL if capture is disabled
+    char *capture_file;
+    long capture_size;
+    struct capture_s *capture;
+    // data threads receive datagrams of replay_file instead of data port, NULL if replay is disabled
+    char *replay_file;
+    // 1 replays with original pacing, 2 twice as fast etc, 0 as fast as possible
+    double replay_speed;
+    struct replay_s *replay;
 };
 
 #endif
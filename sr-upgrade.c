@@ -0,0 +1,335 @@
+#include "sr-main.h"
+
+// this function flushes everything data thread has buffered and reports whether it's sent
+static void drain_flush(struct thread_config_s *thread_config, struct ev_loop *loop) {
+    struct downstream_s *ds;
+    int drained = 1;
+    int i;
+
+    // offloaded batches and lines passed by other threads are routed before buffers are flushed
+    // anything found there means data was still moving between threads, so thread isn't drained yet
+    if (thread_config->common->work_stealing) {
+        if (steal_drain(thread_config, loop) > 0 ||
+            __atomic_load_n(&(thread_config->steal_queue->head), __ATOMIC_ACQUIRE) != __atomic_load_n(&(thread_config->steal_queue->tail), __ATOMIC_ACQUIRE)) {
+            drained = 0;
+        }
+    }
+    if (thread_config->common->name_sharding && handoff_drain(thread_config, loop) > 0) {
+        drained = 0;
+    }
+    if (thread_config->aggregation != NULL) {
+        flush_aggregation(thread_config->aggregation, thread_config->common->downstream_num, thread_config->downstream, loop);
+    }
+    for (i = 0; i < thread_config->common->downstream_num; i++) {
+        ds = thread_config->downstream + i;
+        ds_schedule_flush(ds, loop);
+        if ((ds->active_buffer != NULL && ds->active_buffer->length > 0) || ds->ready_head != NULL) {
+            drained = 0;
+        }
+    }
+    if (thread_config->uring != NULL && uring_pending_sends(thread_config->uring) > 0) {
+        drained = 0;
+    }
+    __atomic_store_n(&(thread_config->drained), drained, __ATOMIC_RELEASE);
+}
+
+static void drain_thread_timer_cb(struct ev_loop *loop, struct ev_timer *timer, int revents) {
+    drain_flush((struct thread_config_s *)timer->data, loop);
+}
+
+// this function stops reading of data thread, lines passed by other threads are still routed
+static void drain_async_cb(struct ev_loop *loop, struct ev_async *watcher, int revents) {
+    struct thread_config_s *thread_config = (struct thread_config_s *)watcher->data;
+
+    if (thread_config->uring != NULL) {
+        uring_stop_recv(thread_config->uring, loop);
+    } else {
+        ev_io_stop(loop, (struct ev_io *)thread_config->socket_watcher);
+    }
+    drain_flush(thread_config, loop);
+    ev_timer_start(loop, &(thread_config->drain_timer));
+}
+
+// this function starts drain watcher of data thread
+void init_drain_thread(struct ev_loop *loop, struct thread_config_s *thread_config) {
+    thread_config->drained = 0;
+    ev_async_init(&(thread_config->drain_async), drain_async_cb);
+    thread_config->drain_async.data = thread_config;
+    ev_async_start(loop, &(thread_config->drain_async));
+    ev_timer_init(&(thread_config->drain_timer), drain_thread_timer_cb, DRAIN_CHECK_INTERVAL, DRAIN_CHECK_INTERVAL);
+    thread_config->drain_timer.data = thread_config;
+}
+
+// this function exits once all data threads have sent their buffers or drain_timeout passes
+static void drain_timer_cb(struct ev_loop *loop, struct ev_timer *timer, int revents) {
+    struct sr_config_s *config = (struct sr_config_s *)timer->data;
+    int i;
+
+    for (i = 0; i < config->threads_num; i++) {
+        if (!__atomic_load_n(&((config->thread_config + i)->drained), __ATOMIC_ACQUIRE)) {
+            break;
+        }
+    }
+    // threads report independently, line passed between threads can arrive after its owner reported
+    config->drain_checks = (i == config->threads_num) ? config->drain_checks + 1 : 0;
+    if (config->drain_checks >= 2) {
+        log_msg(INFO, "%s: buffered data is sent, exiting", __func__);
+        exit(0);
+    }
+    if (ev_now(loop) - config->drain_start > config->drain_timeout) {
+        log_msg(WARN, "%s: drain is not completed in %.1f seconds, exiting", __func__, config->drain_timeout);
+        exit(0);
+    }
+}
+
+static void start_drain(struct ev_loop *loop, struct sr_config_s *config) {
+    int i;
+
+    config->draining = 1;
+    config->drain_checks = 0;
+    config->drain_start = ev_now(loop);
+    for (i = 0; i < config->threads_num; i++) {
+        ev_async_send((config->thread_config + i)->loop, &((config->thread_config + i)->drain_async));
+    }
+    ev_timer_init(&(config->drain_timer), drain_timer_cb, DRAIN_CHECK_INTERVAL, DRAIN_CHECK_INTERVAL);
+    config->drain_timer.data = config;
+    ev_timer_start(loop, &(config->drain_timer));
+}
+
+// second SIGINT doesn't wait for drain
+static void drain_signal_cb(struct ev_loop *loop, struct ev_signal *watcher, int revents) {
+    struct sr_config_s *config = (struct sr_config_s *)watcher->data;
+
+    if (config->draining) {
+        log_msg(INFO, "%s: sigint received while draining, exiting", __func__);
+        exit(0);
+    }
+    log_msg(INFO, "%s: sigint received, draining", __func__);
+    start_drain(loop, config);
+}
+
+// this function makes main loop drain router on SIGINT
+void init_drain(struct ev_loop *loop, struct sr_config_s *config) {
+    ev_signal_init(&(config->drain_signal), drain_signal_cb, SIGINT);
+    config->drain_signal.data = config;
+    ev_signal_start(loop, &(config->drain_signal));
+}
+
+static void upgrade_addr(struct sr_config_s *config, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    strncpy(addr->sun_path, config->upgrade_socket, sizeof(addr->sun_path) - 1);
+}
+
+// this function passes data and control sockets together with downstream health to new router
+static int upgrade_send(struct sr_config_s *config, int fd) {
+    struct upgrade_header_s header;
+    struct upgrade_downstream_s *downstream;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    int fds[config->threads_num + 1];
+    size_t control_size = CMSG_SPACE(sizeof(fds));
+    size_t downstream_size = config->downstream_num * sizeof(struct upgrade_downstream_s);
+    char *control;
+    int rc = 0;
+    int i;
+
+    control = (char *)calloc(1, control_size);
+    downstream = (struct upgrade_downstream_s *)calloc(config->downstream_num, sizeof(struct upgrade_downstream_s));
+    if (control == NULL || downstream == NULL) {
+        log_msg(ERROR, "%s: malloc() failed %s", __func__, strerror(errno));
+        free(control);
+        free(downstream);
+        return 1;
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, UPGRADE_MAGIC, sizeof(header.magic));
+    header.threads_num = config->threads_num;
+    header.data_port = config->data_port;
+    header.control_port = config->control_port;
+    header.downstream_num = config->downstream_num;
+    fds[0] = config->control_socket;
+    for (i = 0; i < config->threads_num; i++) {
+        fds[i + 1] = (config->thread_config + i)->socket_in;
+    }
+    iov.iov_base = &header;
+    iov.iov_len = sizeof(header);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = control_size;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    for (i = 0; i < config->downstream_num; i++) {
+        (downstream + i)->sa_in = (config->health_client + i)->sa_in;
+        (downstream + i)->alive = (config->health_client + i)->alive;
+    }
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(header) || send(fd, downstream, downstream_size, MSG_NOSIGNAL) != downstream_size) {
+        log_msg(WARN, "%s: send() failed %s", __func__, strerror(errno));
+        rc = 1;
+    }
+    free(control);
+    free(downstream);
+    return rc;
+}
+
+static void upgrade_accept_cb(struct ev_loop *loop, struct ev_io *watcher, int revents);
+
+// this function waits till new router is running, this one stops reading then and drains
+// if new router fails to start, this one keeps working
+static void upgrade_ready_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
+    struct sr_config_s *config = (struct sr_config_s *)watcher->data;
+    char ready = 0;
+    int n = recv(watcher->fd, &ready, 1, 0);
+
+    ev_io_stop(loop, watcher);
+    close(watcher->fd);
+    config->upgrade_fd = -1;
+    if (n != 1 || ready != UPGRADE_READY) {
+        log_msg(WARN, "%s: new router didn't start, upgrade is aborted", __func__);
+        ev_io_init(watcher, upgrade_accept_cb, config->upgrade_listen_fd, EV_READ);
+        ev_io_start(loop, watcher);
+        return;
+    }
+    log_msg(INFO, "%s: new router is running, draining", __func__);
+    close(config->upgrade_listen_fd);
+    config->upgrade_listen_fd = -1;
+    start_drain(loop, config);
+}
+
+// new router connects to upgrade socket to take over, both routers read the same sockets until new one is ready
+static void upgrade_accept_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
+    struct sr_config_s *config = (struct sr_config_s *)watcher->data;
+    int fd = accept(watcher->fd, NULL, NULL);
+
+    if (fd < 0) {
+        log_msg(WARN, "%s: accept() failed %s", __func__, strerror(errno));
+        return;
+    }
+    if (config->draining || upgrade_send(config, fd) != 0) {
+        close(fd);
+        return;
+    }
+    log_msg(INFO, "%s: sockets are passed to new router", __func__);
+    config->upgrade_fd = fd;
+    ev_io_stop(loop, watcher);
+    ev_io_init(watcher, upgrade_ready_cb, fd, EV_READ);
+    ev_io_start(loop, watcher);
+}
+
+// this function makes running router listen for new one on upgrade socket
+int init_upgrade(struct ev_loop *loop, struct sr_config_s *config) {
+    struct sockaddr_un addr;
+    int fd;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        log_msg(ERROR, "%s: socket() error %s", __func__, strerror(errno));
+        return 1;
+    }
+    upgrade_addr(config, &addr);
+    // socket of previous router is replaced, it has already passed its sockets
+    unlink(config->upgrade_socket);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 1) != 0) {
+        log_msg(ERROR, "%s: bind() failed %s", __func__, strerror(errno));
+        close(fd);
+        return 1;
+    }
+    config->upgrade_listen_fd = fd;
+    ev_io_init(&(config->upgrade_watcher), upgrade_accept_cb, fd, EV_READ);
+    config->upgrade_watcher.data = config;
+    ev_io_start(loop, &(config->upgrade_watcher));
+    return 0;
+}
+
+// this function takes data and control sockets over from running router
+// returns 0 without taking anything if there is no running router, ports are bound from scratch then
+int upgrade_connect(struct sr_config_s *config) {
+    struct sockaddr_un addr;
+    struct upgrade_header_s header;
+    struct upgrade_downstream_s downstream;
+    struct ds_health_client_s *health_client;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    int fds[config->threads_num + 1];
+    char control[CMSG_SPACE(sizeof(fds))];
+    int fd;
+    int i;
+    int j;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        log_msg(ERROR, "%s: socket() error %s", __func__, strerror(errno));
+        return 1;
+    }
+    upgrade_addr(config, &addr);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        log_msg(INFO, "%s: no running router at %s", __func__, config->upgrade_socket);
+        close(fd);
+        return 0;
+    }
+    iov.iov_base = &header;
+    iov.iov_len = sizeof(header);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(fd, &msg, MSG_WAITALL) != sizeof(header) || memcmp(header.magic, UPGRADE_MAGIC, sizeof(header.magic)) != 0) {
+        log_msg(ERROR, "%s: invalid handoff from running router", __func__);
+        close(fd);
+        return 1;
+    }
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (header.threads_num != config->threads_num || (msg.msg_flags & MSG_CTRUNC) || cmsg == NULL
+        || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        log_msg(ERROR, "%s: running router has %d threads, threads_num should be the same", __func__, header.threads_num);
+        close(fd);
+        return 1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    if (header.data_port != config->data_port || header.control_port != config->control_port) {
+        log_msg(ERROR, "%s: running router uses data_port %d and control_port %d, they should be the same", __func__, header.data_port, header.control_port);
+        close(fd);
+        return 1;
+    }
+    config->control_socket = fds[0];
+    for (i = 0; i < config->threads_num; i++) {
+        (config->thread_config + i)->socket_in = fds[i + 1];
+    }
+    // downstream health is taken over too, so lines are routed before first health check
+    for (i = 0; i < header.downstream_num; i++) {
+        if (recv(fd, &downstream, sizeof(downstream), MSG_WAITALL) != sizeof(downstream)) {
+            log_msg(ERROR, "%s: recv() failed %s", __func__, strerror(errno));
+            close(fd);
+            return 1;
+        }
+        for (j = 0; j < config->downstream_num; j++) {
+            health_client = config->health_client + j;
+            if (memcmp(&(health_client->sa_in), &(downstream.sa_in), sizeof(downstream.sa_in)) == 0) {
+                health_client->alive = downstream.alive;
+            }
+        }
+    }
+    rebuild_routing(&config->routing);
+    config->upgrade_fd = fd;
+    log_msg(INFO, "%s: sockets of running router are taken over", __func__);
+    return 0;
+}
+
+// this function tells previous router that data threads are running, it stops reading and drains then
+void upgrade_ready(struct sr_config_s *config) {
+    char ready = UPGRADE_READY;
+
+    if (send(config->upgrade_fd, &ready, 1, MSG_NOSIGNAL) != 1) {
+        log_msg(WARN, "%s: send() failed %s", __func__, strerror(errno));
+    }
+    close(config->upgrade_fd);
+    config->upgrade_fd = -1;
+}
@@ -0,0 +1,386 @@
+#include "sr-main.h"
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// user_data of multishot receive, sends carry pointer to their slot
+#define URING_RECV_TAG 0
+#define URING_CANCEL_TAG 1
+#define URING_BUFFER_GROUP 0
+
+// send in flight, buffer can't be reused until completion is posted
+struct uring_send_s {
+    struct uring_send_s *next;
+    struct msghdr msg;
+    struct iovec iov;
+    struct ds_buffer_s *buffer;
+    struct ds_buffer_pool_s *pool;
+    // downstream is referred by index, health clients are replaced on reload
+    int downstream_id;
+    int reload_generation;
+};
+
+struct uring_s {
+    // ev_io structure watching ring fd, it's readable when completions are posted
+    struct ev_io super;
+    // runs before event loop blocks, everything queued during loop iteration is submitted with single syscall
+    struct ev_prepare prepare;
+    struct ev_io_ds_s *socket_watcher;
+    struct thread_config_s *thread_config;
+    unsigned int entries;
+    // submission queue, sq_ready is our private tail
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int sq_mask;
+    unsigned int sq_ready;
+    struct io_uring_sqe *sqe;
+    // completion queue
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqe;
+    // provided buffers for multishot receive
+    struct io_uring_buf_ring *buf_ring;
+    unsigned short buf_tail;
+    char *recv_buffer;
+    int recv_buffer_size;
+    int recv_armed;
+    // set if kernel can't do multishot receive, socket is read via libev then
+    int recv_fallback;
+    // set when router drains, receive isn't armed again
+    int recv_stopped;
+    int sends_pending;
+    // free send slots
+    struct uring_send_s *send_free;
+};
+
+// this function returns next free submission entry, NULL if submission queue is full
+static struct io_uring_sqe *uring_get_sqe(struct uring_s *uring) {
+    struct io_uring_sqe *sqe;
+
+    if (uring->sq_ready - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) >= uring->entries) {
+        return NULL;
+    }
+    sqe = uring->sqe + (uring->sq_ready & uring->sq_mask);
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    uring->sq_ready++;
+    return sqe;
+}
+
+// this function passes all prepared entries to kernel
+static void uring_submit(struct uring_s *uring) {
+    unsigned int n = uring->sq_ready - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+
+    if (n == 0) {
+        return;
+    }
+    __atomic_store_n(uring->sq_tail, uring->sq_ready, __ATOMIC_RELEASE);
+    uring->thread_config->syscall_counter++;
+    if (syscall(__NR_io_uring_enter, uring->super.fd, n, 0, 0, NULL, 0) < 0) {
+        if (errno != EAGAIN && errno != EBUSY && errno != EINTR) {
+            log_msg(WARN, "%s: io_uring_enter() failed %s", __func__, strerror(errno));
+        }
+    }
+}
+
+// this function returns receive buffer to the kernel, new tail is published after completions are processed
+static void uring_return_buffer(struct uring_s *uring, unsigned short bid) {
+    struct io_uring_buf *buf = uring->buf_ring->bufs + (uring->buf_tail & (uring->entries - 1));
+
+    // one byte is reserved to terminate last line in datagram
+    buf->addr = (unsigned long)(uring->recv_buffer + bid * uring->recv_buffer_size);
+    buf->len = uring->recv_buffer_size - 1;
+    buf->bid = bid;
+    uring->buf_tail++;
+}
+
+// this function moves ready buffers of queued downstreams to send slots, same order as ds_flush_cb() uses
+static void uring_queue_sends(struct uring_s *uring, struct ds_socket_out_s *socket_out) {
+    struct downstream_s *ds;
+    struct ds_buffer_s *buffer;
+    struct uring_send_s *send;
+    struct io_uring_sqe *sqe;
+
+    while ((ds = socket_out->flush_queue_head) != NULL) {
+        while ((buffer = ds->ready_head) != NULL) {
+            if (uring->send_free == NULL) {
+                return;
+            }
+            sqe = uring_get_sqe(uring);
+            if (sqe == NULL) {
+                uring_submit(uring);
+                if ((sqe = uring_get_sqe(uring)) == NULL) {
+                    return;
+                }
+            }
+            send = uring->send_free;
+            uring->send_free = send->next;
+            ds->ready_head = buffer->next;
+            ds->ready_num--;
+            send->buffer = buffer;
+            send->pool = ds->pool;
+            send->downstream_id = ds->health_client->id;
+            send->reload_generation = uring->thread_config->common->reload_generation;
+            send->iov.iov_base = buffer->data;
+            send->iov.iov_len = buffer->length;
+            send->msg.msg_name = socket_out->connected ? NULL : &(ds->sa_in_data);
+            send->msg.msg_namelen = socket_out->connected ? 0 : sizeof(ds->sa_in_data);
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->fd = socket_out->super.fd;
+            sqe->addr = (unsigned long)&(send->msg);
+            sqe->len = 1;
+            sqe->user_data = (unsigned long)send;
+            uring->sends_pending++;
+        }
+        ds->ready_tail = NULL;
+        socket_out->flush_queue_head = ds->flush_queue_next;
+        ds->flush_queue_next = NULL;
+        ds->flush_queued = 0;
+    }
+    socket_out->flush_queue_tail = NULL;
+}
+
+// this function arms receive if needed and submits flushes scheduled during this loop iteration
+static void uring_prepare_cb(struct ev_loop *loop, struct ev_prepare *watcher, int revents) {
+    struct uring_s *uring = (struct uring_s *)watcher->data;
+    struct io_uring_sqe *sqe;
+    int i;
+
+    if (!uring->recv_armed && !uring->recv_fallback && !uring->recv_stopped && (sqe = uring_get_sqe(uring)) != NULL) {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = uring->socket_watcher->super.fd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BUFFER_GROUP;
+        sqe->user_data = URING_RECV_TAG;
+        uring->recv_armed = 1;
+    }
+    for (i = 0; i < uring->thread_config->common->socket_out_num; i++) {
+        uring_queue_sends(uring, uring->thread_config->socket_out + i);
+    }
+    uring_submit(uring);
+}
+
+// this function processes datagram received by multishot receive
+static void uring_recv_complete(struct uring_s *uring, struct io_uring_cqe *cqe, struct ev_loop *loop) {
+    struct ev_io_ds_s *socket_watcher = uring->socket_watcher;
+    unsigned short bid;
+
+    // without this flag kernel won't post more completions, receive should be armed again
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        uring->recv_armed = 0;
+    }
+    if (cqe->res < 0) {
+        // no free buffers, receive is armed again once buffers are returned
+        if (cqe->res == -ENOBUFS || (cqe->res == -ECANCELED && uring->recv_stopped)) {
+            return;
+        }
+        log_msg(WARN, "%s: receive failed %s", __func__, strerror(-cqe->res));
+        if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP) {
+            log_msg(WARN, "%s: multishot receive is not supported, falling back to libev", __func__);
+            uring->recv_fallback = 1;
+            ev_io_start(loop, (struct ev_io *)socket_watcher);
+        }
+        return;
+    }
+    if (!(cqe->flags & IORING_CQE_F_BUFFER)) {
+        return;
+    }
+    bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    // plain receive doesn't return kernel timestamp, latency is measured from completion
+    latency_mark(uring->thread_config);
+    if (uring->thread_config->common->capture != NULL) {
+        capture_datagram(uring->thread_config->common->capture, uring->thread_config->index,
+            uring->recv_buffer + bid * uring->recv_buffer_size, cqe->res, latency_now());
+    }
+    STATS_ADD(uring->thread_config, datagrams, 1);
+    process_datagram(uring->recv_buffer + bid * uring->recv_buffer_size, cqe->res,
+        socket_watcher->downstream_num, socket_watcher->downstream, loop);
+    uring_return_buffer(uring, bid);
+}
+
+// this function releases buffer once send is completed
+static void uring_send_complete(struct uring_s *uring, struct io_uring_cqe *cqe) {
+    struct uring_send_s *send = (struct uring_send_s *)(unsigned long)cqe->user_data;
+    struct sr_config_s *config = uring->thread_config->common;
+
+    if (cqe->res < 0) {
+        // only connected sockets get port unreachable reported
+        if (cqe->res == -ECONNREFUSED) {
+            if (send->reload_generation == config->reload_generation) {
+                ds_health_refused(config->health_client + send->downstream_id);
+            }
+        } else {
+            log_msg(WARN, "%s: sendmsg() failed %s", __func__, strerror(-cqe->res));
+        }
+        STATS_ADD(uring->thread_config, send_errors, 1);
+        STATS_ADD(uring->thread_config, dropped_lines, count_lines(send->buffer));
+    } else {
+        if (uring->thread_config->latency != NULL) {
+            latency_record(&(uring->thread_config->latency->send), latency_now() - send->buffer->recv_time);
+        }
+        STATS_ADD(uring->thread_config, bytes_sent, cqe->res);
+        STATS_ADD(uring->thread_config, packets_sent, (cqe->res + send->pool->segment_size - 1) / send->pool->segment_size);
+    }
+    ds_buffer_free(send->pool, send->buffer);
+    send->buffer = NULL;
+    send->next = uring->send_free;
+    uring->send_free = send;
+    uring->sends_pending--;
+}
+
+// this function reaps all posted completions
+static void uring_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
+    struct uring_s *uring = (struct uring_s *)watcher;
+    struct io_uring_cqe *cqe;
+    unsigned int head = *(uring->cq_head);
+    unsigned int tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+    unsigned short buf_tail = uring->buf_tail;
+
+    if (EV_ERROR & revents) {
+        log_msg(WARN, "%s: invalid event %s", __func__, strerror(errno));
+        return;
+    }
+    if (head == tail) {
+        return;
+    }
+    uring->thread_config->recv_call_counter++;
+    for (; head != tail; head++) {
+        cqe = uring->cqe + (head & uring->cq_mask);
+        if (cqe->user_data == URING_RECV_TAG) {
+            uring_recv_complete(uring, cqe, loop);
+        } else if (cqe->user_data == URING_CANCEL_TAG) {
+            continue;
+        } else {
+            uring_send_complete(uring, cqe);
+        }
+    }
+    __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+    if (uring->buf_tail != buf_tail) {
+        __atomic_store_n(&(uring->buf_ring->tail), uring->buf_tail, __ATOMIC_RELEASE);
+    }
+}
+
+// this function stops receiving from data socket, datagrams already received are still processed
+void uring_stop_recv(struct uring_s *uring, struct ev_loop *loop) {
+    struct io_uring_sqe *sqe;
+
+    uring->recv_stopped = 1;
+    if (uring->recv_fallback) {
+        ev_io_stop(loop, (struct ev_io *)uring->socket_watcher);
+        return;
+    }
+    // cancel request is submitted by prepare watcher together with sends
+    if (uring->recv_armed && (sqe = uring_get_sqe(uring)) != NULL) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = URING_RECV_TAG;
+        sqe->user_data = URING_CANCEL_TAG;
+    }
+}
+
+// this function returns number of sends kernel didn't complete yet
+int uring_pending_sends(struct uring_s *uring) {
+    return uring->sends_pending;
+}
+
+// this function sets up io_uring for data thread: multishot receive from socket_in and batched sends to downstreams
+// returns NULL if kernel doesn't support required features, libev is used then
+struct uring_s *init_uring(struct ev_loop *loop, struct thread_config_s *thread_config, struct ev_io_ds_s *socket_watcher, int entries) {
+    struct io_uring_params params;
+    struct io_uring_buf_reg reg;
+    struct uring_s *uring;
+    struct uring_send_s *send;
+    size_t ring_size;
+    size_t cq_size;
+    char *ring;
+    int fd;
+    int i;
+
+    memset(&params, 0, sizeof(params));
+    fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) {
+        log_msg(WARN, "%s: io_uring_setup() failed %s", __func__, strerror(errno));
+        return NULL;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        log_msg(WARN, "%s: kernel is too old for io_uring backend", __func__);
+        close(fd);
+        return NULL;
+    }
+    ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (cq_size > ring_size) {
+        ring_size = cq_size;
+    }
+    uring = (struct uring_s *)calloc(1, sizeof(struct uring_s));
+    if (uring == NULL) {
+        log_msg(ERROR, "%s: malloc() failed %s", __func__, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    uring->sqe = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    // provided buffer ring should be page aligned
+    uring->buf_ring = mmap(NULL, params.sq_entries * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED || uring->sqe == MAP_FAILED || uring->buf_ring == MAP_FAILED) {
+        log_msg(WARN, "%s: mmap() failed %s", __func__, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    uring->entries = params.sq_entries;
+    uring->sq_head = (unsigned int *)(ring + params.sq_off.head);
+    uring->sq_tail = (unsigned int *)(ring + params.sq_off.tail);
+    uring->sq_mask = *(unsigned int *)(ring + params.sq_off.ring_mask);
+    uring->sq_ready = *(uring->sq_tail);
+    // submission entries are always used in ring order
+    for (i = 0; i < params.sq_entries; i++) {
+        *((unsigned int *)(ring + params.sq_off.array) + i) = i;
+    }
+    uring->cq_head = (unsigned int *)(ring + params.cq_off.head);
+    uring->cq_tail = (unsigned int *)(ring + params.cq_off.tail);
+    uring->cq_mask = *(unsigned int *)(ring + params.cq_off.ring_mask);
+    uring->cqe = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
+
+    // one receive buffer per submission entry
+    uring->recv_buffer_size = socket_watcher->recv_buffer_size;
+    uring->recv_buffer = (char *)malloc((size_t)uring->entries * uring->recv_buffer_size);
+    send = (struct uring_send_s *)calloc(uring->entries, sizeof(struct uring_send_s));
+    if (uring->recv_buffer == NULL || send == NULL) {
+        log_msg(ERROR, "%s: malloc() failed %s", __func__, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    for (i = 0; i < uring->entries; i++) {
+        uring_return_buffer(uring, i);
+    }
+    uring->buf_ring->tail = uring->buf_tail;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)uring->buf_ring;
+    reg.ring_entries = uring->entries;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        log_msg(WARN, "%s: provided buffer ring registration failed %s", __func__, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    // send slots, each one holds message header for single outgoing buffer
+    for (i = 0; i < uring->entries; i++) {
+        (send + i)->msg.msg_iov = &((send + i)->iov);
+        (send + i)->msg.msg_iovlen = 1;
+        (send + i)->next = uring->send_free;
+        uring->send_free = send + i;
+    }
+    uring->socket_watcher = socket_watcher;
+    uring->thread_config = thread_config;
+    // sends are submitted from prepare watcher instead of socket writability watchers
+    for (i = 0; i < thread_config->common->socket_out_num; i++) {
+        (thread_config->socket_out + i)->uring = uring;
+    }
+    ev_io_init((struct ev_io *)uring, uring_cb, fd, EV_READ);
+    ev_io_start(loop, (struct ev_io *)uring);
+    ev_prepare_init(&(uring->prepare), uring_prepare_cb);
+    uring->prepare.data = uring;
+    ev_prepare_start(loop, &(uring->prepare));
+    log_msg(INFO, "%s: thread %d uses io_uring backend with %d entries", __func__, thread_config->index, uring->entries);
+    return uring;
+}
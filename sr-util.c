@@ -1,30 +1,261 @@
 #include "sr-util.h"
 
+// record header in log ring, message follows it, zero length marks wrap to ring start
+struct log_record_s {
+    time_t time;
+    int level;
+    int length;
+};
+
+#define LOG_ALIGN sizeof(struct log_record_s)
+#define LOG_RECORD_SIZE(length) (sizeof(struct log_record_s) + (((length) + LOG_ALIGN - 1) & ~(LOG_ALIGN - 1)))
+
+// messages per second allowed from single call site, 0 turns limit off
+int log_rate_limit = 0;
+
+// rings of all threads which have logged, new rings are pushed to list head
+static struct log_ring_s *log_rings = NULL;
+// call sites which had messages suppressed
+static struct log_site_s *log_sites = NULL;
+static __thread struct log_ring_s *log_ring = NULL;
+// messages are written synchronously till writer is started and after exit
+static int log_writer_running = 0;
+// writer and exit handler are kept apart by this mutex, threads which log don't take it
+static pthread_mutex_t log_write_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 // function to convert numeric values into strings
 static char *log_level_name(enum log_level_e level) {
     static char *name[] = { "TRACE", "DEBUG", "INFO", "WARN", "ERROR"};
     return name[level];
 }
 
+// this function returns formatted time, it's formatted again only when second changes
+static char *log_time(time_t t) {
+    static time_t cached = -1;
+    static char buffer[LOG_TIME_SIZE];
+    struct tm tinfo;
+
+    if (t != cached) {
+        localtime_r(&t, &tinfo);
+        strftime(buffer, LOG_TIME_SIZE, "%Y-%m-%d %H:%M:%S", &tinfo);
+        cached = t;
+    }
+    return buffer;
+}
+
+// this function writes single message to stdout, it's called with log_write_mutex locked
+static void log_write(time_t t, long tid, int level, char *message, int length) {
+    fprintf(stdout, "%s %ld %s %.*s\n", log_time(t), tid, log_level_name(level), length, message);
+}
+
+// this function returns 1 if call site has already logged log_rate_limit messages during current second
+static int log_rate_limited(struct log_site_s *site, int level, time_t t) {
+    long window = __atomic_load_n(&(site->window), __ATOMIC_RELAXED);
+    int limit = log_rate_limit;
+
+    if (limit <= 0) {
+        return 0;
+    }
+    if (window != t && __atomic_compare_exchange_n(&(site->window), &window, t, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&(site->count), 0, __ATOMIC_RELAXED);
+    }
+    if (__atomic_add_fetch(&(site->count), 1, __ATOMIC_RELAXED) <= limit) {
+        return 0;
+    }
+    __atomic_add_fetch(&(site->suppressed), 1, __ATOMIC_RELAXED);
+    // writer reports suppressed messages of listed sites
+    if (__atomic_exchange_n(&(site->listed), 1, __ATOMIC_RELAXED) == 0) {
+        site->level = level;
+        site->next = __atomic_load_n(&log_sites, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&log_sites, &(site->next), site, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    return 1;
+}
+
+// this function returns ring of calling thread, ring is allocated on first message
+static struct log_ring_s *log_thread_ring() {
+    struct log_ring_s *ring = log_ring;
+
+    if (ring != NULL) {
+        return ring;
+    }
+    if (posix_memalign((void **)&ring, CACHE_LINE_SIZE, sizeof(struct log_ring_s)) != 0) {
+        return NULL;
+    }
+    memset(ring, 0, sizeof(struct log_ring_s));
+    if (posix_memalign((void **)&(ring->data), LOG_ALIGN, LOG_RING_SIZE) != 0) {
+        free(ring);
+        return NULL;
+    }
+    ring->tid = syscall(SYS_gettid);
+    ring->next = __atomic_load_n(&log_rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&log_rings, &(ring->next), ring, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    log_ring = ring;
+    return ring;
+}
+
+// this function puts message into ring of calling thread, message is dropped if ring is full
+static void log_push(struct log_ring_s *ring, time_t t, int level, char *message, int length) {
+    struct log_record_s *record;
+    unsigned long tail = ring->tail;
+    unsigned long need = LOG_RECORD_SIZE(length);
+    unsigned long offset = tail & (LOG_RING_SIZE - 1);
+    unsigned long total = need;
+
+    // record is never split, the rest of ring is skipped if record doesn't fit there
+    if (LOG_RING_SIZE - offset < need) {
+        total += LOG_RING_SIZE - offset;
+    }
+    if (tail + total - ring->head_cache > LOG_RING_SIZE) {
+        ring->head_cache = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+        if (tail + total - ring->head_cache > LOG_RING_SIZE) {
+            __atomic_store_n(&(ring->dropped), ring->dropped + 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+    // writer may read tail any time, so wrap marker and record are published by single store
+    if (total != need) {
+        ((struct log_record_s *)(ring->data + offset))->length = 0;
+        tail += LOG_RING_SIZE - offset;
+        offset = 0;
+    }
+    record = (struct log_record_s *)(ring->data + offset);
+    record->time = t;
+    record->level = level;
+    record->length = length;
+    memcpy(record + 1, message, length);
+    __atomic_store_n(&(ring->tail), tail + need, __ATOMIC_RELEASE);
+}
+
+// this function writes out messages of all rings, drops and suppressions are reported once per second
+// it's called with log_write_mutex locked
+static void log_drain(int report) {
+    static time_t reported = 0;
+    struct log_ring_s *ring;
+    struct log_site_s *site;
+    struct log_record_s *record;
+    char buffer[LOG_BUF_SIZE];
+    unsigned long head;
+    unsigned long tail;
+    unsigned long offset;
+    time_t t = time(NULL);
+    long n;
+
+    for (ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+        head = ring->head;
+        tail = __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            offset = head & (LOG_RING_SIZE - 1);
+            record = (struct log_record_s *)(ring->data + offset);
+            if (record->length == 0) {
+                head += LOG_RING_SIZE - offset;
+                continue;
+            }
+            log_write(record->time, ring->tid, record->level, (char *)(record + 1), record->length);
+            head += LOG_RECORD_SIZE(record->length);
+        }
+        __atomic_store_n(&(ring->head), head, __ATOMIC_RELEASE);
+    }
+    if (!report && t == reported) {
+        fflush(stdout);
+        return;
+    }
+    reported = t;
+    for (ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+        n = __atomic_load_n(&(ring->dropped), __ATOMIC_RELAXED);
+        if (n != ring->dropped_reported) {
+            log_write(t, ring->tid, WARN, buffer,
+                snprintf(buffer, LOG_BUF_SIZE, "%s: %ld messages were dropped, log ring is full", __func__, n - ring->dropped_reported));
+            ring->dropped_reported = n;
+        }
+    }
+    for (site = __atomic_load_n(&log_sites, __ATOMIC_ACQUIRE); site != NULL; site = site->next) {
+        n = __atomic_exchange_n(&(site->suppressed), 0, __ATOMIC_RELAXED);
+        if (n > 0) {
+            log_write(t, syscall(SYS_gettid), site->level, buffer,
+                snprintf(buffer, LOG_BUF_SIZE, "%s: %ld messages from %s:%d were suppressed", __func__, n, site->file, site->line));
+        }
+    }
+    fflush(stdout);
+}
+
 // function to log message
-void log_msg(int level, char *format, ...) {
+// message is formatted by calling thread and written to stdout by log writer thread
+void log_site_msg(struct log_site_s *site, int level, char *format, ...) {
     va_list args;
-    time_t t;
-    struct tm *tinfo;
     char buffer[LOG_BUF_SIZE];
-    int l = 0;
+    time_t t = time(NULL);
+    struct log_ring_s *ring = NULL;
+    int length;
 
-    if (level < log_level) {
+    if (log_rate_limited(site, level, t)) {
         return;
     }
     va_start(args, format);
-    time(&t);
-    tinfo = localtime(&t);
-    l = strftime(buffer, LOG_BUF_SIZE, "%Y-%m-%d %H:%M:%S", tinfo);
-    l += sprintf(buffer + l, " %ld %s ", syscall(SYS_gettid), log_level_name(level));
-    vsnprintf(buffer + l, LOG_BUF_SIZE - l, format, args);
+    length = vsnprintf(buffer, LOG_BUF_SIZE, format, args);
     va_end(args);
-    fprintf(stdout, "%s\n", buffer);
+    if (length < 0) {
+        return;
+    }
+    if (length >= LOG_BUF_SIZE) {
+        length = LOG_BUF_SIZE - 1;
+    }
+    if (__atomic_load_n(&log_writer_running, __ATOMIC_ACQUIRE)) {
+        ring = log_thread_ring();
+    }
+    if (ring != NULL) {
+        log_push(ring, t, level, buffer, length);
+        return;
+    }
+    pthread_mutex_lock(&log_write_mutex);
+    log_write(t, syscall(SYS_gettid), level, buffer, length);
     fflush(stdout);
+    pthread_mutex_unlock(&log_write_mutex);
+}
+
+static void *log_writer_thread(void *args) {
+    struct timespec interval = { 0, LOG_WRITE_INTERVAL };
+
+    while (1) {
+        nanosleep(&interval, NULL);
+        pthread_mutex_lock(&log_write_mutex);
+        log_drain(0);
+        pthread_mutex_unlock(&log_write_mutex);
+    }
+    return NULL;
+}
+
+// this function writes out messages left in rings on exit, further messages are written synchronously
+static void log_flush() {
+    struct timespec deadline;
+
+    __atomic_store_n(&log_writer_running, 0, __ATOMIC_RELEASE);
+    // exit can interrupt thread holding the mutex, so it isn't waited for forever
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec++;
+    if (pthread_mutex_timedlock(&log_write_mutex, &deadline) != 0) {
+        return;
+    }
+    log_drain(1);
+    pthread_mutex_unlock(&log_write_mutex);
 }
 
+// this function starts log writer thread, messages logged before it are written synchronously
+int init_log() {
+    pthread_t thread;
+    int n;
+
+    tzset();
+    if (atexit(log_flush) != 0) {
+        log_msg(ERROR, "%s: atexit() failed", __func__);
+        return 1;
+    }
+    n = pthread_create(&thread, NULL, log_writer_thread, NULL);
+    if (n != 0) {
+        log_msg(ERROR, "%s: pthread_create() failed %s", __func__, strerror(n));
+        return 1;
+    }
+    pthread_detach(thread);
+    __atomic_store_n(&log_writer_running, 1, __ATOMIC_RELEASE);
+    return 0;
+}
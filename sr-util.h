@@ -1,16 +1,27 @@
 #ifndef _SR_UTIL_H
 #define _SR_UTIL_H
 
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <time.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/syscall.h>
+#include <pthread.h>
 
 #include "sr-types.h"
 
 #define LOG_BUF_SIZE 2048
+// size of log ring of each thread, bytes, power of 2
+#define LOG_RING_SIZE (256 * 1024)
+// how often log writer drains rings, nanoseconds
+#define LOG_WRITE_INTERVAL 10000000
+// default number of messages each call site can log per second
+#define LOG_RATE_LIMIT 100
+#define LOG_TIME_SIZE 32
 
 // numeric values for log levels
 enum log_level_e {
@@ -22,7 +33,17 @@ enum log_level_e {
 };
 
 int log_level;
+extern int log_rate_limit;
 
-void log_msg(int level, char *format, ...);
+// each call site has own rate limit, so flood of one message doesn't hide others
+#define log_msg(level, ...) do { \
+    static struct log_site_s log_site = { .file = __FILE__, .line = __LINE__ }; \
+    if ((level) >= log_level) { \
+        log_site_msg(&log_site, (level), __VA_ARGS__); \
+    } \
+} while (0)
+
+void log_site_msg(struct log_site_s *site, int level, char *format, ...);
+int init_log(void);
 
 #endif
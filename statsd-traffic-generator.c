@@ -2,10 +2,14 @@
  * statsd-traffic-generator: generates traffic for testing of statsd-cluster
  * (https://github.com/etsy/statsd/).
  *
+ * Several threads build datagrams packed with metric lines of configured
+ * type mix and send them with sendmmsg() either at target rate or as fast as
+ * possible. Achieved packets/s and lines/s are reported periodically.
+ *
  * Author: Kirill Timofeev <kvt@hulu.com>
- *	
- * Enjoy :-)!	
- *	
+ *
+ * Enjoy :-)!
+ *
 **/
 
 #pragma GCC diagnostic ignored "-Wstrict-aliasing"
@@ -22,28 +26,84 @@
 #include <stdarg.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
 
 // Size of buffer for outgoing packets. Should be below MTU.
-// TODO Probably should be configured via configuration file?
 #define DOWNSTREAM_BUF_SIZE 1450
+#define DOWNSTREAM_BUF_SIZE_MAX 65507
 // Size of other temporary buffers
 #define LOG_BUF_SIZE 2048
+// Max length of metric name, longer names are cut
+#define METRIC_NAME_SIZE 256
+// Default number of datagrams sent with single sendmmsg()
+#define SEND_BATCH_SIZE 64
+#define SEND_BATCH_SIZE_MAX 1024
+#define CACHE_LINE_SIZE 64
 
-// structure that holds downstream data
-struct downstream_s {
-    // sockaddr for data
-    struct sockaddr_in sa_in_data;
-    // id extended ev_io structure used for sending data to downstream
-    struct ev_io flush_watcher;
-    // last time data was flushed to downstream
-    ev_tstamp last_flush_time;
+enum metric_type_e {
+    METRIC_COUNTER,
+    METRIC_GAUGE,
+    METRIC_TIMER,
+    METRIC_SET,
+    METRIC_TYPES_NUM
+};
+
+// statsd type suffixes in metric_type_e order
+static char *metric_type_suffix[] = {"c", "g", "ms", "s"};
+static char *metric_type_name[] = {"counter", "gauge", "timer", "set"};
+
+// per thread counters, written by sending thread and read by reporting main thread
+struct generator_stats_s {
+    long packets;
+    long lines;
+    long bytes;
+    long errors;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct generator_thread_s {
+    int index;
+    pthread_t thread;
+    // xorshift state, each thread has own sequence
+    unsigned long random;
+    struct generator_stats_s stats;
 };
 
 // globally accessed structure with commonly used data
 struct global_s {
-    struct downstream_s downstream;
-    // how often we flush data
-    ev_tstamp downstream_flush_interval;
+    // sockaddr for data
+    struct sockaddr_in sa_in_data;
+    int threads_num;
+    // target lines per second for all threads, 0 means as fast as possible
+    double rate;
+    // how long to run, seconds, 0 means forever
+    double duration;
+    // how often achieved rates are reported, seconds
+    double report_interval;
+    // number of distinct metric names and their length range
+    int key_cardinality;
+    int name_length_min;
+    int name_length_max;
+    char *name_prefix;
+    // relative weights of metric types
+    int type_weight[METRIC_TYPES_NUM];
+    int type_weight_sum;
+    // share of counters and timers having sample rate, percent
+    int sampled_percent;
+    double sample_rate;
+    // datagram is filled up to packet_size bytes or lines_per_datagram lines if it's not 0
+    int packet_size;
+    int lines_per_datagram;
+    int send_batch_size;
+    // metric names, key_cardinality entries of METRIC_NAME_SIZE bytes
+    char *names;
+    int *name_length;
+    struct generator_thread_s *thread;
+    // previous report values
+    long report_packets;
+    long report_lines;
+    long report_bytes;
+    ev_tstamp report_time;
+    ev_tstamp start_time;
     // how noisy is our log
     int log_level;
 };
@@ -87,39 +147,227 @@ void log_msg(int level, char *format, ...) {
     fflush(stdout);
 }
 
-void ds_flush_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
-    int bytes_send;
-    static int counter = 0;
-    char buffer[DOWNSTREAM_BUF_SIZE];
+// xorshift64 random number generator, it's fast and good enough for traffic generation
+static inline unsigned long next_random(unsigned long *state) {
+    unsigned long x = *state;
 
-    if (EV_ERROR & revents) {
-        log_msg(ERROR, "%s: invalid event %s", __func__, strerror(errno));
-        return;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+// this function returns monotonic time in seconds
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// this function prepares metric names, name lengths are spread uniformly between min and max
+int init_names(void) {
+    unsigned long random = 0x9e3779b97f4a7c15UL;
+    char *name;
+    int length;
+    int range = global.name_length_max - global.name_length_min + 1;
+    int i;
+    int l;
+
+    global.names = (char *)malloc((long)global.key_cardinality * METRIC_NAME_SIZE);
+    global.name_length = (int *)malloc(global.key_cardinality * sizeof(int));
+    if (global.names == NULL || global.name_length == NULL) {
+        log_msg(ERROR, "%s: malloc() failed %s", __func__, strerror(errno));
+        return 1;
+    }
+    for (i = 0; i < global.key_cardinality; i++) {
+        name = global.names + (long)i * METRIC_NAME_SIZE;
+        length = global.name_length_min + next_random(&random) % range;
+        l = snprintf(name, METRIC_NAME_SIZE, "%s.key%d.", global.name_prefix, i);
+        // names are padded to target length, shortest names have just prefix and key number
+        if (l < length) {
+            memset(name + l, 'x', length - l);
+            l = length;
+        }
+        if (l >= METRIC_NAME_SIZE) {
+            l = METRIC_NAME_SIZE - 1;
+        }
+        name[l] = 0;
+        *(global.name_length + i) = l;
     }
+    return 0;
+}
+
+// this function writes random metric line to buffer, returns its length or 0 if it doesn't fit
+static int generate_line(struct generator_thread_s *thread, char *buffer, int size) {
+    unsigned long r = next_random(&(thread->random));
+    int key = r % global.key_cardinality;
+    int weight = (r >> 32) % global.type_weight_sum;
+    int type;
+    int sampled;
+    long value;
+    int l;
 
-    ev_io_stop(loop, watcher);
-    counter = (counter + 1) % 100;
-    sprintf(buffer, "test.counter%d:1|c\n", counter);
-    bytes_send = sendto(watcher->fd,
-        buffer,
-        strlen(buffer),
-        0,
-        (struct sockaddr *) (&global.downstream.sa_in_data),
-        sizeof(global.downstream.sa_in_data));
-    if (bytes_send < 0) {
-        log_msg(ERROR, "%s: sendto() failed %s", __func__, strerror(errno));
+    for (type = 0; type < METRIC_TYPES_NUM - 1 && weight >= global.type_weight[type]; type++) {
+        weight -= global.type_weight[type];
+    }
+    r = next_random(&(thread->random));
+    value = r % 1000;
+    if (type == METRIC_COUNTER) {
+        value = 1;
+    } else if (type == METRIC_SET) {
+        value = r % global.key_cardinality;
+    }
+    sampled = (type == METRIC_COUNTER || type == METRIC_TIMER) && (int)((r >> 32) % 100) < global.sampled_percent;
+    if (*(global.name_length + key) + 32 > size) {
+        return 0;
+    }
+    l = sprintf(buffer, "%s:%ld|%s", global.names + (long)key * METRIC_NAME_SIZE, value, metric_type_suffix[type]);
+    if (sampled) {
+        l += sprintf(buffer + l, "|@%g", global.sample_rate);
     }
+    buffer[l++] = '\n';
+    return l;
 }
 
-void ds_flush_timer_cb(struct ev_loop *loop, struct ev_periodic *p, int revents) {
-    struct ev_io *watcher = NULL;
+// this function sends generated datagrams, rate is kept by sleeping between batches
+void *generator_thread(void *args) {
+    struct generator_thread_s *thread = (struct generator_thread_s *)args;
+    int batch_size = global.send_batch_size;
+    struct mmsghdr *msg = (struct mmsghdr *)calloc(batch_size, sizeof(struct mmsghdr));
+    struct iovec *iov = (struct iovec *)calloc(batch_size, sizeof(struct iovec));
+    char *arena = (char *)malloc((long)batch_size * global.packet_size);
+    int *datagram_lines = (int *)malloc(batch_size * sizeof(int));
+    double rate = global.rate / global.threads_num;
+    // with target rate batch holds about 1ms of traffic, so low rates aren't sent in bursts
+    long rate_batch_lines = (long)(rate / 1000.0);
+    double start;
+    double delay;
+    long lines = 0;
+    long batch_lines;
+    long sent_lines;
+    char *buffer;
+    int msg_num;
+    int sent;
+    int length;
+    int n;
+    int l;
+    int i;
+    int k;
+    int fd;
 
-    watcher = &(global.downstream.flush_watcher);
-    if (ev_is_active(watcher)) {
-        return;
+    if (msg == NULL || iov == NULL || arena == NULL || datagram_lines == NULL) {
+        log_msg(ERROR, "%s: malloc() failed %s", __func__, strerror(errno));
+        exit(1);
+    }
+    fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (fd < 0) {
+        log_msg(ERROR, "%s: socket() failed %s", __func__, strerror(errno));
+        exit(1);
+    }
+    // connected socket doesn't need address in each message
+    if (connect(fd, (struct sockaddr *)&global.sa_in_data, sizeof(global.sa_in_data)) != 0) {
+        log_msg(ERROR, "%s: connect() failed %s", __func__, strerror(errno));
+        exit(1);
+    }
+    for (i = 0; i < batch_size; i++) {
+        (iov + i)->iov_base = arena + (long)i * global.packet_size;
+        (msg + i)->msg_hdr.msg_iov = iov + i;
+        (msg + i)->msg_hdr.msg_iovlen = 1;
+    }
+    start = now();
+    while (1) {
+        batch_lines = 0;
+        for (i = 0; i < batch_size && (rate == 0.0 || i == 0 || batch_lines < rate_batch_lines); i++) {
+            buffer = (char *)(iov + i)->iov_base;
+            length = 0;
+            for (k = 0; global.lines_per_datagram == 0 || k < global.lines_per_datagram; k++) {
+                l = generate_line(thread, buffer + length, global.packet_size - length);
+                if (l == 0) {
+                    break;
+                }
+                length += l;
+            }
+            (iov + i)->iov_len = length;
+            *(datagram_lines + i) = k;
+            batch_lines += k;
+        }
+        msg_num = i;
+        // with target rate thread sleeps until batch is due
+        if (rate > 0.0) {
+            delay = start + lines / rate - now();
+            if (delay > 0.0) {
+                usleep(delay * 1e6);
+            }
+        }
+        // sendmmsg() stops at first failed datagram, rest of batch is sent again
+        for (sent = 0; sent < msg_num; sent += n) {
+            n = sendmmsg(fd, msg + sent, msg_num - sent, 0);
+            if (n < 0) {
+                // downstream isn't listening, ICMP errors are reported to connected socket and failed datagram is lost
+                __atomic_store_n(&(thread->stats.errors), thread->stats.errors + 1, __ATOMIC_RELAXED);
+                n = 1;
+                continue;
+            }
+            sent_lines = 0;
+            for (i = sent; i < sent + n; i++) {
+                __atomic_store_n(&(thread->stats.bytes), thread->stats.bytes + (iov + i)->iov_len, __ATOMIC_RELAXED);
+                sent_lines += *(datagram_lines + i);
+            }
+            __atomic_store_n(&(thread->stats.packets), thread->stats.packets + n, __ATOMIC_RELAXED);
+            __atomic_store_n(&(thread->stats.lines), thread->stats.lines + sent_lines, __ATOMIC_RELAXED);
+        }
+        // lost datagrams count for rate too, otherwise generator would speed up when downstream fails
+        lines += batch_lines;
+    }
+    return NULL;
+}
+
+// this function sums counters of all threads
+static void total_stats(struct generator_stats_s *total) {
+    struct generator_stats_s *stats;
+    int i;
+
+    memset(total, 0, sizeof(*total));
+    for (i = 0; i < global.threads_num; i++) {
+        stats = &((global.thread + i)->stats);
+        total->packets += __atomic_load_n(&(stats->packets), __ATOMIC_RELAXED);
+        total->lines += __atomic_load_n(&(stats->lines), __ATOMIC_RELAXED);
+        total->bytes += __atomic_load_n(&(stats->bytes), __ATOMIC_RELAXED);
+        total->errors += __atomic_load_n(&(stats->errors), __ATOMIC_RELAXED);
+    }
+}
+
+// this function reports rates achieved since previous report
+void report_cb(struct ev_loop *loop, struct ev_periodic *p, int revents) {
+    struct generator_stats_s total;
+    ev_tstamp t = ev_time();
+    double interval = t - global.report_time;
+
+    total_stats(&total);
+    if (interval > 0.0) {
+        log_msg(INFO, "%s: packets/s %.0f lines/s %.0f MB/s %.2f send errors %ld", __func__,
+            (total.packets - global.report_packets) / interval,
+            (total.lines - global.report_lines) / interval,
+            (total.bytes - global.report_bytes) / interval / 1e6,
+            total.errors);
     }
-    ev_io_init(watcher, ds_flush_cb, watcher->fd, EV_WRITE);
-    ev_io_start(ev_default_loop(0), watcher);
+    global.report_packets = total.packets;
+    global.report_lines = total.lines;
+    global.report_bytes = total.bytes;
+    global.report_time = t;
+}
+
+// this function stops generator after configured duration and reports average rates
+void duration_cb(struct ev_loop *loop, struct ev_timer *timer, int revents) {
+    struct generator_stats_s total;
+    double interval = ev_time() - global.start_time;
+
+    total_stats(&total);
+    log_msg(INFO, "%s: total packets %ld lines %ld bytes %ld send errors %ld, average packets/s %.0f lines/s %.0f", __func__,
+        total.packets, total.lines, total.bytes, total.errors, total.packets / interval, total.lines / interval);
+    exit(0);
 }
 
 void init_sockaddr_in(struct sockaddr_in *sa_in, char *host, char *port) {
@@ -141,20 +389,42 @@ int init_downstream(char *hosts) {
     char *data_port = NULL;
 
     // argument line has the following format: host:data_port
-    // now let's initialize downstreams
-    global.downstream.last_flush_time = ev_time();
-    global.downstream.flush_watcher.fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);;
-    if (global.downstream.flush_watcher.fd < 0) {
-        log_msg(ERROR, "%s: socket() failed %s", __func__, strerror(errno));
-        return 1;
-    }
     data_port = strchr(host, ':');
     if (data_port == NULL) {
         log_msg(ERROR, "%s: no data port for %s", __func__, host);
         return 1;
     }
     *data_port++ = 0;
-    init_sockaddr_in(&global.downstream.sa_in_data, host, data_port);
+    init_sockaddr_in(&global.sa_in_data, host, data_port);
+    return 0;
+}
+
+// function to parse type mix like counter:60,gauge:20,timer:15,set:5
+int init_type_mix(char *mix) {
+    char *weight;
+    char *next;
+    int i;
+
+    memset(global.type_weight, 0, sizeof(global.type_weight));
+    while (mix != NULL && *mix != 0) {
+        next = strchr(mix, ',');
+        if (next != NULL) {
+            *next++ = 0;
+        }
+        weight = strchr(mix, ':');
+        if (weight == NULL) {
+            log_msg(ERROR, "%s: no weight for %s", __func__, mix);
+            return 1;
+        }
+        *weight++ = 0;
+        for (i = 0; i < METRIC_TYPES_NUM && strcmp(metric_type_name[i], mix) != 0; i++);
+        if (i == METRIC_TYPES_NUM) {
+            log_msg(ERROR, "%s: unknown metric type %s", __func__, mix);
+            return 1;
+        }
+        global.type_weight[i] = atoi(weight);
+        mix = next;
+    }
     return 0;
 }
 
@@ -167,12 +437,38 @@ int process_config_line(char *line) {
         return 1;
     }
     *value_ptr++ = 0;
-    if (strcmp("downstream_flush_interval", line) == 0) {
-        global.downstream_flush_interval = atof(value_ptr);
-    } else if (strcmp("log_level", line) == 0) {
+    if (strcmp("log_level", line) == 0) {
         global.log_level = atoi(value_ptr);
     } else if (strcmp("downstream", line) == 0) {
         return init_downstream(value_ptr);
+    } else if (strcmp("threads_num", line) == 0) {
+        global.threads_num = atoi(value_ptr);
+    } else if (strcmp("rate", line) == 0) {
+        global.rate = atof(value_ptr);
+    } else if (strcmp("duration", line) == 0) {
+        global.duration = atof(value_ptr);
+    } else if (strcmp("report_interval", line) == 0) {
+        global.report_interval = atof(value_ptr);
+    } else if (strcmp("key_cardinality", line) == 0) {
+        global.key_cardinality = atoi(value_ptr);
+    } else if (strcmp("name_length_min", line) == 0) {
+        global.name_length_min = atoi(value_ptr);
+    } else if (strcmp("name_length_max", line) == 0) {
+        global.name_length_max = atoi(value_ptr);
+    } else if (strcmp("name_prefix", line) == 0) {
+        global.name_prefix = strdup(value_ptr);
+    } else if (strcmp("type_mix", line) == 0) {
+        return init_type_mix(value_ptr);
+    } else if (strcmp("sampled_percent", line) == 0) {
+        global.sampled_percent = atoi(value_ptr);
+    } else if (strcmp("sample_rate", line) == 0) {
+        global.sample_rate = atof(value_ptr);
+    } else if (strcmp("packet_size", line) == 0) {
+        global.packet_size = atoi(value_ptr);
+    } else if (strcmp("lines_per_datagram", line) == 0) {
+        global.lines_per_datagram = atoi(value_ptr);
+    } else if (strcmp("send_batch_size", line) == 0) {
+        global.send_batch_size = atoi(value_ptr);
     } else {
         log_msg(ERROR, "%s: unknown parameter \"%s\"", __func__, line);
         return 1;
@@ -180,6 +476,63 @@ int process_config_line(char *line) {
     return 0;
 }
 
+// this function checks that config values are sane
+int verify_config(void) {
+    int failures = 0;
+    int i;
+
+    if (global.sa_in_data.sin_port == 0) {
+        failures++;
+        log_msg(ERROR, "%s: downstream is not set", __func__);
+    }
+    if (global.threads_num < 1) {
+        failures++;
+        log_msg(ERROR, "%s: threads_num should be >= 1", __func__);
+    }
+    if (global.rate < 0.0 || global.duration < 0.0 || global.report_interval <= 0.0) {
+        failures++;
+        log_msg(ERROR, "%s: rate and duration should be >= 0, report_interval should be > 0", __func__);
+    }
+    if (global.key_cardinality < 1) {
+        failures++;
+        log_msg(ERROR, "%s: key_cardinality should be >= 1", __func__);
+    }
+    if (global.name_length_min < 1 || global.name_length_max < global.name_length_min || global.name_length_max >= METRIC_NAME_SIZE) {
+        failures++;
+        log_msg(ERROR, "%s: name length should be in the 1-%d range, name_length_min <= name_length_max", __func__, METRIC_NAME_SIZE - 1);
+    }
+    global.type_weight_sum = 0;
+    for (i = 0; i < METRIC_TYPES_NUM; i++) {
+        if (global.type_weight[i] < 0) {
+            global.type_weight_sum = 0;
+            break;
+        }
+        global.type_weight_sum += global.type_weight[i];
+    }
+    if (global.type_weight_sum <= 0) {
+        failures++;
+        log_msg(ERROR, "%s: type_mix weights should be >= 0 with positive sum", __func__);
+    }
+    if (global.sampled_percent < 0 || global.sampled_percent > 100 || global.sample_rate <= 0.0 || global.sample_rate > 1.0) {
+        failures++;
+        log_msg(ERROR, "%s: sampled_percent should be in the 0-100 range, sample_rate in the (0, 1] range", __func__);
+    }
+    // single line should always fit
+    if (global.packet_size < METRIC_NAME_SIZE + 32 || global.packet_size > DOWNSTREAM_BUF_SIZE_MAX) {
+        failures++;
+        log_msg(ERROR, "%s: packet_size should be in the %d-%d range", __func__, METRIC_NAME_SIZE + 32, DOWNSTREAM_BUF_SIZE_MAX);
+    }
+    if (global.lines_per_datagram < 0) {
+        failures++;
+        log_msg(ERROR, "%s: lines_per_datagram should be >= 0", __func__);
+    }
+    if (global.send_batch_size < 1 || global.send_batch_size > SEND_BATCH_SIZE_MAX) {
+        failures++;
+        log_msg(ERROR, "%s: send_batch_size should be in the 1-%d range", __func__, SEND_BATCH_SIZE_MAX);
+    }
+    return failures;
+}
+
 // this function is called if SIGHUP is received
 void on_sighup(int sig) {
     log_msg(INFO, "%s: sighup received", __func__);
@@ -195,9 +548,26 @@ int init_config(char *filename) {
     size_t n = 0;
     int l = 0;
     int failures = 0;
-    char *buffer;
+    char *buffer = NULL;
 
     global.log_level = 0;
+    global.threads_num = 1;
+    global.rate = 0.0;
+    global.duration = 0.0;
+    global.report_interval = 1.0;
+    global.key_cardinality = 1000;
+    global.name_length_min = 20;
+    global.name_length_max = 60;
+    global.name_prefix = "test.load";
+    global.type_weight[METRIC_COUNTER] = 1;
+    global.type_weight[METRIC_GAUGE] = 0;
+    global.type_weight[METRIC_TIMER] = 0;
+    global.type_weight[METRIC_SET] = 0;
+    global.sampled_percent = 0;
+    global.sample_rate = 1.0;
+    global.packet_size = DOWNSTREAM_BUF_SIZE;
+    global.lines_per_datagram = 0;
+    global.send_batch_size = SEND_BATCH_SIZE;
     FILE *config_file = fopen(filename, "rt");
     if (config_file == NULL) {
         log_msg(ERROR, "%s: fopen() failed %s", __func__, strerror(errno));
@@ -209,13 +579,14 @@ int init_config(char *filename) {
         if (buffer[l - 1] == '\n') {
             buffer[l - 1] = 0;
         }
-        if (buffer[0] != '\n' && buffer[0] != '#') {
+        if (buffer[0] != 0 && buffer[0] != '#') {
             failures += process_config_line(buffer);
         }
     }
     // buffer is reused by getline() so we need to free it only once
     free(buffer);
     fclose(config_file);
+    failures += verify_config();
     if (failures > 0) {
         log_msg(ERROR, "%s: failed to load config file", __func__);
         return 1;
@@ -234,8 +605,9 @@ int init_config(char *filename) {
 // program entry point
 int main(int argc, char *argv[]) {
     struct ev_loop *loop = ev_default_loop(0);
-    struct ev_periodic ds_flush_timer_watcher;
-    ev_tstamp ds_flush_timer_at = 0.0;
+    struct ev_periodic report_timer_watcher;
+    struct ev_timer duration_timer_watcher;
+    int i;
 
    if (argc != 2) {
         fprintf(stdout, "Usage: %s config.file\n", argv[0]);
@@ -245,9 +617,32 @@ int main(int argc, char *argv[]) {
         log_msg(ERROR, "%s: init_config() failed", __func__);
         exit(1);
     }
+    if (init_names() != 0) {
+        log_msg(ERROR, "%s: init_names() failed", __func__);
+        exit(1);
+    }
+    if (posix_memalign((void **)&global.thread, CACHE_LINE_SIZE, global.threads_num * sizeof(struct generator_thread_s)) != 0) {
+        log_msg(ERROR, "%s: malloc() failed", __func__);
+        exit(1);
+    }
+    memset(global.thread, 0, global.threads_num * sizeof(struct generator_thread_s));
+    global.start_time = ev_time();
+    global.report_time = global.start_time;
+    for (i = 0; i < global.threads_num; i++) {
+        (global.thread + i)->index = i;
+        (global.thread + i)->random = 0x2545f4914f6cdd1dUL * (i + 1);
+        if (pthread_create(&(global.thread + i)->thread, NULL, generator_thread, (void *)(global.thread + i)) != 0) {
+            log_msg(ERROR, "%s: pthread_create() failed", __func__);
+            exit(1);
+        }
+    }
 
-    ev_periodic_init (&ds_flush_timer_watcher, ds_flush_timer_cb, ds_flush_timer_at, global.downstream_flush_interval, 0);
-    ev_periodic_start (loop, &ds_flush_timer_watcher);
+    ev_periodic_init(&report_timer_watcher, report_cb, 0.0, global.report_interval, 0);
+    ev_periodic_start(loop, &report_timer_watcher);
+    if (global.duration > 0.0) {
+        ev_timer_init(&duration_timer_watcher, duration_cb, global.duration, 0.0);
+        ev_timer_start(loop, &duration_timer_watcher);
+    }
 
     ev_loop(loop, 0);
     log_msg(ERROR, "%s: ev_loop() exited", __func__);
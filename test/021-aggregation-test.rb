@@ -0,0 +1,12 @@
+#!/usr/bin/env ruby
+
+require './statsd-router-test-lib'
+
+set_config("aggregation", 1)
+toggle_ds(0, 1, 2)
+send_data(aggregated_counter(64, 3),
+    aggregated_counter(128, 5),
+    aggregated_counter(256, 10),
+    valid_metric(64))
+toggle_ds(0)
+send_data(aggregated_counter(128, 4), aggregated_counter(128, 2))
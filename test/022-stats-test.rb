@@ -0,0 +1,18 @@
+#!/usr/bin/env ruby
+
+require './statsd-router-test-lib'
+
+# datagrams of full receive batch are given to idle thread, they should be counted anyway
+set_config("work_stealing", 1)
+set_config("recv_batch_size", 2)
+stats_check()
+toggle_ds(0, 1, 2)
+send_data(valid_metric(64), valid_metric(128), invalid_metric(64))
+send_data(valid_metric(256), invalid_metric(3))
+stats_check()
+# burst fits into default socket buffer, datagrams dropped by kernel aren't counted
+send_datagrams(*(1..60).map { [valid_metric(64), valid_metric(128)] })
+stats_check()
+toggle_ds(1)
+send_data(valid_metric(128), valid_metric(128), valid_metric(128))
+stats_check()
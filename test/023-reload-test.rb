@@ -0,0 +1,9 @@
+#!/usr/bin/env ruby
+
+require './statsd-router-test-lib'
+
+toggle_ds(0, 1, 2)
+send_data(valid_metric(128, 2), valid_metric(128), valid_metric(128, 2))
+reload_ds(2)
+send_data(valid_metric(128, 2), valid_metric(128), valid_metric(128, 2))
+send_data(valid_metric(128, 0), valid_metric(128, 1), valid_metric(128, 2))
@@ -0,0 +1,9 @@
+#!/usr/bin/env ruby
+
+require './statsd-router-test-lib'
+
+set_config("upgrade_socket", SR_UPGRADE_SOCKET)
+set_test_timeout(30)
+toggle_ds(0, 1, 2)
+upgrade_router(*(1..40).map { [valid_metric(64), valid_metric(128), invalid_metric(64), valid_metric(256)] })
+send_data(valid_metric(128), valid_metric(128), valid_metric(128))
@@ -0,0 +1,14 @@
+#!/usr/bin/env ruby
+
+require './statsd-router-test-lib'
+
+set_config("routing_mode", "compat")
+toggle_ds(0, 1, 2)
+send_data(valid_metric(64, 0), valid_metric(64, 1), valid_metric(64, 2), valid_metric(256, 1))
+toggle_ds(1)
+send_data(fallback_metric(64, 1, [1]), fallback_metric(128, 1, [1]), fallback_metric(256, 1, [1]),
+    valid_metric(64, 0), valid_metric(64, 2))
+toggle_ds(2)
+send_data(fallback_metric(64, 1, [1, 2]), fallback_metric(64, 2, [1, 2]), valid_metric(128, 0))
+toggle_ds(1)
+send_data(fallback_metric(64, 2, [2]), fallback_metric(128, 2, [2]), valid_metric(64, 1), valid_metric(64, 0))
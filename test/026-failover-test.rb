@@ -0,0 +1,12 @@
+#!/usr/bin/env ruby
+
+require './statsd-router-test-lib'
+
+# lines stay buffered for long, so downstream is marked down before they are flushed
+# they fit into one packet together with ping lines, so full buffer doesn't flush them either
+set_config("downstream_flush_interval", 10)
+set_test_timeout(50)
+toggle_ds(0, 1, 2)
+failover_ds(1, fallback_metric(64, 1, [1]), fallback_metric(256, 1, [1]), valid_metric(64, 0),
+    fallback_metric(512, 1, [1]), valid_metric(128, 2))
+send_data(fallback_metric(64, 1, [1]), valid_metric(64, 0), valid_metric(64, 2))
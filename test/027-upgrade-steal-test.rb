@@ -0,0 +1,15 @@
+#!/usr/bin/env ruby
+
+require './statsd-router-test-lib'
+
+# old router has batches offloaded to idle threads and lines passed to owner threads when it drains
+set_config("upgrade_socket", SR_UPGRADE_SOCKET)
+set_config("work_stealing", 1)
+set_config("recv_batch_size", 2)
+set_config("name_sharding", 1)
+# every invalid line of burst is expected in log
+set_config("log_rate_limit", 0)
+set_test_timeout(30)
+toggle_ds(0, 1, 2)
+upgrade_router_burst(32, *(1..640).map { [valid_metric(64), valid_metric(128), invalid_metric(64), valid_metric(256)] })
+send_data(valid_metric(128), valid_metric(128), valid_metric(128))
@@ -0,0 +1,11 @@
+#!/usr/bin/env ruby
+
+require './statsd-router-test-lib'
+
+# downstream would be marked down by health checks only after 30 seconds, refused send should do it right away
+set_config("downstream_connected_sockets", 1)
+set_config("downstream_health_down_threshold", 10)
+set_test_timeout(20)
+toggle_ds(0, 1, 2)
+kill_ds(1, fallback_metric(64, 1, [1]), fallback_metric(256, 1, [1]), valid_metric(64, 0), valid_metric(128, 2))
+send_data(fallback_metric(64, 1, [1]), valid_metric(64, 0), valid_metric(64, 2))
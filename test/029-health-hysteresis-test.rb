@@ -0,0 +1,17 @@
+#!/usr/bin/env ruby
+
+require './statsd-router-test-lib'
+
+# downstream is down for less than downstream_health_down_threshold checks, it should keep its metrics
+# downstream which was marked down should get traffic again only after downstream_health_up_threshold checks
+set_config("downstream_health_down_threshold", 3)
+set_config("downstream_health_up_threshold", 2)
+set_test_timeout(50)
+toggle_ds(0, 1, 2)
+# one or two checks fail while downstream is stopped, jitter doesn't make interval longer than flap or half of it
+flap_ds(1, SR_DS_HEALTH_CHECK_INTERVAL * 1.5)
+send_data(valid_metric(64, 1), valid_metric(256, 1), valid_metric(64, 0), valid_metric(128, 2))
+toggle_ds(1)
+toggle_ds(1)
+health_checks(1, 2)
+send_data(valid_metric(64, 1), valid_metric(64, 0), valid_metric(64, 2))
@@ -14,6 +14,8 @@ SR_DATA_PORT = 9000
 SR_CONTROL_PORT = 9001
 # location of config file for statsd router. THis config file is generated for each test run.
 SR_CONFIG_FILE = "/tmp/statsd-router.conf"
+# location of upgrade socket, new router started by upgrade test takes sockets of running one over via it
+SR_UPGRADE_SOCKET = "/tmp/statsd-router.upgrade"
 # location of statsd router executable
 SR_EXE_FILE = "../statsd-router"
 # how often statsd router checks health of downstreams
@@ -35,6 +37,8 @@ SUCCESS_EXIT_STATUS = 0
 FAILURE_EXIT_STATUS = 1
 # default test timeout value, can be changed via set_test_timeout() method
 DEFAULT_TEST_TIMEOUT = 20
+# how often datagrams are sent while new router takes over
+UPGRADE_SEND_INTERVAL = 0.05
 
 # min and max metrics length (those are processed differently than metrics with garbage content)
 MIN_METRICS_LENGTH = 6
@@ -55,6 +59,10 @@ class DataServer < EventMachine::Connection
         data.split("\n").each do |d|
             # internal metric for data loss detection is ignored
             next if d =~ /^#{SR_PING_PREFIX}/
+            # downstream removed from router config shouldn't get any data
+            if @statsd_mock.retired
+                @test_controller.abort("#{@statsd_mock.num} got data though it is removed from config")
+            end
             # let's find metric we've got in message queue
             m = StatsdRouterTest.get_message_queue().select {|x| x[:data] == d}.first
             # if metric was not found - this is error, test should be aborted
@@ -94,7 +102,7 @@ class DataServer < EventMachine::Connection
                 @test_controller.abort("Hashring problem: #{m[:hashring]}, #{h} health status: #{ds.healthy}")
             end
             # let's notify test controller, that metric was delivered successfully
-            @test_controller.notify({source: "statsd", text: d})
+            @test_controller.notify({source: "statsd", text: d, ds: @statsd_mock.num})
         end
     end
 end
@@ -111,6 +119,7 @@ class HealthServer < EventMachine::Connection
     def receive_data(data)
         send_data("health: up\n")
         @statsd_mock.last_health_check_time = Time.now.to_f
+        @statsd_mock.health_checks += 1
     end
 
     def unbind
@@ -120,12 +129,13 @@ end
 
 # umbrella class, using DataServer and HealthServer
 class StatsdMock
-    attr_accessor :last_health_check_time, :message_queue, :num, :last_start_time, :last_stop_time
-    attr_reader :test_controller
+    attr_accessor :last_health_check_time, :message_queue, :num, :last_start_time, :last_stop_time, :health_checks
+    attr_reader :test_controller, :data_port, :health_port, :retired
     @@all = []
 
     def initialize(data_port, health_port, num, test_controller)
-        @@all << self
+        # new instance can replace downstream with the same number on config reload
+        @@all[num] = self
         @num = num
         @data_port = data_port
         @health_port = health_port
@@ -133,8 +143,9 @@ class StatsdMock
         @last_health_check_time = Time.now.to_f
         @last_start_time = Time.now.to_f
         @last_stop_time = Time.now.to_f
+        @health_checks = 0
         @test_controller = test_controller
-        EventMachine::open_datagram_socket('0.0.0.0', @data_port, DataServer, self)
+        @data_server = EventMachine::open_datagram_socket('0.0.0.0', @data_port, DataServer, self)
     end
 
     def healthy
@@ -146,6 +157,8 @@ class StatsdMock
         now = Time.now.to_f
         @last_start_time = now
         @last_health_check_time = now
+        # successful health checks since start
+        @health_checks = 0
         @health_server = EventMachine::start_server('0.0.0.0', @health_port, HealthServer, @connections, self)
         puts "downstream #{@num} started" if $verbose
     end
@@ -161,6 +174,19 @@ class StatsdMock
         puts "downstream #{@num} stopped" if $verbose
     end
 
+    # downstream process is gone, its data port is closed too, so kernel answers sends with port unreachable
+    def kill
+        stop()
+        @data_server.close_connection
+        puts "downstream #{@num} killed" if $verbose
+    end
+
+    # downstream is stopped for good, it's removed from router config
+    def retire
+        stop()
+        @retired = true
+    end
+
     def get_all
         @@all
     end
@@ -192,6 +218,29 @@ class HealthClient < EM::Connection
     end
 end
 
+# helper class to read counters from control port, response is checked once it's complete
+class StatsClient < EM::Connection
+    def initialize(test_controller, format)
+        @test_controller = test_controller
+        @format = format
+        @response = ""
+    end
+
+    def receive_data(data)
+        @response += data
+        # stats connection is kept open like health one, response is complete when counters of last thread are received
+        if @format == :stats && @response =~ /^thread\.#{THREADS_NUM - 1}\.kernel_drops \d+$/
+            @test_controller.check_stats(@format, @response)
+            close_connection
+        end
+    end
+
+    # prometheus connection is closed after response
+    def unbind
+        @test_controller.check_stats(@format, @response) if @format == :prometheus
+    end
+end
+
 class StatsdRouterTest
     @@message_queue = []
 
@@ -223,20 +272,24 @@ class StatsdRouterTest
                 a[j] = a[i]
                 a[i] = k
             end
-            hash = (hash * 7 + 5) / 3
+            # router does it in unsigned long, so overflow is cut the same way
+            hash = ((hash * 7 + 5) & 0xffffffffffffffff) / 3
         end
         a.reverse
     end
 
     # this function generates valid metric of given length
-    def valid_metric(length)
-        name = "statsd-cluster.count"
-        number = rand(100).to_s
-        name_length = name.length + number.length
-        if name_length < length
-            name += ("X" * (length - name_length) + number)
-        end
-        a = hashring(name)
+    # if ds_num is set metric is owned by this downstream and it's expected to be delivered there
+    def valid_metric(length, ds_num = nil)
+        begin
+            name = "statsd-cluster.count"
+            number = rand(100).to_s
+            name_length = name.length + number.length
+            if name_length < length
+                name += ("X" * (length - name_length) + number)
+            end
+            a = hashring(name)
+        end while ds_num != nil && a[0] != ds_num
         # to simplify metric identification counter value grows from 0 to 1000, after that is reset back to 0 and so on
         @counter = (@counter + 1) % 1000
         # only counters are generated
@@ -245,7 +298,33 @@ class StatsdRouterTest
         {
             hashring: a,
             data: data,
-            event: {source: "statsd", text: data}
+            event: {source: "statsd", text: data, ds: ds_num}
+        }
+    end
+
+    # this function generates valid metric owned by downstream ds_num while downstreams of down list are dead
+    # it's expected at first alive downstream of its hashring, so placement is the same as in older releases
+    def fallback_metric(length, ds_num, down)
+        m = valid_metric(length, ds_num)
+        m[:event][:ds] = m[:hashring].find {|x| !down.include?(x)}
+        m
+    end
+
+    # this function generates counter of given length sent count times in one datagram
+    # router with aggregation enabled should pass single line with sum of values to downstream
+    def aggregated_counter(length, count)
+        @counter = (@counter + 1) % 1000
+        name = "statsd-cluster.aggregated.#{@counter}"
+        if name.length < length
+            name += "X" * (length - name.length)
+        end
+        a = hashring(name)
+        values = (1..count).to_a
+        expected = name + ":#{values.sum}|c"
+        {
+            hashring: a,
+            data: values.map {|v| name + ":#{v}|c"}.join("\n"),
+            event: {source: "statsd", text: expected}
         }
     end
 
@@ -256,7 +335,7 @@ class StatsdRouterTest
         if length < MIN_METRICS_LENGTH || length > MAX_METRICS_LENGTH
             {
                 data: data,
-                event: {source: "statsd-router", text: "WARN udp_read_cb: invalid length #{length} of metric #{data}"}
+                event: {source: "statsd-router", text: "WARN process_datagram: invalid length #{length} of metric #{data}"}
             }
         else
             {
@@ -266,33 +345,102 @@ class StatsdRouterTest
         end
     end
 
-    # this function sends data during test execution
-    def send_data_impl(*args)
-        puts "send(#{args[0]})" if $verbose
-        event_list = []
+    # this function requests counters via stats command and prometheus endpoint
+    def stats_check_impl(str)
+        @expected_events << [{source: "stats", text: "stats"}, {source: "stats", text: "prometheus"}]
+        EventMachine.connect('127.0.0.1', SR_CONTROL_PORT, StatsClient, self, :stats) do |conn|
+            conn.send_data("stats")
+        end
+        EventMachine.connect('127.0.0.1', SR_CONTROL_PORT, StatsClient, self, :prometheus) do |conn|
+            conn.send_data("GET /metrics HTTP/1.0\r\n\r\n")
+        end
+    end
+
+    # this function compares counters summed over threads with data sent so far
+    def check_stats(format, response)
+        puts "#{format}: #{response}" if $verbose
+        totals = Hash.new(0)
+        response.split("\n").each do |l|
+            if format == :stats && l =~ /^(\w+) (\d+)$/
+                totals[$1] += $2.to_i
+            elsif format == :prometheus && l =~ /^statsd_router_(\w+)_total\{thread="\d+"\} (\d+)$/
+                totals[$1] += $2.to_i
+            end
+        end
+        @sent.each do |name, value|
+            if totals[name] != value
+                abort("#{format} reports #{name} #{totals[name]}, expected #{value}")
+            end
+        end
+        notify({source: "stats", text: format.to_s})
+    end
+
+    # this function sends single datagram and registers its metrics in message queue
+    def send_datagram(metrics)
         data = []
-        args[0].each do |x|
+        @sent["datagrams"] += 1
+        metrics.each do |x|
+            lines = x[:data].split("\n").length
+            @sent["lines"] += lines
+            @sent["invalid_lines"] += lines if x[:hashring] == nil
             # if hashring is not nil this is valid metric
             if x[:hashring] != nil
+                # downstream should get expected event text, it differs from sent data for aggregated metrics
                 @@message_queue << {
                     :hashring => x[:hashring],
                     :timestamp => Time.now.to_f,
-                    :data => x[:data]
+                    :data => x[:event][:text]
                 }
             end
             data << x[:data]
-            event_list << x[:event]
         end
-        @expected_events << event_list
         @data_socket.send(data.join("\n") + "\n", 0, '127.0.0.1', SR_DATA_PORT)
     end
 
-    # this function runs actual test
-    def run()
-        # let's install signal handlers
-        Signal.trap("INT")  { EventMachine.stop }
-        Signal.trap("TERM") { EventMachine.stop }
-        # let's generate config file for statsd router
+    # this function sends data during test execution
+    def send_data_impl(*args)
+        puts "send(#{args[0]})" if $verbose
+        @expected_events << args[0].map {|x| x[:event]}
+        send_datagram(args[0])
+    end
+
+    # this function sends several datagrams back to back, so router receives them in one batch
+    def send_datagrams_impl(datagrams)
+        puts "send(#{datagrams})" if $verbose
+        @expected_events << datagrams.flatten(1).map {|x| x[:event]}
+        datagrams.each {|metrics| send_datagram(metrics)}
+    end
+
+    # this function starts new router while datagrams are sent at steady rate
+    # new router takes sockets over, old one drains and exits, every metric should be delivered once
+    # burst datagrams are sent back to back each time, so they are received in one batch
+    def upgrade_router_impl(datagrams, burst = 1)
+        puts "*** upgrade(#{datagrams.length} datagrams)" if $verbose
+        event_list = [
+            {source: "statsd-router", text: "INFO upgrade_connect: sockets of running router are taken over"},
+            {source: "statsd-router", text: "INFO upgrade_ready_cb: new router is running, draining"},
+            {source: "statsd-router", text: "INFO drain_timer_cb: buffered data is sent, exiting"}
+        ]
+        datagrams.each {|metrics| event_list.concat(metrics.map {|x| x[:event]})}
+        @expected_events << event_list
+        sent = 0
+        timer = EventMachine.add_periodic_timer(UPGRADE_SEND_INTERVAL) do
+            datagrams[sent, burst].each {|metrics| send_datagram(metrics)}
+            sent += burst
+            # new router is started once old one has some data buffered
+            if sent >= datagrams.length / 4 && sent - burst < datagrams.length / 4
+                @router = EventMachine.popen("#{SR_EXE_FILE} #{SR_CONFIG_FILE}", OutputHandler, self)
+            end
+            EventMachine.cancel_timer(timer) if sent >= datagrams.length
+        end
+    end
+
+    def upgrade_router_burst_impl(args)
+        upgrade_router_impl(args.drop(1), args[0])
+    end
+
+    # this function generates config file for statsd router, downstreams are taken from current statsd instances
+    def write_config()
         File.open(SR_CONFIG_FILE, "w") do |f|
             f.puts("log_level=1")
             f.puts("data_port=#{SR_DATA_PORT}")
@@ -302,8 +450,16 @@ class StatsdRouterTest
             f.puts("downstream_ping_interval=#{SR_DS_PING_INTERVAL}")
             f.puts("ping_prefix=#{SR_PING_PREFIX}")
             f.puts("threads_num=#{THREADS_NUM}")
-            f.puts("downstream=#{(0...DOWNSTREAM_NUM).to_a.map {|x| BASE_DS_PORT + 2 * x}.map {|x| "127.0.0.1:#{x}:#{x + 1}"}.join(',')}")
+            f.puts("downstream=#{@downstream.map {|ds| "127.0.0.1:#{ds.data_port}:#{ds.health_port}"}.join(',')}")
+            @config.each {|name, value| f.puts("#{name}=#{value}")}
         end
+    end
+
+    # this function runs actual test
+    def run()
+        # let's install signal handlers
+        Signal.trap("INT")  { EventMachine.stop }
+        Signal.trap("TERM") { EventMachine.stop }
         @downstream = []
         # socket for sending data
         @data_socket = UDPSocket.new
@@ -314,8 +470,9 @@ class StatsdRouterTest
                 sm = StatsdMock.new(BASE_DS_PORT + 2 * i, BASE_DS_PORT + 2 * i + 1, i, self)
                 @downstream << sm
             end
+            write_config()
             # start statsd router
-            EventMachine.popen("#{SR_EXE_FILE} #{SR_CONFIG_FILE}", OutputHandler, self)
+            @router = EventMachine.popen("#{SR_EXE_FILE} #{SR_CONFIG_FILE}", OutputHandler, self)
             sleep 1
             # and set timer to interrupt test in case of timeout
             EventMachine.add_timer(@timeout) do
@@ -349,8 +506,15 @@ class StatsdRouterTest
         @test_sequence = []
         @expected_events = []
         @counter = 0
+        # number of downstreams replaced by reload, their replacements get next free ports
+        @replaced_num = 0
         @timeout = DEFAULT_TEST_TIMEOUT
         @health_response = "health: up"
+        # extra config parameters set by test
+        @config = {}
+        # counters router should report for data sent by test
+        # dropped_lines isn't checked, ping lines are dropped if ping fires before downstreams are up
+        @sent = {"datagrams" => 0, "lines" => 0, "invalid_lines" => 0}
     end
 
     # this function is used to notify test of external events
@@ -365,7 +529,7 @@ class StatsdRouterTest
         end
         # if we've got expected event we remove it from the list
         event_list.each do |e|
-            if e[:source] == event[:source] && event[:text].end_with?(e[:text])
+            if e[:source] == event[:source] && event[:text].end_with?(e[:text]) && (e[:ds] == nil || e[:ds] == event[:ds])
                 event_list.delete(e)
             end
         end
@@ -410,6 +574,95 @@ class StatsdRouterTest
         end
     end
 
+    # function to stop downstream right after data is sent, so router has lines buffered for it
+    # buffered lines should be rerouted to alive downstreams and delivered once
+    # router flushes at multiples of flush interval, data is sent right after flush, so it stays buffered till downstream is marked down
+    def failover_ds_impl(args)
+        ds_num = args[0]
+        metrics = args[1..-1]
+        puts "*** failover(#{ds_num}, #{metrics})" if $verbose
+        if @downstream[ds_num] == nil || !@downstream[ds_num].healthy
+            abort("Invalid downstream #{ds_num}")
+        end
+        @expected_events << metrics.map {|x| x[:event]} + [{source: "statsd-router", text: "DEBUG ds_mark_down downstream #{ds_num} is down"}]
+        interval = @config.fetch("downstream_flush_interval", SR_DS_FLUSH_INTERVAL).to_f
+        EventMachine.add_timer(interval - Time.now.to_f % interval + 0.2) do
+            send_datagram(metrics)
+            @downstream[ds_num].stop()
+        end
+    end
+
+    # function to stop downstream for a while and start it again
+    # downstream should be started before router marks it down, so it keeps getting its metrics
+    def flap_ds_impl(args)
+        ds_num, duration = args
+        puts "*** flap(#{ds_num}, #{duration})" if $verbose
+        if @downstream[ds_num] == nil || !@downstream[ds_num].healthy
+            abort("Invalid downstream #{ds_num}")
+        end
+        @expected_events << [{source: "test", text: "downstream #{ds_num} is flapped"}]
+        @downstream[ds_num].stop()
+        EventMachine.add_timer(duration) do
+            @downstream[ds_num].start()
+            notify({source: "test", text: "downstream #{ds_num} is flapped"})
+        end
+    end
+
+    # function to check how many health checks downstream answered since it was started
+    # it's called right after router marked downstream up, so it checks that up threshold was respected
+    def health_checks_impl(args)
+        ds_num, min = args
+        puts "*** health_checks(#{ds_num}, #{min})" if $verbose
+        if @downstream[ds_num].health_checks < min
+            abort("#{ds_num} is up after #{@downstream[ds_num].health_checks} health checks, expected #{min}")
+        end
+        advance_test_sequence()
+    end
+
+    # function to kill downstream, router should learn it from refused send before health check fails
+    # first send to closed port is lost, port unreachable is reported by the next one
+    # so probe line is sent right away and metrics are sent once probe is flushed, they should be rerouted
+    def kill_ds_impl(args)
+        ds_num = args[0]
+        metrics = args[1..-1]
+        puts "*** kill(#{ds_num}, #{metrics})" if $verbose
+        if @downstream[ds_num] == nil || !@downstream[ds_num].healthy
+            abort("Invalid downstream #{ds_num}")
+        end
+        @expected_events << metrics.map {|x| x[:event]} + [
+            {source: "statsd-router", text: "INFO ds_health_refused_cb: downstream #{ds_num} refused data"},
+            {source: "statsd-router", text: "DEBUG ds_mark_down downstream #{ds_num} is down"}
+        ]
+        @downstream[ds_num].kill()
+        send_datagram([valid_metric(64, ds_num)])
+        EventMachine.add_timer(SR_DS_FLUSH_INTERVAL * 1.5) do
+            send_datagram(metrics)
+        end
+    end
+
+    # function to replace downstreams with new statsd instances and reload router config
+    # new instances listen on ports next to the ones of existing instances, replaced ones shouldn't get data any more
+    def reload_ds_impl(ds_list)
+        puts "*** reload(#{ds_list})" if $verbose
+        event_list = [{source: "statsd-router", text: "INFO reload_signal_cb: config reloaded, #{DOWNSTREAM_NUM} downstreams"}]
+        ds_list.each do |ds_num|
+            if @downstream[ds_num] == nil
+                abort("Invalid downstream #{ds_num}")
+            end
+            @downstream[ds_num].retire()
+            port = BASE_DS_PORT + 2 * (DOWNSTREAM_NUM + @replaced_num)
+            @replaced_num += 1
+            ds = StatsdMock.new(port, port + 1, ds_num, self)
+            ds.start()
+            @downstream[ds_num] = ds
+            # new downstream gets traffic after first successful health check
+            event_list << {source: "statsd-router", text: "DEBUG ds_health_read_cb downstream #{ds_num} is up"}
+        end
+        @expected_events << event_list
+        write_config()
+        Process.kill("HUP", EventMachine.get_subprocess_pid(@router.signature))
+    end
+
     def test_sequence
         @test_sequence
     end
@@ -417,6 +670,10 @@ class StatsdRouterTest
     def set_test_timeout(t)
         @timeout = t
     end
+
+    def set_config(name, value)
+        @config[name] = value
+    end
 end
 
 @srt = StatsdRouterTest.new
@@ -429,8 +686,20 @@ def set_test_timeout(t)
     @srt.set_test_timeout(t)
 end
 
-def valid_metric(n)
-    @srt.valid_metric(n)
+def set_config(name, value)
+    @srt.set_config(name, value)
+end
+
+def aggregated_counter(n, count)
+    @srt.aggregated_counter(n, count)
+end
+
+def valid_metric(n, ds_num = nil)
+    @srt.valid_metric(n, ds_num)
+end
+
+def fallback_metric(n, ds_num, down)
+    @srt.fallback_metric(n, ds_num, down)
 end
 
 def invalid_metric(n)
@@ -441,10 +710,46 @@ def toggle_ds(*args)
     @srt.test_sequence << [:toggle_ds_impl, args]
 end
 
+def flap_ds(*args)
+    @srt.test_sequence << [:flap_ds_impl, args]
+end
+
+def health_checks(*args)
+    @srt.test_sequence << [:health_checks_impl, args]
+end
+
+def kill_ds(*args)
+    @srt.test_sequence << [:kill_ds_impl, args]
+end
+
+def failover_ds(*args)
+    @srt.test_sequence << [:failover_ds_impl, args]
+end
+
+def reload_ds(*args)
+    @srt.test_sequence << [:reload_ds_impl, args]
+end
+
+def upgrade_router(*args)
+    @srt.test_sequence << [:upgrade_router_impl, args]
+end
+
+def upgrade_router_burst(burst, *args)
+    @srt.test_sequence << [:upgrade_router_burst_impl, [burst] + args]
+end
+
 def send_data(*args)
     @srt.test_sequence << [:send_data_impl, args]
 end
 
+def send_datagrams(*args)
+    @srt.test_sequence << [:send_datagrams_impl, args]
+end
+
+def stats_check()
+    @srt.test_sequence << [:stats_check_impl, nil]
+end
+
 def health_check(str)
     @srt.test_sequence << [:health_check_impl, str]
 end